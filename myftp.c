@@ -10,9 +10,23 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <glob.h>
 
 #include "myftp.h"
 
+static struct line_reader reply_reader;
+static int persistent_sock = -1;
+static int persistent_supported = 1;
+static int stripe_streams = 1;
+static size_t stripe_chunk = IO_CHUNK_SIZE;
+static int compress_level = 0;
+static int verify_checksums = 0;
+static int delta_sync = 0;
+static int chunked_puts = 0;
+static const char *durability = NULL;
+static int data_buffer = 0;
+
 int connect_to_server(const char* hostname, int port) {
 	int sockfd;
     struct sockaddr_in server_addr;
@@ -42,23 +56,69 @@ int connect_to_server(const char* hostname, int port) {
         exit(EXIT_FAILURE);
     }
 
+    sock_control(sockfd);
+    line_reader_init(&reply_reader, sockfd);
     return sockfd;
 }
 
+int read_reply(int control_sock, char *buffer, size_t buffer_size) {
+    if (reply_reader.fd != control_sock) {
+        line_reader_init(&reply_reader, control_sock);
+    }
+    return read_line(&reply_reader, buffer, buffer_size);
+}
+
+int connect_data_port(const char *server_address, int port) {
+    int data_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (data_sock < 0) {
+        fprintf(stderr, "Error: Unable to create data socket\n");
+        return -1;
+    }
+
+    struct sockaddr_in data_addr;
+    struct hostent *server = gethostbyname(server_address);
+    if (server == NULL) {
+        fprintf(stderr, "Error: Unable to resolve server address: %s\n", server_address);
+        close(data_sock);
+        return -1;
+    }
+
+    memset(&data_addr, 0, sizeof(data_addr));
+    data_addr.sin_family = AF_INET;
+    memcpy(&data_addr.sin_addr.s_addr, server->h_addr, server->h_length);
+    data_addr.sin_port = htons(port);
+
+    if (connect(data_sock, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0) {
+        fprintf(stderr, "Error: Unable to connect to data port\n");
+        close(data_sock);
+        return -1;
+    }
+
+    return data_sock;
+}
+
 int setup_data_connection(int control_sock, const char *server_address) {
-    if (write(control_sock, "D\n", 2) < 0) {
+    if (persistent_sock >= 0) {
+        return persistent_sock;
+    }
+
+    /* Ask for a persistent data connection first; older servers only know D. */
+    const char *request = persistent_supported ? "K\n" : "D\n";
+    if (write(control_sock, request, 2) < 0) {
         fprintf(stderr, "Error: Unable to send data connection request\n");
         return -1;
     }
 
     char buffer[BUFFER_SIZE];
-    int bytes_read = read(control_sock, buffer, sizeof(buffer) - 1);
-    if (bytes_read <= 0) {
+    if (read_reply(control_sock, buffer, sizeof(buffer)) < 0) {
         fprintf(stderr, "Error: Unable to read server response for data connection\n");
         return -1;
     }
 
-    buffer[bytes_read] = '\0';
+    if (persistent_supported && buffer[0] == 'E') {
+        persistent_supported = 0;
+        return setup_data_connection(control_sock, server_address);
+    }
 
     if (buffer[0] != 'A' || strlen(buffer) <= 1) {
         fprintf(stderr, "Error: Invalid or missing port in server response: %s\n", buffer);
@@ -71,38 +131,473 @@ int setup_data_connection(int control_sock, const char *server_address) {
         return -1;
     }
 
-    int data_sock = socket(AF_INET, SOCK_STREAM, 0);
+    int data_sock = connect_data_port(server_address, port);
     if (data_sock < 0) {
-        fprintf(stderr, "Error: Unable to create data socket\n");
         return -1;
     }
+    sock_data(data_sock, data_buffer);
 
-    struct sockaddr_in data_addr;
-    struct hostent *server = gethostbyname(server_address);
-    if (server == NULL) {
-        fprintf(stderr, "Error: Unable to resolve server address: %s\n", server_address);
-        close(data_sock);
+    if (persistent_supported) {
+        persistent_sock = data_sock;
+    }
+    return data_sock;
+}
+
+int setup_striped_connection(int control_sock, const char *server_address, int *socks) {
+    char buffer[BUFFER_SIZE];
+    snprintf(buffer, sizeof(buffer), "W%d %zu\n", stripe_streams, stripe_chunk);
+    if (write(control_sock, buffer, strlen(buffer)) < 0 ||
+        read_reply(control_sock, buffer, sizeof(buffer)) < 0) {
+        fprintf(stderr, "Error: Unable to request striped data connection\n");
         return -1;
     }
 
-    memset(&data_addr, 0, sizeof(data_addr));
-    data_addr.sin_family = AF_INET;
-    memcpy(&data_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-    data_addr.sin_port = htons(port);
+    int port = buffer[0] == 'A' ? atoi(buffer + 1) : 0;
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "Error: Server refused striped transfer, using one stream: %s\n", buffer);
+        stripe_streams = 1;
+        return -1;
+    }
 
-    if (connect(data_sock, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0) {
-        fprintf(stderr, "Error: Unable to connect to data port\n");
-        close(data_sock);
+    for (int i = 0; i < stripe_streams; i++) {
+        socks[i] = connect_data_port(server_address, port);
+        if (socks[i] < 0) {
+            while (--i >= 0) {
+                close(socks[i]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+off_t remote_size(int control_sock, const char *filename) {
+    char command[BUFFER_SIZE];
+    char reply[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "I%s\n", filename);
+    if (write(control_sock, command, strlen(command)) < 0 ||
+        read_reply(control_sock, reply, sizeof(reply)) < 0 || reply[0] != 'A' || reply[1] == '\0') {
         return -1;
     }
+    return strtoll(reply + 1, NULL, 10);
+}
 
-    return data_sock;
+int remote_checksum(int control_sock, const char *filename, uint32_t *crc, char *reply, size_t size) {
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "H%s\n", filename);
+    if (write(control_sock, command, strlen(command)) < 0 ||
+        read_reply(control_sock, reply, size) < 0 || reply[0] != 'A' || reply[1] == '\0') {
+        return -1;
+    }
+    *crc = strtoul(reply + 1, NULL, 16);
+    return 0;
+}
+
+/* Prints the server's CRC32C of filename and checks the local copy, if any, against it. */
+void checksum(int control_sock, const char *filename) {
+    if (filename == NULL || strlen(filename) == 0) {
+        fprintf(stderr, "Error: Usage: sum <filename>\n");
+        return;
+    }
+
+    uint32_t remote, local;
+    char reply[BUFFER_SIZE];
+    if (remote_checksum(control_sock, filename, &remote, reply, sizeof(reply)) < 0) {
+        fprintf(stderr, "Error: Server failed to checksum %s: %s\n", filename, reply);
+        return;
+    }
+
+    int file_fd = open(filename, O_RDONLY);
+    if (file_fd < 0) {
+        printf("%08x  %s (server)\n", remote, filename);
+        return;
+    }
+    int status = crc32c_file(file_fd, &local);
+    close(file_fd);
+    if (status < 0) {
+        fprintf(stderr, "Error: Unable to read local file: %s\n", filename);
+    } else if (local != remote) {
+        fprintf(stderr, "Error: Checksum mismatch for %s: local %08x, server %08x\n", filename, local, remote);
+    } else {
+        printf("%08x  %s verified\n", local, filename);
+    }
+}
+
+/* The server's CRC32C of filename's first length bytes (O), or -1. */
+int remote_prefix_checksum(int control_sock, const char *filename, off_t length, uint32_t *crc) {
+    char command[BUFFER_SIZE];
+    char reply[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "O%lld %s\n", (long long)length, filename);
+    if (write(control_sock, command, strlen(command)) < 0 ||
+        read_reply(control_sock, reply, sizeof(reply)) < 0 || reply[0] != 'A' || reply[1] == '\0') {
+        return -1;
+    }
+    *crc = strtoul(reply + 1, NULL, 16);
+    return 0;
+}
+
+/*
+ * Compare a partial file with its counterpart and, if the receiving side
+ * holds a shorter copy whose bytes match the start of the other (same
+ * CRC32C over them on both sides), send R so the next G/P resumes there.
+ * A put's partial copy is the staging file an interrupted put left on the
+ * server, not the file it replaces.  Returns the offset to start from; 0
+ * sends the whole file.  A copy of the same size is sent again: equal
+ * sizes say nothing about contents.
+ */
+off_t resume_offset(int control_sock, const char *filename, off_t local_size, int download) {
+    char part[BUFFER_SIZE];
+    const char *remote_name = filename;
+
+    if (local_size <= 0) {
+        return 0;
+    }
+    if (!download) {
+        if (upload_part_name(filename, part, sizeof(part)) < 0) {
+            return 0;
+        }
+        remote_name = part;
+    }
+
+    off_t remote = remote_size(control_sock, remote_name);
+    off_t have = download ? local_size : remote;
+    off_t want = download ? remote : local_size;
+    if (remote < 0 || have <= 0 || have >= want) {
+        return 0;
+    }
+
+    uint32_t local_crc, remote_crc;
+    int file_fd = open(filename, O_RDONLY);
+    int status = file_fd < 0 ? -1 : crc32c_prefix(file_fd, have, &local_crc);
+    if (file_fd >= 0) {
+        close(file_fd);
+    }
+    if (status < 0 || remote_prefix_checksum(control_sock, remote_name, have, &remote_crc) < 0 ||
+        local_crc != remote_crc) {
+        return 0;
+    }
+
+    char command[64];
+    char reply[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "R%lld\n", (long long)have);
+    if (write(control_sock, command, strlen(command)) < 0 ||
+        read_reply(control_sock, reply, sizeof(reply)) < 0 || reply[0] != 'A') {
+        return 0;
+    }
+    printf("Resuming %s at byte %lld\n", filename, (long long)have);
+    return have;
+}
+
+/* Asks for compression of the next transfer; returns the level in effect or -1. */
+int request_compression(int control_sock) {
+    if (compress_level == 0) {
+        return 0;
+    }
+
+    char command[32];
+    char reply[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "Y%d\n", compress_level);
+    if (write(control_sock, command, strlen(command)) < 0 ||
+        read_reply(control_sock, reply, sizeof(reply)) < 0) {
+        fprintf(stderr, "Error: Failed to send compression request\n");
+        return -1;
+    }
+    if (reply[0] != 'A') {
+        fprintf(stderr, "Error: Server refused compression, sending uncompressed: %s\n", reply);
+        compress_level = 0;
+    }
+    return compress_level;
+}
+
+/* Asks for the next put to be committed as -f says; returns 1 if a commit reply will follow, -1 on error. */
+int request_durability(int control_sock) {
+    if (durability == NULL) {
+        return 0;
+    }
+
+    char command[32];
+    char reply[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "F%s\n", durability);
+    if (write(control_sock, command, strlen(command)) < 0 ||
+        read_reply(control_sock, reply, sizeof(reply)) < 0) {
+        fprintf(stderr, "Error: Failed to send durability request\n");
+        return -1;
+    }
+    if (reply[0] != 'A') {
+        fprintf(stderr, "Error: Server refused durability mode, not waiting for commits: %s\n", reply);
+        durability = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/* Reads the reply that ends a put sent after F. */
+void commit_result(int control_sock, const char *filename) {
+    char reply[BUFFER_SIZE];
+    if (read_reply(control_sock, reply, sizeof(reply)) < 0) {
+        fprintf(stderr, "Error: Lost the server before %s was committed\n", filename);
+    } else if (reply[0] != 'A') {
+        fprintf(stderr, "Error: Server failed to commit %s: %s\n", filename, reply);
+    }
+}
+
+off_t local_file_size(const char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+}
+
+void transfer_striped(int control_sock, const char *server_address, const char *filename, int download) {
+    int socks[MAX_STREAMS];
+    int streams = stripe_streams;
+    int file_fd = -1;
+    off_t offset;
+    off_t size = -1;
+    struct stat st;
+
+    if (download) {
+        /* The stripes are checked against the size the server has now. */
+        size = remote_size(control_sock, filename);
+        offset = resume_offset(control_sock, filename, local_file_size(filename), 1);
+    } else {
+        file_fd = open(filename, O_RDONLY);
+        if (file_fd < 0 || fstat(file_fd, &st) < 0) {
+            fprintf(stderr, "Error: Unable to open local file for reading: %s\n", filename);
+            if (file_fd >= 0) {
+                close(file_fd);
+            }
+            return;
+        }
+
+        char size_command[64];
+        char size_ack[BUFFER_SIZE];
+        snprintf(size_command, sizeof(size_command), "Z%lld\n", (long long)st.st_size);
+        if (write(control_sock, size_command, strlen(size_command)) < 0 ||
+            read_reply(control_sock, size_ack, sizeof(size_ack)) < 0) {
+            fprintf(stderr, "Error: Failed to send file size\n");
+            close(file_fd);
+            return;
+        }
+        offset = resume_offset(control_sock, filename, st.st_size, 0);
+    }
+
+    if (setup_striped_connection(control_sock, server_address, socks) < 0) {
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        if (stripe_streams == 1) {
+            if (download) {
+                get(control_sock, server_address, filename);
+            } else {
+                put(control_sock, server_address, filename);
+            }
+        }
+        return;
+    }
+
+    char command[BUFFER_SIZE];
+    char ack_buffer[BUFFER_SIZE] = "";
+    int status = -1;
+    int commit = download ? 0 : request_durability(control_sock);
+    snprintf(command, sizeof(command), "%c%s\n", download ? 'G' : 'P', filename);
+    if (commit < 0 || write(control_sock, command, strlen(command)) < 0 ||
+        read_reply(control_sock, ack_buffer, sizeof(ack_buffer)) < 0 || ack_buffer[0] != 'A') {
+        fprintf(stderr, "Error: Server failed to acknowledge %s command: %s\n", download ? "get" : "put", ack_buffer);
+        commit = 0;
+    } else {
+        if (download) {
+            file_fd = open(filename, offset > 0 ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (file_fd < 0) {
+                fprintf(stderr, "Error: Unable to open local file for writing: %s\n", filename);
+            }
+        }
+        if (file_fd >= 0) {
+            status = download ? receive_file_striped(socks, streams, file_fd, stripe_chunk, offset, size)
+                              : send_file_striped(socks, streams, file_fd, stripe_chunk, offset);
+            if (status < 0) {
+                fprintf(stderr, "Error: Striped transfer of %s failed\n", filename);
+            }
+        }
+    }
+
+    for (int i = 0; i < streams; i++) {
+        close(socks[i]);
+    }
+    if (file_fd >= 0) {
+        close(file_fd);
+    }
+    if (commit > 0) {
+        commit_result(control_sock, filename);
+    }
+    if (status == 0 && verify_checksums) {
+        checksum(control_sock, filename);
+    }
+}
+
+/*
+ * Moves only what changed: for a download the local copy is the basis and
+ * the server sends a delta against it (V), for an upload the server's copy
+ * is the basis (U).  The download is rebuilt beside the file and renamed
+ * over it once its checksum matches.
+ */
+void transfer_delta(int control_sock, const char *server_address, const char *filename, int download) {
+    char temp[BUFFER_SIZE];
+    int file_fd = download ? delta_temp_file(AT_FDCWD, filename, temp, sizeof(temp)) : open(filename, O_RDONLY);
+    if (file_fd < 0) {
+        fprintf(stderr, "Error: Unable to open local file for %s: %s\n", download ? "writing" : "reading", filename);
+        return;
+    }
+
+    int data_sock = setup_data_connection(control_sock, server_address);
+    char command[BUFFER_SIZE];
+    char ack_buffer[BUFFER_SIZE];
+    struct delta_stats stats = { 0, 0 };
+    int status = -1;
+
+    snprintf(command, sizeof(command), "%c%s\n", download ? 'V' : 'U', filename);
+    if (data_sock < 0) {
+        fprintf(stderr, "Error: Failed to establish data connection\n");
+    } else if (write(control_sock, command, strlen(command)) < 0) {
+        fprintf(stderr, "Error: Failed to send %s command\n", download ? "get" : "put");
+        close_data_connection(data_sock, -1);
+    } else if (read_reply(control_sock, ack_buffer, sizeof(ack_buffer)) < 0 || ack_buffer[0] != 'A') {
+        fprintf(stderr, "Error: Server failed to acknowledge %s command: %s\n", download ? "get" : "put", ack_buffer);
+        close_data_connection(data_sock, 0);
+    } else {
+        int framed = data_connection_framed(data_sock);
+        status = download ? delta_rebuild(data_sock, framed, AT_FDCWD, filename, file_fd, temp, &stats)
+                          : delta_send(data_sock, framed, file_fd, &stats);
+        if (status < 0) {
+            fprintf(stderr, "Error: Delta transfer of %s failed\n", filename);
+        } else {
+            printf("%s: %lld bytes sent, %lld bytes reused\n", filename,
+                   (long long)stats.literal, (long long)stats.matched);
+        }
+        close_data_connection(data_sock, status);
+    }
+
+    if (download && status < 0) {
+        unlink(temp);
+    }
+    close(file_fd);
+    if (status == 0 && verify_checksums) {
+        checksum(control_sock, filename);
+    }
+}
+
+/*
+ * Uploads through the server's chunk store (X): only the chunks of the file
+ * the store does not hold yet are sent.  Returns -1 without transferring
+ * anything if the server has no store, so the caller can put the file whole.
+ */
+int transfer_chunked(int control_sock, const char *server_address, const char *filename) {
+    int file_fd = open(filename, O_RDONLY);
+    if (file_fd < 0) {
+        fprintf(stderr, "Error: Unable to open local file for reading: %s\n", filename);
+        return 0;
+    }
+
+    int data_sock = setup_data_connection(control_sock, server_address);
+    char command[BUFFER_SIZE];
+    char ack_buffer[BUFFER_SIZE];
+    struct delta_stats stats = { 0, 0 };
+    int status = -1;
+
+    snprintf(command, sizeof(command), "X%s\n", filename);
+    if (data_sock < 0) {
+        fprintf(stderr, "Error: Failed to establish data connection\n");
+    } else if (write(control_sock, command, strlen(command)) < 0) {
+        fprintf(stderr, "Error: Failed to send put command\n");
+        close_data_connection(data_sock, -1);
+    } else if (read_reply(control_sock, ack_buffer, sizeof(ack_buffer)) < 0 || ack_buffer[0] != 'A') {
+        close_data_connection(data_sock, 0);
+        if (strncmp(ack_buffer, "E No chunk store", 16) == 0) {
+            close(file_fd);
+            return -1;
+        }
+        fprintf(stderr, "Error: Server failed to acknowledge put command: %s\n", ack_buffer);
+    } else {
+        status = store_send(data_sock, data_connection_framed(data_sock), file_fd, &stats);
+        if (status < 0) {
+            fprintf(stderr, "Error: Chunked upload of %s failed\n", filename);
+        } else {
+            printf("%s: %lld bytes sent, %lld bytes reused\n", filename,
+                   (long long)stats.literal, (long long)stats.matched);
+        }
+        close_data_connection(data_sock, status);
+    }
+
+    close(file_fd);
+    if (status == 0 && verify_checksums) {
+        checksum(control_sock, filename);
+    }
+    return 0;
+}
+
+int data_connection_framed(int data_sock) {
+    return data_sock == persistent_sock;
+}
+
+void close_data_connection(int data_sock, int status) {
+    if (data_sock == persistent_sock) {
+        if (status == 0) {
+            return;
+        }
+        persistent_sock = -1;
+    }
+    close(data_sock);
+}
+
+int page_data(int data_sock, int compressed) {
+    int framed = data_connection_framed(data_sock) || compressed;
+    int pipe_fd[2];
+    int status = 0;
+
+    if (framed && pipe(pipe_fd) < 0) {
+        fprintf(stderr, "Error: pipe failed\n");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error: fork failed\n");
+        if (framed) {
+            close(pipe_fd[0]);
+            close(pipe_fd[1]);
+        }
+        return -1;
+    }
+
+    if (pid == 0) {
+        if (dup2(framed ? pipe_fd[0] : data_sock, STDIN_FILENO) < 0) {
+            fprintf(stderr, "Error: dup2 failed\n");
+            exit(EXIT_FAILURE);
+        }
+        close(data_sock);
+        if (framed) {
+            close(pipe_fd[0]);
+            close(pipe_fd[1]);
+        }
+        execlp("more", "more", "-20", NULL);
+        fprintf(stderr, "Error: execlp failed for more\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (framed) {
+        close(pipe_fd[0]);
+        status = compressed ? receive_compressed(pipe_fd[1], data_sock) : receive_framed(pipe_fd[1], data_sock);
+        close(pipe_fd[1]);
+    }
+    wait(NULL);
+    return status;
 }
 
 void exit_command(int control_sock) {
     if (write(control_sock, "Q\n", 2) < 0) {
         fprintf(stderr, "Error: Unable to send quit command to server\n");
     }
+    if (persistent_sock >= 0) {
+        close(persistent_sock);
+    }
     close(control_sock);
     exit(0);
 }
@@ -131,9 +626,7 @@ void rcd(int control_sock, const char *pathname) {
         return;
     }
 
-    memset(buffer, 0, sizeof(buffer));
-    int bytes_read = read(control_sock, buffer, sizeof(buffer) - 1);
-    if (bytes_read <= 0) {
+    if (read_reply(control_sock, buffer, sizeof(buffer)) < 0) {
         fprintf(stderr, "Error: No response from server for rcd command\n");
         return;
     }
@@ -148,149 +641,150 @@ void rcd(int control_sock, const char *pathname) {
 }
 
 void ls() {
+    struct dir_lister *lister = dir_lister_open(AT_FDCWD, NULL, LIST_LONG, 0, -1);
+    if (lister == NULL) {
+        fprintf(stderr, "Error: Unable to read directory: %s\n", strerror(errno));
+        return;
+    }
+
     int pipe_fd[2];
     if (pipe(pipe_fd) < 0) {
         fprintf(stderr, "Error: pipe failed\n");
+        dir_lister_close(lister);
         return;
     }
 
     pid_t pid = fork();
     if (pid < 0) {
-        fprintf(stderr, "Error: fork failed\n");
+        fprintf(stderr, "Error: fork failed for more\n");
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+        dir_lister_close(lister);
         return;
     }
 
     if (pid == 0) {
-        close(pipe_fd[0]);
-        if (dup2(pipe_fd[1], STDOUT_FILENO) < 0) {
-            fprintf(stderr, "Error: dup2 failed for STDOUT\n");
+        if (dup2(pipe_fd[0], STDIN_FILENO) < 0) {
+            fprintf(stderr, "Error: dup2 failed for STDIN\n");
             exit(EXIT_FAILURE);
         }
+        close(pipe_fd[0]);
         close(pipe_fd[1]);
-        execlp("ls", "ls", "-l", NULL);
-        fprintf(stderr, "Error: execlp failed for ls\n");
+        execlp("more", "more", "-20", NULL);
+        fprintf(stderr, "Error: execlp failed for more\n");
         exit(EXIT_FAILURE);
-    } else {
-        close(pipe_fd[1]);
-        pid_t more_pid = fork();
-        if (more_pid < 0) {
-            fprintf(stderr, "Error: fork failed for more\n");
-            close(pipe_fd[0]);
-            return;
-        }
-
-        if (more_pid == 0) {
-            if (dup2(pipe_fd[0], STDIN_FILENO) < 0) {
-                fprintf(stderr, "Error: dup2 failed for STDIN\n");
-                exit(EXIT_FAILURE);
-            }
-            close(pipe_fd[0]);
-            execlp("more", "more", "-20", NULL);
-            fprintf(stderr, "Error: execlp failed for more\n");
-            exit(EXIT_FAILURE);
-        } else {
-            close(pipe_fd[0]);
-            wait(NULL);
-        }
-
-        wait(NULL);
     }
+
+    /* The listing is produced here and streamed to more as it is formatted. */
+    close(pipe_fd[0]);
+    send_listing(pipe_fd[1], lister, 0);
+    close(pipe_fd[1]);
+    dir_lister_close(lister);
+    wait(NULL);
 }
 
-void rls(int control_sock, const char *server_address) {
+/* Pages the data a listing-style command (L or S) sends before its reply. */
+void page_remote(int control_sock, const char *server_address, const char *command, const char *what) {
     int data_sock = setup_data_connection(control_sock, server_address);
     if (data_sock < 0) {
         fprintf(stderr, "Error: Failed to establish data connection\n");
         return;
     }
 
-    if (write(control_sock, "L\n", 2) < 0) {
-        fprintf(stderr, "Error: Failed to send rls command\n");
-        close(data_sock);
+    if (write(control_sock, command, strlen(command)) < 0) {
+        fprintf(stderr, "Error: Failed to send %s command\n", what);
+        close_data_connection(data_sock, -1);
         return;
     }
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        fprintf(stderr, "Error: fork failed\n");
-        close(data_sock);
-        return;
-    }
+    close_data_connection(data_sock, page_data(data_sock, 0));
 
-    if (pid == 0) {
-        if (dup2(data_sock, STDIN_FILENO) < 0) {
-            fprintf(stderr, "Error: dup2 failed\n");
-            exit(EXIT_FAILURE);
-        }
-        close(data_sock);
-        execlp("more", "more", "-20", NULL);
-        fprintf(stderr, "Error: execlp failed for more\n");
-        exit(EXIT_FAILURE);
-    } else {
-        close(data_sock);
-        wait(NULL);
-    }
-
-    char buffer[BUFFER_SIZE] = {0};
-    int bytes_read = read(control_sock, buffer, sizeof(buffer) - 1);
-    if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
-    } else {
+    char buffer[BUFFER_SIZE];
+    if (read_reply(control_sock, buffer, sizeof(buffer)) < 0) {
         fprintf(stderr, "Error: Failed to read server acknowledgment\n");
+    } else if (buffer[0] == 'E') {
+        fprintf(stderr, "Error: Server failed to %s: %s\n",
+                command[0] == 'S' ? "report statistics" : "list directory", buffer);
     }
 }
 
+void rls(int control_sock, const char *server_address, const char *page) {
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "L%s\n", page);
+    page_remote(control_sock, server_address, command, "rls");
+}
+
+void stats(int control_sock, const char *server_address) {
+    page_remote(control_sock, server_address, "S\n", "stats");
+}
+
 void get(int control_sock, const char *server_address, const char *filename) {
     if (filename == NULL || strlen(filename) == 0) {
         fprintf(stderr, "Error: Usage: get <filename>\n");
         return;
     }
 
+    if (delta_sync && local_file_size(filename) > 0) {
+        transfer_delta(control_sock, server_address, filename, 1);
+        return;
+    }
+
+    if (stripe_streams > 1) {
+        transfer_striped(control_sock, server_address, filename, 1);
+        return;
+    }
+
     int data_sock = setup_data_connection(control_sock, server_address);
     if (data_sock < 0) {
         fprintf(stderr, "Error: Failed to establish data connection\n");
         return;
     }
 
+    off_t offset = resume_offset(control_sock, filename, local_file_size(filename), 1);
+
+    int level = request_compression(control_sock);
     char command[BUFFER_SIZE];
     snprintf(command, sizeof(command), "G%s\n", filename);
-    if (write(control_sock, command, strlen(command)) < 0) {
+    if (level < 0 || write(control_sock, command, strlen(command)) < 0) {
         fprintf(stderr, "Error: Failed to send get command\n");
-        close(data_sock);
+        close_data_connection(data_sock, -1);
         return;
     }
 
     char ack_buffer[BUFFER_SIZE];
-    int ack_bytes = read(control_sock, ack_buffer, sizeof(ack_buffer) - 1);
-    if (ack_bytes <= 0 || ack_buffer[0] != 'A') {
-        ack_buffer[ack_bytes] = '\0';
+    if (read_reply(control_sock, ack_buffer, sizeof(ack_buffer)) < 0 || ack_buffer[0] != 'A') {
         fprintf(stderr, "Error: Server failed to acknowledge get command: %s\n", ack_buffer);
-        close(data_sock);
+        close_data_connection(data_sock, 0);
         return;
     }
 
-    int file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (file_fd < 0) {
+    int file_fd = open(filename, offset > 0 ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file_fd < 0 || lseek(file_fd, offset, SEEK_SET) < 0) {
         fprintf(stderr, "Error: Unable to open local file for writing: %s\n", filename);
-        close(data_sock);
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        close_data_connection(data_sock, -1);
         return;
     }
 
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = read(data_sock, buffer, sizeof(buffer))) > 0) {
-        if (write(file_fd, buffer, bytes_read) < 0) {
-            fprintf(stderr, "Error: Unable to write to local file: %s\n", filename);
-            break;
-        }
+    int status;
+    if (level > 0) {
+        status = receive_compressed(file_fd, data_sock);
+    } else if (data_connection_framed(data_sock)) {
+        status = receive_framed(file_fd, data_sock);
+    } else {
+        status = receive_file(file_fd, data_sock);
     }
-
-    if (bytes_read < 0) {
-        fprintf(stderr, "Error: Failed to read data from server\n");
+    if (status < 0) {
+        fprintf(stderr, "Error: Failed to receive file data from server\n");
     }
 
     close(file_fd);
-    close(data_sock);
+    close_data_connection(data_sock, status);
+    if (status == 0 && verify_checksums) {
+        checksum(control_sock, filename);
+    }
 }
 
 void show(int control_sock, const char *server_address, const char *pathname) {
@@ -305,50 +799,46 @@ void show(int control_sock, const char *server_address, const char *pathname) {
         return;
     }
 
+    int level = request_compression(control_sock);
     char command[BUFFER_SIZE];
     snprintf(command, sizeof(command), "G%s\n", pathname);
-    if (write(control_sock, command, strlen(command)) < 0) {
+    if (level < 0 || write(control_sock, command, strlen(command)) < 0) {
         fprintf(stderr, "Error: Unable to send show command\n");
-        close(data_sock);
+        close_data_connection(data_sock, -1);
         return;
     }
 
     char ack_buffer[BUFFER_SIZE];
-    int ack_bytes = read(control_sock, ack_buffer, sizeof(ack_buffer) - 1);
-    if (ack_bytes <= 0 || ack_buffer[0] != 'A') {
-        ack_buffer[ack_bytes] = '\0';
+    if (read_reply(control_sock, ack_buffer, sizeof(ack_buffer)) < 0 || ack_buffer[0] != 'A') {
         fprintf(stderr, "Error: Server failed to acknowledge show command: %s\n", ack_buffer);
-        close(data_sock);
+        close_data_connection(data_sock, 0);
         return;
     }
 
-    pid_t pid = fork();
-    if (pid < 0) {
-        fprintf(stderr, "Error: fork failed\n");
-        close(data_sock);
+    close_data_connection(data_sock, page_data(data_sock, level > 0));
+}
+
+void put(int control_sock, const char *server_address, const char *filename) {
+    if (filename == NULL || strlen(filename) == 0) {
+        fprintf(stderr, "Error: Usage: put <filename>\n");
         return;
     }
 
-    if (pid == 0) {
-        if (dup2(data_sock, STDIN_FILENO) < 0) {
-            fprintf(stderr, "Error: dup2 failed\n");
-            exit(EXIT_FAILURE);
-        }
-
-        close(data_sock);
+    if (delta_sync && remote_size(control_sock, filename) > 0) {
+        transfer_delta(control_sock, server_address, filename, 0);
+        return;
+    }
 
-        execlp("more", "more", "-20", NULL);
-        fprintf(stderr, "Error: execlp failed\n");
-        exit(EXIT_FAILURE);
-    } else {
-        close(data_sock);
-        wait(NULL);
+    if (chunked_puts) {
+        if (transfer_chunked(control_sock, server_address, filename) == 0) {
+            return;
+        }
+        fprintf(stderr, "Error: Server has no chunk store, sending whole files\n");
+        chunked_puts = 0;
     }
-}
 
-void put(int control_sock, const char *server_address, const char *filename) {
-    if (filename == NULL || strlen(filename) == 0) {
-        fprintf(stderr, "Error: Usage: put <filename>\n");
+    if (stripe_streams > 1) {
+        transfer_striped(control_sock, server_address, filename, 0);
         return;
     }
 
@@ -358,6 +848,23 @@ void put(int control_sock, const char *server_address, const char *filename) {
         return;
     }
 
+    struct stat st;
+    if (fstat(file_fd, &st) < 0) {
+        fprintf(stderr, "Error: Unable to open local file for reading: %s\n", filename);
+        close(file_fd);
+        return;
+    }
+
+    char size_command[64];
+    char size_ack[BUFFER_SIZE];
+    snprintf(size_command, sizeof(size_command), "Z%lld\n", (long long)st.st_size);
+    if (write(control_sock, size_command, strlen(size_command)) < 0 ||
+        read_reply(control_sock, size_ack, sizeof(size_ack)) < 0) {
+        fprintf(stderr, "Error: Failed to send file size\n");
+        close(file_fd);
+        return;
+    }
+
     int data_sock = setup_data_connection(control_sock, server_address);
     if (data_sock < 0) {
         fprintf(stderr, "Error: Failed to establish data connection\n");
@@ -365,64 +872,329 @@ void put(int control_sock, const char *server_address, const char *filename) {
         return;
     }
 
+    off_t offset = resume_offset(control_sock, filename, st.st_size, 0);
+
+    int level = request_compression(control_sock);
+    int commit = level < 0 ? 0 : request_durability(control_sock);
     char command[BUFFER_SIZE];
     snprintf(command, sizeof(command), "P%s\n", filename);
-    if (write(control_sock, command, strlen(command)) < 0) {
+    if (level < 0 || commit < 0 || write(control_sock, command, strlen(command)) < 0) {
         fprintf(stderr, "Error: Failed to send put command\n");
         close(file_fd);
-        close(data_sock);
+        close_data_connection(data_sock, -1);
         return;
     }
 
     char ack_buffer[BUFFER_SIZE];
-    int ack_bytes = read(control_sock, ack_buffer, sizeof(ack_buffer) - 1);
-    if (ack_bytes <= 0 || ack_buffer[0] != 'A') {
-        ack_buffer[ack_bytes] = '\0';
+    if (read_reply(control_sock, ack_buffer, sizeof(ack_buffer)) < 0 || ack_buffer[0] != 'A') {
         fprintf(stderr, "Error: Server failed to acknowledge put command: %s\n", ack_buffer);
         close(file_fd);
-        close(data_sock);
+        /* A rejected P on a framed connection still expects a (here empty) body. */
+        if (data_connection_framed(data_sock)) {
+            close_data_connection(data_sock, write_frame_header(data_sock, 0, 0));
+        } else {
+            close_data_connection(data_sock, 0);
+        }
         return;
     }
 
+    int status;
+    if (level > 0) {
+        status = send_file_compressed(data_sock, file_fd, offset, level);
+    } else if (data_connection_framed(data_sock)) {
+        status = send_file_framed(data_sock, file_fd, offset);
+    } else {
+        status = send_file(data_sock, file_fd, offset);
+    }
+    if (status < 0) {
+        fprintf(stderr, "Error: Failed to send file data to server\n");
+    } else if (st.st_size - offset >= SOCK_MEASURE_MIN) {
+        data_buffer = sock_measure(data_sock, data_buffer);
+    }
+
+    close(file_fd);
+    close_data_connection(data_sock, status);
+    if (commit > 0) {
+        commit_result(control_sock, filename);
+    }
+    if (status == 0 && verify_checksums) {
+        checksum(control_sock, filename);
+    }
+}
+
+int remote_names(int control_sock, const char *server_address, const char *pattern, glob_t *names) {
+    int data_sock = setup_data_connection(control_sock, server_address);
+    if (data_sock < 0) {
+        fprintf(stderr, "Error: Failed to establish data connection\n");
+        return -1;
+    }
+
+    char command[BUFFER_SIZE];
+    snprintf(command, sizeof(command), "N%s\n", pattern);
+    if (write(control_sock, command, strlen(command)) < 0) {
+        fprintf(stderr, "Error: Failed to send name list command\n");
+        close_data_connection(data_sock, -1);
+        return -1;
+    }
+
+    FILE *list = tmpfile();
+    if (list == NULL) {
+        fprintf(stderr, "Error: Unable to create temporary file\n");
+        close_data_connection(data_sock, -1);
+        return -1;
+    }
+
+    int status;
+    if (data_connection_framed(data_sock)) {
+        status = receive_framed(fileno(list), data_sock);
+    } else {
+        status = receive_file(fileno(list), data_sock);
+    }
+    close_data_connection(data_sock, status);
+
     char buffer[BUFFER_SIZE];
-    int bytes_read;
-    while ((bytes_read = read(file_fd, buffer, sizeof(buffer))) > 0) {
-        if (write(data_sock, buffer, bytes_read) < 0) {
-            fprintf(stderr, "Error: Failed to send file data to server\n");
+    if (read_reply(control_sock, buffer, sizeof(buffer)) < 0 || buffer[0] != 'A') {
+        fprintf(stderr, "Error: Server failed to list '%s': %s\n", pattern, buffer);
+        status = -1;
+    }
+
+    /* Collect the names into the glob_t so mget handles local and remote lists alike. */
+    rewind(list);
+    while (status == 0 && fgets(buffer, sizeof(buffer), list) != NULL) {
+        buffer[strcspn(buffer, "\n")] = '\0';
+        names->gl_pathv = realloc(names->gl_pathv, (names->gl_pathc + 2) * sizeof(char *));
+        names->gl_pathv[names->gl_pathc++] = strdup(buffer);
+        names->gl_pathv[names->gl_pathc] = NULL;
+    }
+
+    fclose(list);
+    return status;
+}
+
+void free_names(glob_t *names) {
+    for (size_t i = 0; i < names->gl_pathc; i++) {
+        free(names->gl_pathv[i]);
+    }
+    free(names->gl_pathv);
+}
+
+void mget(int control_sock, const char *server_address, const char *patterns) {
+    glob_t names = { 0 };
+    char pattern_list[BUFFER_SIZE];
+
+    snprintf(pattern_list, sizeof(pattern_list), "%s", patterns);
+    for (char *pattern = strtok(pattern_list, " "); pattern != NULL; pattern = strtok(NULL, " ")) {
+        if (remote_names(control_sock, server_address, pattern, &names) < 0) {
+            free_names(&names);
+            return;
+        }
+    }
+    if (names.gl_pathc == 0) {
+        fprintf(stderr, "Error: No remote files match '%s'\n", patterns);
+        free_names(&names);
+        return;
+    }
+
+    int data_sock = setup_data_connection(control_sock, server_address);
+    if (data_sock < 0) {
+        fprintf(stderr, "Error: Failed to establish data connection\n");
+        free_names(&names);
+        return;
+    }
+    if (!data_connection_framed(data_sock)) {
+        /* One-shot data connections cannot be pipelined; fetch one by one. */
+        close_data_connection(data_sock, -1);
+        for (size_t i = 0; i < names.gl_pathc; i++) {
+            get(control_sock, server_address, names.gl_pathv[i]);
+        }
+        free_names(&names);
+        return;
+    }
+
+    size_t sent = 0;
+    int status = 0;
+    for (size_t i = 0; i < names.gl_pathc && status == 0; i++) {
+        /* Keep a window of G commands in flight so the files stream back to back. */
+        while (sent < names.gl_pathc && sent < i + PIPELINE_WINDOW) {
+            char command[BUFFER_SIZE];
+            snprintf(command, sizeof(command), "G%s\n", names.gl_pathv[sent++]);
+            if (write(control_sock, command, strlen(command)) < 0) {
+                fprintf(stderr, "Error: Failed to send get command\n");
+                status = -1;
+                break;
+            }
+        }
+
+        char ack_buffer[BUFFER_SIZE];
+        if (status < 0 || read_reply(control_sock, ack_buffer, sizeof(ack_buffer)) < 0) {
+            status = -1;
             break;
         }
+        if (ack_buffer[0] != 'A') {
+            fprintf(stderr, "Error: Server failed to acknowledge get command: %s\n", ack_buffer);
+            continue;
+        }
+
+        int file_fd = open(names.gl_pathv[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file_fd < 0) {
+            fprintf(stderr, "Error: Unable to open local file for writing: %s\n", names.gl_pathv[i]);
+            file_fd = open("/dev/null", O_WRONLY);
+        }
+        status = receive_framed(file_fd, data_sock);
+        close(file_fd);
     }
 
-    if (bytes_read < 0) {
-        fprintf(stderr, "Error: Failed to read from local file\n");
+    if (status < 0) {
+        /* The reply and data streams are out of step; the session cannot recover. */
+        fprintf(stderr, "Error: Failed to receive file data from server\n");
+        exit_command(control_sock);
     }
+    printf("Received %zu file(s)\n", names.gl_pathc);
+    free_names(&names);
+}
 
-    close(file_fd);
-    close(data_sock);
+int mput_reply(int control_sock, const char *filename, int durable) {
+    char size_ack[BUFFER_SIZE];
+    char durable_ack[BUFFER_SIZE] = "A";
+    char ack_buffer[BUFFER_SIZE];
+
+    if (read_reply(control_sock, size_ack, sizeof(size_ack)) < 0 ||
+        (durable && read_reply(control_sock, durable_ack, sizeof(durable_ack)) < 0) ||
+        read_reply(control_sock, ack_buffer, sizeof(ack_buffer)) < 0) {
+        return -1;
+    }
+    if (ack_buffer[0] != 'A') {
+        fprintf(stderr, "Error: Server failed to acknowledge put of %s: %s\n", filename, ack_buffer);
+    } else if (durable && durable_ack[0] == 'A') {
+        commit_result(control_sock, filename);
+    }
+    return 0;
+}
+
+void mput(int control_sock, const char *server_address, const char *patterns) {
+    glob_t names;
+    char pattern_list[BUFFER_SIZE];
+    int flags = 0;
+
+    memset(&names, 0, sizeof(names));
+    snprintf(pattern_list, sizeof(pattern_list), "%s", patterns);
+    for (char *pattern = strtok(pattern_list, " "); pattern != NULL; pattern = strtok(NULL, " ")) {
+        if (glob(pattern, flags, NULL, &names) == GLOB_NOMATCH) {
+            fprintf(stderr, "Error: No local files match '%s'\n", pattern);
+        }
+        flags = GLOB_APPEND;
+    }
+    if (names.gl_pathc == 0) {
+        globfree(&names);
+        return;
+    }
+
+    int data_sock = setup_data_connection(control_sock, server_address);
+    if (data_sock < 0) {
+        fprintf(stderr, "Error: Failed to establish data connection\n");
+        globfree(&names);
+        return;
+    }
+    if (!data_connection_framed(data_sock)) {
+        close_data_connection(data_sock, -1);
+        for (size_t i = 0; i < names.gl_pathc; i++) {
+            put(control_sock, server_address, names.gl_pathv[i]);
+        }
+        globfree(&names);
+        return;
+    }
+
+    /*
+     * Each file's data goes out right behind its Z/P without waiting for the
+     * replies, which are read up to PIPELINE_WINDOW files later and only
+     * report errors.  pending[] maps queued commands back to file names.
+     */
+    size_t pending[2 * PIPELINE_WINDOW];
+    int file_fds[2 * PIPELINE_WINDOW];
+    size_t next = 0;
+    size_t queued = 0;
+    size_t sent = 0;
+    size_t acked = 0;
+    int status = 0;
+
+    while (status == 0 && (next < names.gl_pathc || sent < queued)) {
+        while (next < names.gl_pathc && queued - sent < PIPELINE_WINDOW) {
+            struct stat st;
+            int file_fd = open(names.gl_pathv[next], O_RDONLY);
+            if (file_fd < 0 || fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+                fprintf(stderr, "Error: Unable to open local file for reading: %s\n", names.gl_pathv[next]);
+                if (file_fd >= 0) {
+                    close(file_fd);
+                }
+                next++;
+                continue;
+            }
+
+            char command[BUFFER_SIZE + 64];
+            char durable[32] = "";
+            if (durability != NULL) {
+                snprintf(durable, sizeof(durable), "F%s\n", durability);
+            }
+            snprintf(command, sizeof(command), "Z%lld\n%sP%s\n", (long long)st.st_size, durable,
+                     names.gl_pathv[next]);
+            if (write(control_sock, command, strlen(command)) < 0) {
+                close(file_fd);
+                status = -1;
+                break;
+            }
+            pending[queued % (2 * PIPELINE_WINDOW)] = next++;
+            file_fds[queued % (2 * PIPELINE_WINDOW)] = file_fd;
+            queued++;
+        }
+
+        if (status == 0 && sent < queued) {
+            int file_fd = file_fds[sent % (2 * PIPELINE_WINDOW)];
+            status = send_file_framed(data_sock, file_fd, 0);
+            close(file_fd);
+            sent++;
+        }
+
+        while (status == 0 && sent - acked > PIPELINE_WINDOW) {
+            status = mput_reply(control_sock, names.gl_pathv[pending[acked++ % (2 * PIPELINE_WINDOW)]],
+                                durability != NULL);
+        }
+    }
+    while (status == 0 && acked < sent) {
+        status = mput_reply(control_sock, names.gl_pathv[pending[acked++ % (2 * PIPELINE_WINDOW)]],
+                            durability != NULL);
+    }
+
+    if (status < 0) {
+        /* The reply and data streams are out of step; the session cannot recover. */
+        fprintf(stderr, "Error: Failed to send file data to server\n");
+        for (; sent < queued; sent++) {
+            close(file_fds[sent % (2 * PIPELINE_WINDOW)]);
+        }
+        exit_command(control_sock);
+    }
+    printf("Sent %zu file(s)\n", sent);
+    globfree(&names);
 }
 
 void command_server(int control_sock, const char *server_address) {
     char buffer[BUFFER_SIZE];
+    struct line_reader input;
+
+    line_reader_init(&input, STDIN_FILENO);
 
     while (1) {
         printf("MFTP> ");
         fflush(stdout);
 
-        memset(buffer, 0, sizeof(buffer));
-        ssize_t bytes_read = read(STDIN_FILENO, buffer, sizeof(buffer) - 1);
-        if (bytes_read <= 0) {
-            fprintf(stderr, "Error: Unable to read user input\n");
-            continue;
+        if (read_line(&input, buffer, sizeof(buffer)) < 0) {
+            printf("\n");
+            exit_command(control_sock);
         }
 
-        if (bytes_read == 1) {
+        if (buffer[0] == '\0') {
             continue;
         }
 
-        if (buffer[bytes_read - 1] == '\n') {
-            buffer[bytes_read - 1] = '\0';
-        }
-
         if (strncmp(buffer, "cd ", 3) == 0) {
             cd(buffer + 3);
         } else if (strcmp(buffer, "ls") == 0) {
@@ -430,13 +1202,23 @@ void command_server(int control_sock, const char *server_address) {
         } else if (strncmp(buffer, "rcd ", 4) == 0) {
             rcd(control_sock, buffer + 4);
         } else if (strcmp(buffer, "rls") == 0) {
-            rls(control_sock, server_address);
+            rls(control_sock, server_address, "");
+        } else if (strncmp(buffer, "rls ", 4) == 0) {
+            rls(control_sock, server_address, buffer + 4);
+        } else if (strncmp(buffer, "sum ", 4) == 0) {
+            checksum(control_sock, buffer + 4);
+        } else if (strcmp(buffer, "stats") == 0) {
+            stats(control_sock, server_address);
         } else if (strncmp(buffer, "get ", 4) == 0) {
             get(control_sock, server_address, buffer + 4);
         } else if (strncmp(buffer, "show ", 5) == 0) {
             show(control_sock, server_address, buffer + 5);
         } else if (strncmp(buffer, "put ", 4) == 0) {
             put(control_sock, server_address, buffer + 4);
+        } else if (strncmp(buffer, "mget ", 5) == 0) {
+            mget(control_sock, server_address, buffer + 5);
+        } else if (strncmp(buffer, "mput ", 5) == 0) {
+            mput(control_sock, server_address, buffer + 5);
         } else if (strcmp(buffer, "exit") == 0) {
             exit_command(control_sock);
         } else {
@@ -446,19 +1228,46 @@ void command_server(int control_sock, const char *server_address) {
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <port> <hostname | IP address>\n", argv[0]);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:k:z:vdcf:")) != -1) {
+        if (opt == 's' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_STREAMS) {
+            stripe_streams = atoi(optarg);
+        } else if (opt == 'k' && atoll(optarg) >= 4096 && atoll(optarg) <= MAX_CHUNK_SIZE) {
+            stripe_chunk = atoll(optarg);
+        } else if (opt == 'z' && atoi(optarg) >= 0 && atoi(optarg) <= 9) {
+            compress_level = atoi(optarg);
+        } else if (opt == 'v') {
+            verify_checksums = 1;
+        } else if (opt == 'd') {
+            delta_sync = 1;
+        } else if (opt == 'c') {
+            chunked_puts = 1;
+        } else if (opt == 'f' && (strcmp(optarg, "none") == 0 || strcmp(optarg, "sync") == 0 ||
+                                  strcmp(optarg, "group") == 0)) {
+            durability = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-s streams] [-k chunk size] [-z level] [-v] [-d] [-c] [-f none|sync|group] <port> <hostname | IP address>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-s streams] [-k chunk size] [-z level] [-v] [-d] [-c] [-f none|sync|group] <port> <hostname | IP address>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    int port = atoi(argv[1]);
-    const char *hostname = argv[2];
+    int port = atoi(argv[optind]);
+    const char *hostname = argv[optind + 1];
 
     if (port <= 0 || port > 65535) {
         fprintf(stderr, "Error: invalid port number\n");
         exit(EXIT_FAILURE);
     }
 
+    signal(SIGPIPE, SIG_IGN);
+    sock_init(0);
+
     int sockfd = connect_to_server(hostname, port);
     printf("Connected to server at %s\n", hostname);
 
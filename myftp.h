@@ -5,41 +5,385 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <errno.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <netdb.h>
+#include <glob.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #define BUFFER_SIZE 1024
-#define BACKLOG 4
+#define IO_BUFFER_SIZE 65536
+#define DATA_STREAM_SIZE 65536
+#define IO_CHUNK_SIZE (1 << 20)
+#define LINE_BUFFER_SIZE 8192
+#define PIPELINE_WINDOW 32
+#define MAX_STREAMS 16
+#define MAX_CHUNK_SIZE (64 << 20)
+#define STRIPE_ACCEPT_TIMEOUT 30
+#define COMPRESS_BLOCK_SIZE (256 * 1024)
+#define COMPRESS_BUFFER_SIZE (COMPRESS_BLOCK_SIZE + COMPRESS_BLOCK_SIZE / 256 + 64)
+#define FRAME_COMPRESSED 0x80000000u
+#define ENTROPY_SAMPLE 4096
+#define ENTROPY_LIMIT 7.5
+#define LIST_DENTS_SIZE 32768
+#define LIST_LINE_SIZE 2048
+#define LIST_CACHE_ENTRIES 64
+#define LIST_CACHE_WATCHES 128
+#define LIST_CACHE_BYTES (64 << 20)
+#define POOL_DEQUE_SIZE 1024
+#define URING_BLOCK_SIZE (256 * 1024)
+#define URING_MAX_DEPTH 64
+#define HOTCACHE_ENTRIES 256
+#define HOTCACHE_GHOSTS 512
+#define HOTCACHE_HOLDERS 1024
+#define SLAB_BYTES (1 << 20)
+#define SLAB_MIN_OBJECTS 8
+#define SLAB_ALIGN 64
+#define SLAB_BATCH 8
+#define SLAB_LOCAL_MAX 16
+#define STATS_SHARDS 64
+#define STATS_COMMANDS "DKCLMNGPWZRYIHOUVXQS"
+#define STATS_BUCKETS 26
+#define STATS_TEXT_SIZE (256 * 1024)
+#define LOG_RINGS 32
+#define LOG_RING_SIZE 1024
+#define LOG_PATH_SIZE 232
+#define LOG_LINE_SIZE 2048
+#define LOG_RATE 10000
+#define LOG_BATCH 4096
+#define LOG_BATCH_BYTES (256 * 1024)
+#define LOG_FLUSH_INTERVAL_MS 5
+#define SHAPE_QUANTUM 65536
+#define SHAPE_BURST (256 * 1024)
+#define SHAPE_SMALL (1 << 20)
+#define SHAPE_WEIGHT 16
+#define CHECKSUM_BLOCK_SIZE (256 * 1024)
+#define SHA256_SIZE 32
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define DELTA_MAX_BLOCKS (1 << 22)
+#define DELTA_SCAN_SIZE (1 << 20)
+#define DELTA_LITERAL_MAX 65536
+#define CHUNK_MIN (16 * 1024)
+#define CHUNK_AVG (64 * 1024)
+#define CHUNK_MAX (256 * 1024)
+#define CHUNK_SCAN_SIZE (1 << 20)
+#define STORE_MAX_CHUNKS (1 << 24)
+#define COMMIT_BATCH 256
+#define UPLOAD_PART_SUFFIX ".part"
+#define SOCK_BUFFER_MAX (64 << 20)
+#define SOCK_MEASURE_MIN (8 << 20)
+#define BENCH_SMALL_FILES 64
+#define BENCH_LIST_ENTRIES 1000
+#define BENCH_MAX_SESSIONS 1024
 
-int setup_server(int port);
+enum { LIST_LONG, LIST_MACHINE, LIST_NAMES };
+enum { SLAB_SESSION, SLAB_LISTER, SLAB_BLOCK, SLAB_TASK, SLAB_CLASSES };
+enum { LOG_ERROR, LOG_INFO, LOG_DEBUG };
+enum { LOG_CONNECT, LOG_CD, LOG_GET, LOG_PUT, LOG_QUIT, LOG_COMMAND, LOG_PUT_FAILED };
+enum { DURABLE_NONE, DURABLE_SYNC, DURABLE_GROUP, DURABLE_MODES };
+enum { SHARD_NONE, SHARD_HASH, SHARD_CPU };
+
+/* Newline-framed reader over a ring buffer, one per control connection. */
+struct line_reader {
+    int fd;
+    size_t head;
+    size_t count;
+    char buf[LINE_BUFFER_SIZE];
+};
+
+/* Buffered two-way message stream over a data connection, see myftpio.c. */
+struct data_stream;
+
+/* Batched getdents64() directory listing, see myftplist.c. */
+struct dir_lister;
+
+struct list_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long invalidations;
+    int entries;
+    size_t bytes;
+};
+
+/* Blocking work run on the worker pool, see myftppool.c. */
+struct pool_task {
+    void (*run)(struct pool_task *task);
+    void *arg;
+    struct completion_queue *done;
+    struct pool_task *next;
+};
+
+/* Finished pool tasks waiting for their reactor; fd is an eventfd. */
+struct completion_queue {
+    pthread_mutex_t lock;
+    struct pool_task *head;
+    struct pool_task *tail;
+    int fd;
+};
+
+/* An upload waiting for the group-commit flusher, see myftpcommit.c. */
+struct commit {
+    int file_fd;
+    int dir_fd;
+    int parent_fd;
+    int reply_fd;
+    off_t size;
+    int error;
+    struct pool_task *task;
+    struct commit *next;
+    char temp[BUFFER_SIZE];
+    char name[BUFFER_SIZE];
+};
+
+struct hotcache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long long bytes_served;
+    off_t bytes;
+    int files;
+};
+
+/* Occupancy of one slab class; free bytes are bytes - in_use * object_size. */
+struct slab_stats {
+    const char *name;
+    size_t object_size;
+    size_t in_use;
+    size_t peak;
+    size_t capacity;
+    size_t depot;
+    size_t slabs;
+    size_t bytes;
+};
+
+/* Syscalls and network bytes of the data path, see myftpio.c. */
+struct io_counters {
+    unsigned long syscalls;
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+};
+
+/* One transfer's token buckets, see myftpshape.c. */
+struct shaper {
+    uint64_t tat;
+    uint64_t share_tat;
+    uint64_t ready;
+    uint64_t rate;
+    size_t credit;
+    unsigned int weight;
+    int active;
+    int small;
+};
+
+/* What a delta transfer sent as data and what it reused, see myftpdelta.c. */
+struct delta_stats {
+    off_t literal;
+    off_t matched;
+};
+
+extern int zero_copy;
+extern int uring_depth;
+extern int hotcache_fd;
+extern int store_fd;
+extern __thread struct io_counters *io_account;
+extern __thread struct shaper *io_shaper;
+
+void io_count(unsigned long syscalls, ssize_t bytes_in, ssize_t bytes_out);
+void io_snapshot(struct io_counters *out);
+
+int write_all(int fd, const char *buffer, size_t len);
+ssize_t send_file_chunk(int out_fd, int in_fd, off_t *offset, size_t count);
+int send_file(int out_fd, int in_fd, off_t offset);
+int open_splice_pipe(int pipe_fd[2]);
+void close_splice_pipe(int pipe_fd[2]);
+ssize_t recv_file_chunk(int file_fd, int sock_fd, int pipe_fd[2], size_t count);
+void preallocate_file(int file_fd, off_t size);
+int receive_file(int file_fd, int sock_fd);
+void line_reader_init(struct line_reader *reader, int fd);
+ssize_t line_reader_fill(struct line_reader *reader);
+int line_reader_next(struct line_reader *reader, char *line, size_t size);
+int read_line(struct line_reader *reader, char *line, size_t size);
+int write_frame_header(int sock_fd, uint32_t len, int more);
+int read_frame_header(int sock_fd, uint32_t *len);
+int send_range(int out_fd, int in_fd, off_t offset, off_t end, int framed);
+int send_file_framed(int out_fd, int in_fd, off_t offset);
+int receive_framed(int out_fd, int sock_fd);
+ssize_t encode_block(int in_fd, off_t *offset, unsigned char *out, unsigned char *scratch, int level);
+int decode_block(int out_fd, uint32_t header, const unsigned char *payload, unsigned char *scratch);
+int send_file_compressed(int out_fd, int in_fd, off_t offset, int level);
+int receive_compressed(int out_fd, int sock_fd);
+struct data_stream *data_stream_open(int fd, int framed);
+int data_stream_write(struct data_stream *s, const void *data, size_t len);
+int data_stream_finish(struct data_stream *s);
+int data_stream_read(struct data_stream *s, void *data, size_t len);
+int data_stream_end(struct data_stream *s);
+void data_stream_close(struct data_stream *s);
+int copy_file_data(int in_fd, off_t offset, int out_fd, off_t len);
+int send_file_striped(int *socks, int streams, int file_fd, size_t chunk_size, off_t offset);
+int receive_file_striped(int *socks, int streams, int file_fd, size_t chunk_size, off_t offset, off_t size);
+
+struct dir_lister *dir_lister_open(int dir_fd, const char *pattern, int format, long start, long count);
+ssize_t dir_lister_next(struct dir_lister *l, char *out, size_t size);
+void dir_lister_close(struct dir_lister *l);
+int dir_lister_error(const struct dir_lister *l);
+struct dir_lister *dir_lister_text(const char *text, size_t len);
+int send_listing(int out_fd, struct dir_lister *l, int framed);
+struct dir_lister *open_listing(int dir_fd, char cmd, const char *arg);
+void list_cache_stats(struct list_cache_stats *stats);
+
+int pool_start(int workers);
+void pool_submit(struct pool_task *task);
+void pool_complete(struct pool_task *task);
+int completion_queue_init(struct completion_queue *q);
+struct pool_task *completion_queue_take(struct completion_queue *q);
+
+int uring_probe(int depth);
+int uring_ready(void);
+int uring_send_file(int out_fd, int in_fd, off_t offset, int framed);
+int uring_receive_file(int file_fd, int sock_fd, int framed);
+
+int hotcache_init(off_t cap);
+int hotcache_acquire(int file_fd, off_t *base, off_t *size);
+void hotcache_release(int holder, off_t sent);
+void hotcache_stats(struct hotcache_stats *stats);
+
+void *slab_alloc(int id, size_t size);
+void slab_free(int id, void *p);
+void slab_stats(int id, struct slab_stats *stats);
+
+int stats_init(void);
+void stats_attach(void);
+uint64_t stats_clock(void);
+void stats_command(char cmd, uint64_t start, const struct io_counters *before, const struct io_counters *after);
+void stats_io(const struct io_counters *io);
+void stats_sessions(int delta);
+void stats_accept_queue(int listen_fd);
+size_t stats_format(char *out, size_t size, int local);
+struct dir_lister *stats_listing(void);
+int stats_serve(int port, int local);
+
+int log_init(int level, int json, const char *label);
+void log_attach(void);
+void log_event(int level, int event, int session, const char *path, int streams);
+int log_start(void);
+
+int shape_init(uint64_t global, uint64_t session);
+void shape_begin(struct shaper *sh, off_t size, int streams);
+void shape_end(struct shaper *sh);
+size_t shape_grant(struct shaper *sh, size_t want, uint64_t *delay);
+void shape_sent(struct shaper *sh, size_t n);
+size_t shape_wait(size_t want);
+void shape_take(size_t n);
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+int crc32c_file(int fd, uint32_t *out);
+int crc32c_prefix(int fd, off_t length, uint32_t *out);
+void sha256(const void *data, size_t len, unsigned char out[SHA256_SIZE]);
+
+int delta_send(int sock_fd, int framed, int file_fd, struct delta_stats *stats);
+int delta_receive(int sock_fd, int framed, int old_fd, int new_fd, struct delta_stats *stats);
+int delta_temp_file(int dir_fd, const char *pathname, char *temp, size_t size);
+int upload_part_name(const char *pathname, char *part, size_t size);
+int delta_rebuild(int sock_fd, int framed, int dir_fd, const char *pathname, int temp_fd, const char *temp,
+                  struct delta_stats *stats);
+
+int durability_parse(const char *name);
+int upload_open(int dir_fd, const char *pathname, off_t offset, char *temp, size_t size);
+void upload_discard(int dir_fd, const char *temp);
+int upload_ended(off_t size, int framed, int level);
+int upload_commit(int file_fd, int dir_fd, const char *temp, const char *pathname, off_t size, int mode);
+int upload_commit_async(struct commit *c);
+int commit_start(void);
+
+int store_init(const char *path);
+int store_unshare(int dir_fd, const char *pathname, off_t keep);
+int store_send(int sock_fd, int framed, int file_fd, struct delta_stats *stats);
+int store_receive(int sock_fd, int framed, int dir_fd, const char *pathname, int temp_fd, const char *temp);
+
+void sock_init(int backlog);
+int sock_listen(int fd);
+int sock_steer_cpu(int fd, int shards);
+void sock_control(int fd);
+void sock_cork(int fd, int on);
+void sock_data(int fd, int bytes);
+int sock_measure(int fd, int current);
+
+int setup_server(int port, int reuseport);
+int open_data_listener(int *port);
 int handle_data_connection(int client_sock);
 void handle_client(int client_sock);
 void handle_rcd(int client_sock, const char *pathname);
-void handle_rls(int client_sock, int data_sock);
-void handle_get(int client_sock, int data_sock, const char *pathname);
-void handle_put(int client_sock, int data_sock, const char *pathname);
-int receive_command(int sock_fd, char *buffer, size_t buffer_size);
+int accept_data_connection(int client_sock, int *data_listen_fd, int *data_fd, int keep_data);
+void release_data_connection(int data_conn, int *data_fd, int status);
+void listing_error_reply(char cmd, int error, char *response, size_t size);
+int handle_rls(int client_sock, int data_conn, int framed, char cmd, struct dir_lister *lister);
+int open_transfer_file(int dir_fd, const char *pathname, int get, off_t offset);
+void size_reply(int dir_fd, const char *pathname, char *response, size_t size);
+void checksum_reply(int dir_fd, const char *pathname, char *response, size_t size);
+void prefix_checksum_reply(int dir_fd, const char *arg, char *response, size_t size);
+void commit_reply(int error, char *response, size_t size);
+int finish_upload(int file_fd, int dir_fd, const char *temp, const char *pathname, off_t size, int mode,
+                  int status);
+int handle_get(int client_sock, int data_conn, const char *pathname, off_t offset, int level, int framed);
+int handle_put(int client_sock, int data_conn, const char *pathname, off_t size, off_t offset,
+               int level, int durability, int framed);
+int handle_delta(int client_sock, int data_conn, const char *pathname, char cmd, int framed);
+int open_stripe_listener(const char *arg, int *streams, size_t *chunk_size, int *port);
+int accept_stripes(int listen_fd, int *socks, int streams);
+int transfer_stripes(int listen_fd, int file_fd, int streams, size_t chunk_size, off_t offset, off_t size,
+                     int get);
+void handle_striped(int client_sock, int listen_fd, int streams, size_t chunk_size,
+                    const char *pathname, int get, off_t size, off_t offset, int durability);
+int receive_command(struct line_reader *reader, char *buffer, size_t buffer_size);
 void handle_client(int client_sock);
 void handle_sigchld(int sig);
 void client_connection(int server_sock);
+void accept_shards(int *listen_fds, int n, int steer);
+void event_server(int *listen_fds, int nlisten, int nthreads, int nworkers);
 
 int connect_to_server(const char *hostname, int port);
+int read_reply(int control_sock, char *buffer, size_t buffer_size);
+int connect_data_port(const char *server_address, int port);
 int setup_data_connection(int control_sock, const char *server_address);
+int setup_striped_connection(int control_sock, const char *server_address, int *socks);
+off_t remote_size(int control_sock, const char *filename);
+int remote_checksum(int control_sock, const char *filename, uint32_t *crc, char *reply, size_t size);
+void checksum(int control_sock, const char *filename);
+int remote_prefix_checksum(int control_sock, const char *filename, off_t length, uint32_t *crc);
+off_t resume_offset(int control_sock, const char *filename, off_t local_size, int download);
+int request_compression(int control_sock);
+int request_durability(int control_sock);
+void commit_result(int control_sock, const char *filename);
+off_t local_file_size(const char *filename);
+void transfer_striped(int control_sock, const char *server_address, const char *filename, int download);
+void transfer_delta(int control_sock, const char *server_address, const char *filename, int download);
+int transfer_chunked(int control_sock, const char *server_address, const char *filename);
+int data_connection_framed(int data_sock);
+void close_data_connection(int data_sock, int status);
+int page_data(int data_sock, int compressed);
 void exit_command(int control_sock);
 void cd(const char *pathname);
 void rcd(int control_sock, const char *pathname);
 void ls();
-void rls(int control_sock, const char *server_address);
+void page_remote(int control_sock, const char *server_address, const char *command, const char *what);
+void rls(int control_sock, const char *server_address, const char *page);
+void stats(int control_sock, const char *server_address);
 void get(int control_sock, const char *server_address, const char *filename);
 void show(int control_sock, const char *server_address, const char *pathname);
 void put(int control_sock, const char *server_address, const char *pathname);
+int remote_names(int control_sock, const char *server_address, const char *pattern, glob_t *names);
+void free_names(glob_t *names);
+void mget(int control_sock, const char *server_address, const char *patterns);
+int mput_reply(int control_sock, const char *filename, int durable);
+void mput(int control_sock, const char *server_address, const char *patterns);
 
 #endif
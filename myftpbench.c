@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "myftp.h"
+
+/*
+ * Load generator for myftpserve.
+ *
+ * Starts the server on loopback in a scratch directory filled with
+ * fixtures, then runs each scenario with every session on its own thread,
+ * control connection and persistent (K) data connection.  Every command is
+ * timed from request to its last byte; put also waits for an I reply, so
+ * its latency covers the server having written the file.  Server CPU is
+ * read from /proc/<pid>/stat, client CPU from getrusage().
+ */
+
+enum { BENCH_SMALL_GET, BENCH_LARGE_GET, BENCH_LARGE_PUT, BENCH_RLS, BENCH_SCENARIOS };
+
+static const struct {
+    const char *name;
+    char cmd;
+} scenarios[BENCH_SCENARIOS] = {
+    [BENCH_SMALL_GET] = { "small-get", 'G' },
+    [BENCH_LARGE_GET] = { "large-get", 'G' },
+    [BENCH_LARGE_PUT] = { "large-put", 'P' },
+    [BENCH_RLS] = { "rls", 'L' },
+};
+
+struct bench_session {
+    int id;
+    int scenario;
+    long ops;
+    long done;
+    long errors;
+    unsigned long long bytes;
+    uint64_t *latency;
+};
+
+struct bench_result {
+    int scenario;
+    long ops;
+    long errors;
+    unsigned long long bytes;
+    double seconds;
+    double server_cpu;
+    double client_cpu;
+    double p50;
+    double p99;
+    double p999;
+};
+
+static struct {
+    const char *server;
+    char *server_args;
+    int sessions;
+    long small_ops;
+    long large_ops;
+    off_t small_size;
+    off_t large_size;
+    int enabled[BENCH_SCENARIOS];
+    int json;
+    char root[64];
+    int port;
+    pid_t pid;
+    pthread_barrier_t start;
+} bench = { "./myftpserve", "", 8, 500, 4, 4096, 16 << 20, { 1, 1, 1, 1 }, 0, "", 0, -1 };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* User plus system time of the server and its reaped children, in seconds. */
+static double server_cpu(void) {
+    char path[64];
+    char buffer[1024];
+    unsigned long long utime, stime, cutime, cstime;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)bench.pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    char *p = fgets(buffer, sizeof(buffer), f) != NULL ? strrchr(buffer, ')') : NULL;
+    fclose(f);
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu",
+                            &utime, &stime, &cutime, &cstime) != 4) {
+        return 0;
+    }
+    return (double)(utime + stime + cutime + cstime) / sysconf(_SC_CLK_TCK);
+}
+
+static double client_cpu(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static int write_fixture(const char *name, off_t size, unsigned long long seed) {
+    char path[PATH_MAX];
+    char block[65536];
+
+    snprintf(path, sizeof(path), "%s/%s", bench.root, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    /* xorshift output: incompressible, so -z runs measure real work. */
+    while (size > 0) {
+        size_t len = size < (off_t)sizeof(block) ? (size_t)size : sizeof(block);
+        for (size_t i = 0; i + 8 <= sizeof(block); i += 8) {
+            seed ^= seed << 13;
+            seed ^= seed >> 7;
+            seed ^= seed << 17;
+            memcpy(block + i, &seed, 8);
+        }
+        if (write_all(fd, block, len) < 0) {
+            close(fd);
+            return -1;
+        }
+        size -= len;
+    }
+    return close(fd);
+}
+
+static int make_fixtures(void) {
+    char name[PATH_MAX];
+
+    snprintf(bench.root, sizeof(bench.root), "/tmp/myftpbench.XXXXXX");
+    if (mkdtemp(bench.root) == NULL) {
+        return -1;
+    }
+    snprintf(name, sizeof(name), "%s/list", bench.root);
+    if (mkdir(name, 0755) < 0) {
+        return -1;
+    }
+    snprintf(name, sizeof(name), "%s/up", bench.root);
+    if (mkdir(name, 0755) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < BENCH_SMALL_FILES; i++) {
+        snprintf(name, sizeof(name), "small%03d", i);
+        if (write_fixture(name, bench.small_size, i + 1) < 0) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < BENCH_LIST_ENTRIES; i++) {
+        snprintf(name, sizeof(name), "list/entry%04d", i);
+        if (write_fixture(name, i % 100, i + 1) < 0) {
+            return -1;
+        }
+    }
+    return write_fixture("large", bench.large_size, 0x9e3779b97f4a7c15ull);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+static void remove_fixtures(void) {
+    if (bench.root[0] != '\0') {
+        nftw(bench.root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+}
+
+static int connect_port(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Lets the kernel pick a free loopback port for the server. */
+static int free_port(void) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static int start_server(void) {
+    char *argv[64];
+    char port[16];
+    char server[PATH_MAX];
+    int argc = 0;
+
+    if (realpath(bench.server, server) == NULL) {
+        fprintf(stderr, "Error: %s: %s\n", bench.server, strerror(errno));
+        return -1;
+    }
+    bench.port = free_port();
+    if (bench.port < 0) {
+        return -1;
+    }
+    snprintf(port, sizeof(port), "%d", bench.port);
+
+    argv[argc++] = server;
+    char *args = strdup(bench.server_args);
+    for (char *arg = strtok(args, " "); arg != NULL && argc < 62; arg = strtok(NULL, " ")) {
+        argv[argc++] = arg;
+    }
+    argv[argc++] = port;
+    argv[argc] = NULL;
+
+    bench.pid = fork();
+    if (bench.pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        if (chdir(bench.root) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        execv(server, argv);
+        fprintf(stderr, "Error: %s: %s\n", server, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    free(args);
+    if (bench.pid < 0) {
+        return -1;
+    }
+
+    /* Up to two seconds for the server to start listening. */
+    for (int i = 0; i < 200; i++) {
+        int fd = connect_port(bench.port);
+        if (fd >= 0) {
+            write_all(fd, "Q\n", 2);
+            close(fd);
+            return 0;
+        }
+        if (waitpid(bench.pid, NULL, WNOHANG) == bench.pid) {
+            break;
+        }
+        usleep(10000);
+    }
+    fprintf(stderr, "Error: server did not start\n");
+    return -1;
+}
+
+static void stop_server(void) {
+    if (bench.pid > 0) {
+        kill(bench.pid, SIGTERM);
+        waitpid(bench.pid, NULL, 0);
+    }
+}
+
+static int command(int ctl, struct line_reader *reader, const char *request, char *reply, size_t size) {
+    if (write_all(ctl, request, strlen(request)) < 0 || read_line(reader, reply, size) < 0) {
+        return -1;
+    }
+    return reply[0] == 'A' ? 0 : -1;
+}
+
+static int open_data(int ctl, struct line_reader *reader) {
+    char reply[BUFFER_SIZE];
+    if (command(ctl, reader, "K\n", reply, sizeof(reply)) < 0) {
+        return -1;
+    }
+    return connect_port(atoi(reply + 1));
+}
+
+static int op_get(struct bench_session *s, int ctl, struct line_reader *reader, int data, int sink) {
+    char request[BUFFER_SIZE];
+    char reply[BUFFER_SIZE];
+
+    if (s->scenario == BENCH_SMALL_GET) {
+        snprintf(request, sizeof(request), "Gsmall%03ld\n", (s->id + s->done) % BENCH_SMALL_FILES);
+    } else {
+        snprintf(request, sizeof(request), "Glarge\n");
+    }
+    if (command(ctl, reader, request, reply, sizeof(reply)) < 0 || receive_framed(sink, data) < 0) {
+        return -1;
+    }
+    s->bytes += s->scenario == BENCH_SMALL_GET ? bench.small_size : bench.large_size;
+    return 0;
+}
+
+static int op_put(struct bench_session *s, int ctl, struct line_reader *reader, int data, int file_fd) {
+    char request[BUFFER_SIZE];
+    char reply[BUFFER_SIZE];
+
+    snprintf(request, sizeof(request), "Z%lld\n", (long long)bench.large_size);
+    if (command(ctl, reader, request, reply, sizeof(reply)) < 0) {
+        return -1;
+    }
+    snprintf(request, sizeof(request), "Pup/put%d\n", s->id);
+    if (command(ctl, reader, request, reply, sizeof(reply)) < 0 || send_file_framed(data, file_fd, 0) < 0) {
+        return -1;
+    }
+    snprintf(request, sizeof(request), "Iup/put%d\n", s->id);
+    if (command(ctl, reader, request, reply, sizeof(reply)) < 0 || atoll(reply + 1) != bench.large_size) {
+        return -1;
+    }
+    s->bytes += bench.large_size;
+    return 0;
+}
+
+static int op_list(struct bench_session *s, int ctl, struct line_reader *reader, int data, int sink) {
+    char reply[BUFFER_SIZE];
+
+    /* The sink is a memfd, so its offset counts the listing bytes. */
+    if (write_all(ctl, "L\n", 2) < 0 || receive_framed(sink, data) < 0 ||
+        read_line(reader, reply, sizeof(reply)) < 0 || reply[0] != 'A') {
+        return -1;
+    }
+    s->bytes += lseek(sink, 0, SEEK_CUR);
+    lseek(sink, 0, SEEK_SET);
+    return 0;
+}
+
+static void *session_run(void *arg) {
+    struct bench_session *s = arg;
+    struct line_reader reader;
+    char reply[BUFFER_SIZE];
+    char path[PATH_MAX];
+    int data = -1;
+    int sink = -1;
+    int file_fd = -1;
+
+    int ctl = connect_port(bench.port);
+    if (ctl >= 0) {
+        line_reader_init(&reader, ctl);
+        data = open_data(ctl, &reader);
+    }
+    if (s->scenario == BENCH_RLS) {
+        sink = memfd_create("myftpbench", MFD_CLOEXEC);
+        if (ctl >= 0 && command(ctl, &reader, "Clist\n", reply, sizeof(reply)) < 0) {
+            close(data);
+            data = -1;
+        }
+    } else if (s->scenario == BENCH_LARGE_PUT) {
+        snprintf(path, sizeof(path), "%s/large", bench.root);
+        file_fd = open(path, O_RDONLY);
+    } else {
+        sink = open("/dev/null", O_WRONLY);
+    }
+
+    pthread_barrier_wait(&bench.start);
+    if (data >= 0 && (sink >= 0 || file_fd >= 0)) {
+        while (s->done < s->ops) {
+            uint64_t start = now_ns();
+            int status;
+            if (s->scenario == BENCH_LARGE_PUT) {
+                status = op_put(s, ctl, &reader, data, file_fd);
+            } else if (s->scenario == BENCH_RLS) {
+                status = op_list(s, ctl, &reader, data, sink);
+            } else {
+                status = op_get(s, ctl, &reader, data, sink);
+            }
+            if (status < 0) {
+                /* The connection state is unknown now: give up on the rest. */
+                break;
+            }
+            s->latency[s->done++] = now_ns() - start;
+        }
+    }
+    s->errors = s->ops - s->done;
+
+    if (ctl >= 0) {
+        write_all(ctl, "Q\n", 2);
+        close(ctl);
+    }
+    if (data >= 0) {
+        close(data);
+    }
+    if (sink >= 0) {
+        close(sink);
+    }
+    if (file_fd >= 0) {
+        close(file_fd);
+    }
+    return NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *sorted, long count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    long i = (long)(p * count);
+    return sorted[i < count ? i : count - 1] / 1000.0;
+}
+
+static int run_scenario(int scenario, struct bench_result *result) {
+    struct bench_session *sessions = calloc(bench.sessions, sizeof(*sessions));
+    pthread_t *threads = calloc(bench.sessions, sizeof(*threads));
+    long ops = scenario == BENCH_SMALL_GET || scenario == BENCH_RLS ? bench.small_ops : bench.large_ops;
+    uint64_t *latency = calloc(ops * bench.sessions, sizeof(*latency));
+    int started = 0;
+
+    if (sessions == NULL || threads == NULL || latency == NULL) {
+        free(sessions);
+        free(threads);
+        free(latency);
+        return -1;
+    }
+
+    pthread_barrier_init(&bench.start, NULL, bench.sessions + 1);
+    for (int i = 0; i < bench.sessions; i++) {
+        sessions[i] = (struct bench_session){ i, scenario, ops, 0, 0, 0, latency + i * ops };
+        if (pthread_create(&threads[i], NULL, session_run, &sessions[i]) != 0) {
+            fprintf(stderr, "Error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        started++;
+    }
+
+    double server_start = server_cpu();
+    double client_start = client_cpu();
+    pthread_barrier_wait(&bench.start);
+    uint64_t start = now_ns();
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+    /* Give fork-mode session processes time to exit and be reaped. */
+    usleep(100000);
+
+    memset(result, 0, sizeof(*result));
+    result->scenario = scenario;
+    result->seconds = elapsed / 1e9;
+    result->server_cpu = server_cpu() - server_start;
+    result->client_cpu = client_cpu() - client_start;
+
+    /* Pack every session's samples together before sorting. */
+    long count = 0;
+    for (int i = 0; i < bench.sessions; i++) {
+        memmove(latency + count, sessions[i].latency, sessions[i].done * sizeof(*latency));
+        count += sessions[i].done;
+        result->errors += sessions[i].errors;
+        result->bytes += sessions[i].bytes;
+    }
+    qsort(latency, count, sizeof(*latency), compare_latency);
+    result->ops = count;
+    result->p50 = percentile(latency, count, 0.50);
+    result->p99 = percentile(latency, count, 0.99);
+    result->p999 = percentile(latency, count, 0.999);
+
+    pthread_barrier_destroy(&bench.start);
+    free(sessions);
+    free(threads);
+    free(latency);
+    return 0;
+}
+
+static void print_human(const struct bench_result *results, int count) {
+    printf("myftpbench: %s %s, %d sessions\n\n", bench.server, bench.server_args, bench.sessions);
+    printf("%-10s %3s %8s %6s %10s %10s %10s %10s %10s %12s %12s\n", "scenario", "cmd", "ops", "errors",
+           "ops/s", "MB/s", "p50 us", "p99 us", "p999 us", "srv cpu s/GB", "cli cpu s/GB");
+    for (int i = 0; i < count; i++) {
+        const struct bench_result *r = &results[i];
+        double gb = r->bytes / 1e9;
+        printf("%-10s %3c %8ld %6ld %10.0f %10.1f %10.1f %10.1f %10.1f %12.2f %12.2f\n",
+               scenarios[r->scenario].name, scenarios[r->scenario].cmd, r->ops, r->errors,
+               r->ops / r->seconds, r->bytes / 1e6 / r->seconds, r->p50, r->p99, r->p999,
+               gb > 0 ? r->server_cpu / gb : 0, gb > 0 ? r->client_cpu / gb : 0);
+    }
+}
+
+static void print_json(const struct bench_result *results, int count) {
+    printf("{\"server\": \"%s\", \"server_args\": \"%s\", \"sessions\": %d, \"scenarios\": [",
+           bench.server, bench.server_args, bench.sessions);
+    for (int i = 0; i < count; i++) {
+        const struct bench_result *r = &results[i];
+        double gb = r->bytes / 1e9;
+        printf("%s\n  {\"name\": \"%s\", \"command\": \"%c\", \"ops\": %ld, \"errors\": %ld, \"bytes\": %llu, "
+               "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+               "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+               "\"server_cpu_s\": %.3f, \"client_cpu_s\": %.3f, "
+               "\"server_cpu_s_per_gb\": %.3f, \"client_cpu_s_per_gb\": %.3f}",
+               i > 0 ? "," : "", scenarios[r->scenario].name, scenarios[r->scenario].cmd, r->ops, r->errors,
+               r->bytes, r->seconds, r->ops / r->seconds, r->bytes / 1e6 / r->seconds, r->p50, r->p99, r->p999,
+               r->server_cpu, r->client_cpu, gb > 0 ? r->server_cpu / gb : 0, gb > 0 ? r->client_cpu / gb : 0);
+    }
+    printf("\n]}\n");
+}
+
+static int select_scenarios(char *list) {
+    memset(bench.enabled, 0, sizeof(bench.enabled));
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int found = 0;
+        for (int i = 0; i < BENCH_SCENARIOS; i++) {
+            if (strcmp(name, scenarios[i].name) == 0) {
+                bench.enabled[i] = found = 1;
+            }
+        }
+        if (!found) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-S server] [-a \"server args\"] [-c sessions] [-n small ops] [-l large ops] "
+            "[-f small bytes] [-F large MB] [-s small-get,large-get,large-put,rls] [-j]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_result results[BENCH_SCENARIOS];
+    int count = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "S:a:c:n:l:f:F:s:j")) != -1) {
+        if (opt == 'S') {
+            bench.server = optarg;
+        } else if (opt == 'a') {
+            bench.server_args = optarg;
+        } else if (opt == 'c' && atoi(optarg) >= 1 && atoi(optarg) <= BENCH_MAX_SESSIONS) {
+            bench.sessions = atoi(optarg);
+        } else if (opt == 'n' && atol(optarg) >= 1) {
+            bench.small_ops = atol(optarg);
+        } else if (opt == 'l' && atol(optarg) >= 1) {
+            bench.large_ops = atol(optarg);
+        } else if (opt == 'f' && atoll(optarg) >= 1) {
+            bench.small_size = atoll(optarg);
+        } else if (opt == 'F' && atoll(optarg) >= 1) {
+            bench.large_size = atoll(optarg) << 20;
+        } else if (opt == 's' && select_scenarios(optarg) == 0) {
+            continue;
+        } else if (opt == 'j') {
+            bench.json = 1;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (make_fixtures() < 0) {
+        fprintf(stderr, "Error: unable to create fixtures in %s: %s\n", bench.root, strerror(errno));
+        remove_fixtures();
+        exit(EXIT_FAILURE);
+    }
+    if (start_server() < 0) {
+        stop_server();
+        remove_fixtures();
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < BENCH_SCENARIOS; i++) {
+        if (bench.enabled[i] && run_scenario(i, &results[count]) == 0) {
+            count++;
+        }
+    }
+
+    stop_server();
+    remove_fixtures();
+
+    if (bench.json) {
+        print_json(results, count);
+    } else {
+        print_human(results, count);
+    }
+    return 0;
+}
@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "myftp.h"
+
+/*
+ * Shared hot-file cache for GET.
+ *
+ * Cached files are copied whole into one memfd arena, and the index that
+ * places them lives in shared anonymous memory.  Both are created before
+ * the server forks or starts threads, so every session, in either mode,
+ * sees the same cache.  A file is cached under (dev, inode, mtime, size);
+ * a new mtime or size simply misses, and the stale copy is dropped.  A hit
+ * is sent with sendfile() straight from the arena at entry base + offset,
+ * so popular files never touch the disk or their own page cache again.
+ *
+ * A file is admitted on its second miss: the first only leaves its key in
+ * a ring of recent misses, so a file read once does not push out one read
+ * often.  The session that admits it is served from the file as on any
+ * miss; it hands the file over a socket to a fill thread started with the
+ * cache, which copies it in and marks the entry ready.
+ *
+ * Every reference a session holds is recorded with its pid.  A forked
+ * session that dies while sending drops its references without releasing
+ * them, so whenever a file is admitted the cache first takes back those
+ * whose owner is gone.
+ *
+ * Entries are contiguous extents of the arena.  Room is found first-fit;
+ * when nothing fits, the least recently used idle entry is evicted and
+ * its pages are punched out of the memfd, so the arena never holds more
+ * than the configured cap.
+ */
+
+enum { HOT_EMPTY, HOT_LOADING, HOT_READY };
+
+struct hot_key {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+};
+
+struct hot_entry {
+    int state;
+    int refs;
+    struct hot_key key;
+    off_t base;
+    unsigned long used;
+};
+
+/* One reference to an entry and the process that took it; pid 0 is free. */
+struct hot_holder {
+    pid_t pid;
+    int entry;
+};
+
+struct hot_cache {
+    pthread_mutex_t lock;
+    off_t cap;
+    unsigned long clock;
+    unsigned int ghost_next;
+    struct hot_entry entries[HOTCACHE_ENTRIES];
+    struct hot_key ghosts[HOTCACHE_GHOSTS];
+    struct hot_holder holders[HOTCACHE_HOLDERS];
+    struct hotcache_stats stats;
+};
+
+int hotcache_fd = -1;
+static struct hot_cache *cache;
+static char *arena;
+static int fill_sock[2] = { -1, -1 };
+
+static void *hot_filler(void *arg);
+
+int hotcache_init(off_t cap) {
+    pthread_mutexattr_t attr;
+    pthread_t thread;
+
+    cache = mmap(NULL, sizeof(*cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED) {
+        cache = NULL;
+        return -1;
+    }
+    hotcache_fd = memfd_create("myftp-hotcache", MFD_CLOEXEC);
+    if (hotcache_fd < 0 || ftruncate(hotcache_fd, cap) < 0) {
+        goto fail;
+    }
+    arena = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, hotcache_fd, 0);
+    if (arena == MAP_FAILED) {
+        goto fail;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fill_sock) < 0) {
+        fill_sock[0] = fill_sock[1] = -1;
+        goto fail;
+    }
+
+    /* Shared by forked sessions; robust, since one of them may die holding it. */
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&cache->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    cache->cap = cap;
+    if (pthread_create(&thread, NULL, hot_filler, NULL) != 0) {
+        goto fail;
+    }
+    pthread_detach(thread);
+    return 0;
+
+fail:
+    if (fill_sock[0] >= 0) {
+        close(fill_sock[0]);
+        close(fill_sock[1]);
+        fill_sock[0] = fill_sock[1] = -1;
+    }
+    if (arena != NULL && arena != MAP_FAILED) {
+        munmap(arena, cap);
+    }
+    arena = NULL;
+    if (hotcache_fd >= 0) {
+        close(hotcache_fd);
+        hotcache_fd = -1;
+    }
+    munmap(cache, sizeof(*cache));
+    cache = NULL;
+    return -1;
+}
+
+static void hot_lock(void) {
+    if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+
+static int hot_key_matches(const struct hot_key *k, const struct stat *st) {
+    return k->dev == st->st_dev && k->ino == st->st_ino && k->size == st->st_size &&
+           k->mtime.tv_sec == st->st_mtim.tv_sec && k->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void hot_drop(struct hot_entry *e) {
+    fallocate(hotcache_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, e->base, e->key.size);
+    cache->stats.bytes -= e->key.size;
+    cache->stats.files--;
+    e->state = HOT_EMPTY;
+}
+
+/* Takes back the references of sessions that died holding them; returns how many. */
+static int hot_reap(void) {
+    int reaped = 0;
+
+    for (int i = 0; i < HOTCACHE_HOLDERS; i++) {
+        struct hot_holder *h = &cache->holders[i];
+        if (h->pid != 0 && kill(h->pid, 0) < 0 && errno == ESRCH) {
+            cache->entries[h->entry].refs--;
+            h->pid = 0;
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+/* Records a reference to entry for this process; -1 if every holder is taken. */
+static int hot_hold(int entry) {
+    do {
+        for (int i = 0; i < HOTCACHE_HOLDERS; i++) {
+            struct hot_holder *h = &cache->holders[i];
+            if (h->pid == 0) {
+                *h = (struct hot_holder){ getpid(), entry };
+                cache->entries[entry].refs++;
+                return i;
+            }
+        }
+    } while (hot_reap() > 0);
+    return -1;
+}
+
+/* True on the second miss of a file; the first only remembers it. */
+static int hot_missed_before(const struct stat *st) {
+    for (int i = 0; i < HOTCACHE_GHOSTS; i++) {
+        struct hot_key *k = &cache->ghosts[i];
+        if (hot_key_matches(k, st)) {
+            memset(k, 0, sizeof(*k));
+            return 1;
+        }
+    }
+    cache->ghosts[cache->ghost_next++ % HOTCACHE_GHOSTS] =
+        (struct hot_key){ st->st_dev, st->st_ino, st->st_mtim, st->st_size };
+    return 0;
+}
+
+/* First-fit search for size free bytes between the live extents; -1 if none. */
+static off_t hot_find_room(off_t size) {
+    off_t start = 0;
+
+    while (start + size <= cache->cap) {
+        off_t next = -1;
+        for (int i = 0; i < HOTCACHE_ENTRIES; i++) {
+            struct hot_entry *e = &cache->entries[i];
+            if (e->state != HOT_EMPTY && e->base < start + size && e->base + e->key.size > start) {
+                /* Overlaps the candidate: try again just past it. */
+                if (next < e->base + e->key.size) {
+                    next = e->base + e->key.size;
+                }
+            }
+        }
+        if (next < 0) {
+            return start;
+        }
+        start = next;
+    }
+    return -1;
+}
+
+static struct hot_entry *hot_insert(const struct stat *st) {
+    struct hot_entry *slot = NULL;
+
+    /* Admissions are rare enough to check for dead holders on each. */
+    hot_reap();
+    for (int i = 0; i < HOTCACHE_ENTRIES; i++) {
+        struct hot_entry *e = &cache->entries[i];
+        if (e->state != HOT_EMPTY && e->key.dev == st->st_dev && e->key.ino == st->st_ino) {
+            if (e->state == HOT_LOADING) {
+                /* It is already being copied in. */
+                return NULL;
+            }
+            if (e->refs == 0) {
+                /* An older version of the same file. */
+                hot_drop(e);
+            }
+        }
+        if (e->state == HOT_EMPTY && slot == NULL) {
+            slot = e;
+        }
+    }
+
+    off_t base = -1;
+    while (slot == NULL || (base = hot_find_room(st->st_size)) < 0) {
+        struct hot_entry *oldest = NULL;
+        for (int i = 0; i < HOTCACHE_ENTRIES; i++) {
+            struct hot_entry *e = &cache->entries[i];
+            if (e->state == HOT_READY && e->refs == 0 && (oldest == NULL || e->used < oldest->used)) {
+                oldest = e;
+            }
+        }
+        if (oldest == NULL) {
+            /* Everything left is being sent or loaded right now. */
+            return NULL;
+        }
+        hot_drop(oldest);
+        cache->stats.evictions++;
+        if (slot == NULL) {
+            slot = oldest;
+        }
+    }
+
+    *slot = (struct hot_entry){ HOT_LOADING, 0, { st->st_dev, st->st_ino, st->st_mtim, st->st_size },
+                                base, ++cache->clock };
+    cache->stats.bytes += st->st_size;
+    cache->stats.files++;
+    return slot;
+}
+
+/* Copies the file into its extent; fails if it changed while being read. */
+static int hot_fill(struct hot_entry *e, int file_fd) {
+    struct stat st;
+    off_t done = 0;
+
+    while (done < e->key.size) {
+        ssize_t n = pread(file_fd, arena + e->base + done, e->key.size - done, done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    if (fstat(file_fd, &st) < 0 || !hot_key_matches(&e->key, &st)) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Fills the entries sessions hand over, one at a time; nobody else touches a LOADING entry. */
+static void *hot_filler(void *arg) {
+    while (1) {
+        int entry;
+        int file_fd;
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { &entry, sizeof(entry) };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                              .msg_controllen = sizeof(control) };
+        ssize_t n = recvmsg(fill_sock[0], &msg, MSG_CMSG_CLOEXEC);
+        struct cmsghdr *cmsg = n < 0 ? NULL : CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+            continue;
+        }
+        memcpy(&file_fd, CMSG_DATA(cmsg), sizeof(file_fd));
+        if (n != sizeof(entry) || entry < 0 || entry >= HOTCACHE_ENTRIES) {
+            close(file_fd);
+            continue;
+        }
+
+        struct hot_entry *e = &cache->entries[entry];
+        int ok = hot_fill(e, file_fd) == 0;
+        close(file_fd);
+        hot_lock();
+        if (ok) {
+            e->state = HOT_READY;
+        } else {
+            hot_drop(e);
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return NULL;
+}
+
+/* Queues e for the fill thread, without waiting; drops it if the queue is full. */
+static void hot_hand_off(struct hot_entry *e, int file_fd) {
+    int entry = e - cache->entries;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &entry, sizeof(entry) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                          .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &file_fd, sizeof(file_fd));
+
+    if (sendmsg(fill_sock[1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) != sizeof(entry)) {
+        hot_lock();
+        hot_drop(e);
+        pthread_mutex_unlock(&cache->lock);
+    }
+}
+
+/*
+ * Looks file_fd up for a GET.  On a hit returns a reference for
+ * hotcache_release() and where the copy is; on a miss returns -1, and the
+ * caller sends from the file while a second miss is copied in behind it.
+ */
+int hotcache_acquire(int file_fd, off_t *base, off_t *size) {
+    struct stat st;
+
+    if (cache == NULL || fstat(file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+
+    hot_lock();
+    for (int i = 0; i < HOTCACHE_ENTRIES; i++) {
+        struct hot_entry *e = &cache->entries[i];
+        if (e->state == HOT_READY && hot_key_matches(&e->key, &st)) {
+            int holder = hot_hold(i);
+            if (holder < 0) {
+                /* Too many sends in flight to track another; serve this one from the file. */
+                pthread_mutex_unlock(&cache->lock);
+                return -1;
+            }
+            e->used = ++cache->clock;
+            cache->stats.hits++;
+            *base = e->base;
+            *size = e->key.size;
+            pthread_mutex_unlock(&cache->lock);
+            return holder;
+        }
+    }
+    cache->stats.misses++;
+
+    /* Only files that leave room for others are worth admitting. */
+    struct hot_entry *e = NULL;
+    if (st.st_size > 0 && st.st_size <= cache->cap / 4 && hot_missed_before(&st)) {
+        e = hot_insert(&st);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (e != NULL) {
+        hot_hand_off(e, file_fd);
+    }
+    return -1;
+}
+
+void hotcache_release(int holder, off_t sent) {
+    hot_lock();
+    struct hot_holder *h = &cache->holders[holder];
+    cache->entries[h->entry].refs--;
+    h->pid = 0;
+    cache->stats.bytes_served += sent;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void hotcache_stats(struct hotcache_stats *stats) {
+    if (cache == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    hot_lock();
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
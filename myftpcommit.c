@@ -0,0 +1,453 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "myftp.h"
+
+/*
+ * Atomic, durable uploads.
+ *
+ * An upload is written to a hidden file beside its destination, .<name>.part
+ * (upload_open()), and renamed over it with the old file's permissions
+ * only once it is complete, so readers see the old file or the new one,
+ * never half of one.  An upload that fails, ends short of the size
+ * announced with Z, or cannot be known whole (upload_ended()) leaves the
+ * destination alone and its .part file in place; a later put of the same
+ * file resumes (R) after the bytes it holds once the client has checked
+ * them.  A lock on the .part file keeps two puts of one file from writing
+ * it at once.
+ *
+ * How durable the rename is can be chosen per transfer with F:
+ *   none   rename only; the data reaches the disk when the kernel writes it
+ *   sync   fdatasync() the file, rename, fsync() the directory
+ *   group  the same, batched with every other upload finishing meanwhile
+ * Group commits go to one flusher thread, started before the server forks.
+ * It starts writeback of the whole batch at once, then waits for each file
+ * (so the journal commits them together), renames them and syncs each
+ * directory once.  The batch is whatever queued while the previous one was
+ * on the disk, so it grows with the load and costs nothing when idle.
+ *
+ * Epoll sessions queue their commit in memory and the flusher completes
+ * it on the session's pool completion queue.  Blocking callers (forked
+ * sessions, transfer threads) pass their descriptors over a socket with
+ * SCM_RIGHTS and wait on a pipe for the result; a forked session never
+ * touches the in-memory queue, whose lock it may have inherited mid-use.
+ */
+
+struct commit_request {
+    off_t size;
+    char temp[BUFFER_SIZE];
+    char name[BUFFER_SIZE];
+};
+
+static struct {
+    int running;
+    pid_t pid;
+    int sock[2];
+    int wake_fd;
+    pthread_mutex_t lock;
+    struct commit *head;
+    struct commit *tail;
+} group = { 0, 0, { -1, -1 }, -1, PTHREAD_MUTEX_INITIALIZER, NULL, NULL };
+
+static const char *durability_names[] = { "none", "sync", "group" };
+
+int durability_parse(const char *name) {
+    for (int i = 0; i < DURABLE_MODES; i++) {
+        if (strcmp(name, durability_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Locks the staging file fd was opened as; fails if another put holds it. */
+static int lock_part(int fd, int dir_fd, const char *temp) {
+    struct stat st, named;
+
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        errno = errno == EWOULDBLOCK ? EBUSY : errno;
+        return -1;
+    }
+    /* The holder may have renamed it into place between our open and lock. */
+    if (fstat(fd, &st) < 0 || fstatat(dir_fd, temp, &named, 0) < 0 ||
+        st.st_dev != named.st_dev || st.st_ino != named.st_ino) {
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Opens the staging file of pathname, named in temp, for a put: empty for
+ * a new upload, or for a resumed one (offset > 0) cut to its first offset
+ * bytes and positioned after them.  temp is left empty on failure, so
+ * upload_discard() cannot touch a staging file another put holds.
+ */
+int upload_open(int dir_fd, const char *pathname, off_t offset, char *temp, size_t size) {
+    struct stat st;
+
+    if (upload_part_name(pathname, temp, size) < 0) {
+        temp[0] = '\0';
+        return -1;
+    }
+    int fd = openat(dir_fd, temp, O_RDWR | O_CLOEXEC | (offset == 0 ? O_CREAT : 0), 0644);
+    if (fd >= 0 && lock_part(fd, dir_fd, temp) == 0) {
+        if (offset > 0 && fstat(fd, &st) == 0 && offset > st.st_size) {
+            errno = EINVAL;
+        } else if (ftruncate(fd, offset) == 0 && lseek(fd, offset, SEEK_SET) == offset) {
+            return fd;
+        }
+    }
+    int error = errno;
+    if (fd >= 0) {
+        close(fd);
+    }
+    temp[0] = '\0';
+    errno = error;
+    return -1;
+}
+
+/*
+ * Drops the staging file of an upload that will not be committed.  A .part
+ * file is kept for the put that resumes it; a delta or store temporary
+ * file is removed.
+ */
+void upload_discard(int dir_fd, const char *temp) {
+    size_t len = strlen(temp);
+    if (len > 0 && (len < sizeof(UPLOAD_PART_SUFFIX) - 1 ||
+                    strcmp(temp + len - (sizeof(UPLOAD_PART_SUFFIX) - 1), UPLOAD_PART_SUFFIX) != 0)) {
+        unlinkat(dir_fd, temp, 0);
+    }
+}
+
+/* Gives a staging file the permissions of the file it is about to replace. */
+static void keep_mode(int file_fd, int dir_fd, const char *pathname) {
+    struct stat st;
+    if (fstatat(dir_fd, pathname, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+        fchmod(file_fd, st.st_mode & 07777);
+    }
+}
+
+static const char *base_name(const char *pathname) {
+    const char *slash = strrchr(pathname, '/');
+    return slash != NULL ? slash + 1 : pathname;
+}
+
+/* Opens the directory pathname is in, for fsync() and renames within it. */
+static int parent_dir(int dir_fd, const char *pathname) {
+    const char *slash = strrchr(pathname, '/');
+    char parent[BUFFER_SIZE];
+
+    if (slash == NULL) {
+        return openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    snprintf(parent, sizeof(parent), "%.*s", (int)(slash - pathname) + 1, pathname);
+    return openat(dir_fd, parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/*
+ * Whether a put that ran to its end is known to be whole.  K frames and
+ * compressed streams end with an end frame, and Z gives the size to check,
+ * but a raw D connection closes the same way whether the client finished
+ * or died, so such a put is kept as its .part file rather than renamed.
+ */
+int upload_ended(off_t size, int framed, int level) {
+    return size >= 0 || framed || level > 0;
+}
+
+/* Checks the upload is whole before it replaces anything. */
+static int commit_check(int file_fd, off_t size) {
+    struct stat st;
+    if (size < 0) {
+        return 0;
+    }
+    if (fstat(file_fd, &st) < 0) {
+        return -1;
+    }
+    if (st.st_size != size) {
+        errno = EPIPE;
+        return -1;
+    }
+    return 0;
+}
+
+static void group_flush(struct commit *batch) {
+    struct stat st[COMMIT_BATCH];
+    int n = 0;
+
+    for (struct commit *c = batch; c != NULL; c = c->next) {
+        c->parent_fd = -1;
+        if (c->error == 0 && commit_check(c->file_fd, c->size) < 0) {
+            c->error = errno;
+        }
+        if (c->error == 0 && c->temp[0] != '\0' && (c->parent_fd = parent_dir(c->dir_fd, c->name)) < 0) {
+            c->error = errno;
+        }
+        if (c->error == 0 && c->temp[0] != '\0') {
+            keep_mode(c->file_fd, c->dir_fd, c->name);
+        }
+        if (c->error == 0) {
+            sync_file_range(c->file_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        }
+    }
+    for (struct commit *c = batch; c != NULL; c = c->next) {
+        if (c->error == 0 && fdatasync(c->file_fd) < 0) {
+            c->error = errno;
+        }
+        if (c->error == 0 && c->temp[0] != '\0' &&
+            renameat(c->parent_fd, base_name(c->temp), c->parent_fd, base_name(c->name)) < 0) {
+            c->error = errno;
+        }
+        if (c->error != 0) {
+            upload_discard(c->dir_fd, c->temp);
+        }
+    }
+
+    /* One fsync() per directory makes every rename in it durable. */
+    for (struct commit *c = batch; c != NULL; c = c->next) {
+        struct stat dir;
+        int seen = 0;
+        if (c->error == 0 && c->parent_fd >= 0 && fstat(c->parent_fd, &dir) == 0) {
+            for (int i = 0; i < n && !seen; i++) {
+                seen = st[i].st_dev == dir.st_dev && st[i].st_ino == dir.st_ino;
+            }
+            if (!seen && fsync(c->parent_fd) < 0) {
+                c->error = errno;
+            }
+            if (!seen && n < COMMIT_BATCH) {
+                st[n++] = dir;
+            }
+        }
+        if (c->parent_fd >= 0) {
+            close(c->parent_fd);
+        }
+    }
+}
+
+/* Reads the requests blocking callers sent; the descriptors come with them. */
+static struct commit *group_receive(struct commit *batch, int *count) {
+    while (*count < COMMIT_BATCH) {
+        struct commit_request req;
+        char control[CMSG_SPACE(3 * sizeof(int))];
+        struct iovec iov = { &req, sizeof(req) };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                              .msg_controllen = sizeof(control) };
+        ssize_t n = recvmsg(group.sock[0], &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+            break;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        int fds[3];
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+            continue;
+        }
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        struct commit *c = malloc(sizeof(*c));
+        if (c == NULL || n != sizeof(req)) {
+            int error = c == NULL ? ENOMEM : EPROTO;
+            write(fds[2], &error, sizeof(error));
+            close(fds[0]);
+            close(fds[1]);
+            close(fds[2]);
+            free(c);
+            continue;
+        }
+        c->file_fd = fds[0];
+        c->dir_fd = fds[1];
+        c->reply_fd = fds[2];
+        c->size = req.size;
+        c->error = 0;
+        c->task = NULL;
+        req.temp[sizeof(req.temp) - 1] = req.name[sizeof(req.name) - 1] = '\0';
+        memcpy(c->temp, req.temp, sizeof(c->temp));
+        memcpy(c->name, req.name, sizeof(c->name));
+        c->next = batch;
+        batch = c;
+        (*count)++;
+    }
+    return batch;
+}
+
+static void *group_flusher(void *arg) {
+    struct pollfd fds[2] = { { group.sock[0], POLLIN, 0 }, { group.wake_fd, POLLIN, 0 } };
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+
+        uint64_t wakes;
+        int count = 0;
+        read(group.wake_fd, &wakes, sizeof(wakes));
+        pthread_mutex_lock(&group.lock);
+        struct commit *batch = group.head;
+        group.head = group.tail = NULL;
+        pthread_mutex_unlock(&group.lock);
+        for (struct commit *c = batch; c != NULL; c = c->next) {
+            count++;
+        }
+        batch = group_receive(batch, &count);
+
+        group_flush(batch);
+
+        while (batch != NULL) {
+            struct commit *c = batch;
+            batch = c->next;
+            if (c->task != NULL) {
+                pool_complete(c->task);
+                continue;
+            }
+            write(c->reply_fd, &c->error, sizeof(c->error));
+            close(c->reply_fd);
+            close(c->file_fd);
+            close(c->dir_fd);
+            free(c);
+        }
+    }
+    return NULL;
+}
+
+/* Starts the group-commit flusher; must run before the server forks or starts threads. */
+int commit_start(void) {
+    pthread_t thread;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, group.sock) < 0) {
+        return -1;
+    }
+    group.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (group.wake_fd < 0 || fcntl(group.sock[0], F_SETFL, O_NONBLOCK) < 0 ||
+        pthread_create(&thread, NULL, group_flusher, NULL) != 0) {
+        close(group.sock[0]);
+        close(group.sock[1]);
+        if (group.wake_fd >= 0) {
+            close(group.wake_fd);
+        }
+        group.sock[0] = group.sock[1] = group.wake_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    group.pid = getpid();
+    group.running = 1;
+    return 0;
+}
+
+/* Hands a commit to the flusher and waits for it; -1 if it cannot be handed over. */
+static int group_commit(int file_fd, int dir_fd, const char *temp, const char *pathname, off_t size,
+                        int *error) {
+    struct commit_request req = { size, "", "" };
+    int reply[2];
+    int dir = dir_fd == AT_FDCWD ? open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC) : dir_fd;
+    int status = -1;
+
+    snprintf(req.temp, sizeof(req.temp), "%s", temp);
+    snprintf(req.name, sizeof(req.name), "%s", pathname);
+    if (dir < 0 || pipe2(reply, O_CLOEXEC) < 0) {
+        if (dir >= 0 && dir != dir_fd) {
+            close(dir);
+        }
+        return -1;
+    }
+
+    int fds[3] = { file_fd, dir, reply[1] };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { &req, sizeof(req) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control,
+                          .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t n;
+    do {
+        n = sendmsg(group.sock[1], &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    close(reply[1]);
+    if (dir != dir_fd) {
+        close(dir);
+    }
+    if (n == sizeof(req)) {
+        do {
+            n = read(reply[0], error, sizeof(*error));
+        } while (n < 0 && errno == EINTR);
+        status = n == sizeof(*error) ? 0 : -1;
+    }
+    close(reply[0]);
+    return status;
+}
+
+/*
+ * Makes a finished upload visible, as durable as mode asks: renames temp
+ * over pathname, or with an empty temp only syncs file_fd.  On failure the
+ * staging file is dropped with upload_discard() and pathname left as it was.
+ */
+int upload_commit(int file_fd, int dir_fd, const char *temp, const char *pathname, off_t size, int mode) {
+    int error = 0;
+
+    if (mode == DURABLE_GROUP && group.running && group_commit(file_fd, dir_fd, temp, pathname, size, &error) == 0) {
+        errno = error;
+        return error == 0 ? 0 : -1;
+    }
+
+    /* Without a flusher a group commit is a plain synchronous one. */
+    if (commit_check(file_fd, size) < 0 || (mode != DURABLE_NONE && fdatasync(file_fd) < 0)) {
+        upload_discard(dir_fd, temp);
+        return -1;
+    }
+    if (temp[0] != '\0') {
+        keep_mode(file_fd, dir_fd, pathname);
+    }
+    if (temp[0] != '\0' && renameat(dir_fd, temp, dir_fd, pathname) < 0) {
+        upload_discard(dir_fd, temp);
+        return -1;
+    }
+    if (mode != DURABLE_NONE && temp[0] != '\0') {
+        int parent = parent_dir(dir_fd, pathname);
+        int status = parent < 0 ? -1 : fsync(parent);
+        if (parent >= 0) {
+            close(parent);
+        }
+        return status;
+    }
+    return 0;
+}
+
+/*
+ * Queues a group commit without waiting: c->file_fd and c->dir_fd stay the
+ * caller's, and c->task is completed on its pool completion queue with the
+ * result in c->error.  Returns -1, queueing nothing, if this process has
+ * no flusher.
+ */
+int upload_commit_async(struct commit *c) {
+    uint64_t one = 1;
+
+    if (!group.running || group.pid != getpid()) {
+        return -1;
+    }
+    c->reply_fd = -1;
+    c->error = 0;
+    c->next = NULL;
+    pthread_mutex_lock(&group.lock);
+    if (group.tail != NULL) {
+        group.tail->next = c;
+    } else {
+        group.head = c;
+    }
+    group.tail = c;
+    pthread_mutex_unlock(&group.lock);
+    write(group.wake_fd, &one, sizeof(one));
+    return 0;
+}
@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <zlib.h>
+#include <sys/stat.h>
+
+#include "myftp.h"
+
+/*
+ * Delta transfers (U and V), rsync style.
+ *
+ * The side that already holds a copy of the file, the receiver, cuts it
+ * into blocks and sends one signature per block: a rolling weak sum and a
+ * 64-bit strong sum (CRC32C and zlib's CRC-32 of the block).  The sender
+ * slides a window over its copy a byte at a time, looks the weak sum up in
+ * a hash of the signatures, confirms hits with the strong sum, and sends
+ * references to the blocks it found plus the literal bytes in between.
+ * The receiver builds the new file next to the old one, copying referenced
+ * blocks inside the kernel with copy_file_range(), checks it against the
+ * CRC32C the sender ends with and renames it over the old copy.
+ *
+ * Both messages go over one data connection, raw on D or inside frames on K:
+ *   signatures  be32 block size, be32 count, count x (be32 weak, be32 crc32c, be32 crc32)
+ *   delta       'L' be32 length + bytes, 'C' be32 first block + be32 blocks,
+ *               'E' be64 file size + be32 crc32c of the whole file
+ */
+
+struct delta_sig {
+    uint32_t weak;
+    uint32_t crc32c;
+    uint32_t crc32;
+    int next;
+};
+
+struct delta_index {
+    uint32_t block_size;
+    uint32_t count;
+    uint32_t mask;
+    int *heads;
+    struct delta_sig *sigs;
+};
+
+static unsigned int temp_serial;
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/* About sqrt(size), as rsync picks it: fewer signatures for big files, finer matches for small ones. */
+static uint32_t delta_block_size(off_t size) {
+    uint32_t block = (uint32_t)sqrt((double)size) & ~1023u;
+    if (block < DELTA_MIN_BLOCK) {
+        return DELTA_MIN_BLOCK;
+    }
+    return block > DELTA_MAX_BLOCK ? DELTA_MAX_BLOCK : block;
+}
+
+static uint32_t weak_sum(const unsigned char *p, uint32_t len, uint32_t *a, uint32_t *b) {
+    uint32_t s1 = 0, s2 = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        s1 += p[i];
+        s2 += (len - i) * p[i];
+    }
+    *a = s1;
+    *b = s2;
+    return (s1 & 0xffff) | s2 << 16;
+}
+
+static uint32_t weak_bucket(uint32_t weak, uint32_t mask) {
+    return (weak * 2654435761u) >> 7 & mask;
+}
+
+/* Signatures of every whole block of old_fd (none when old_fd < 0), written to s. */
+static int send_signatures(struct data_stream *s, int old_fd, uint32_t *block_size) {
+    struct stat st;
+    off_t size = old_fd >= 0 && fstat(old_fd, &st) == 0 ? st.st_size : 0;
+    uint32_t block = delta_block_size(size);
+    uint32_t count = size / block > DELTA_MAX_BLOCKS ? DELTA_MAX_BLOCKS : size / block;
+    size_t chunk = DELTA_SCAN_SIZE / block * block;
+    unsigned char header[8], sig[12];
+    unsigned char *buffer = count > 0 ? malloc(chunk) : NULL;
+
+    *block_size = block;
+    put_be32(header, block);
+    put_be32(header + 4, count);
+    if ((count > 0 && buffer == NULL) || data_stream_write(s, header, sizeof(header)) < 0) {
+        free(buffer);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; ) {
+        size_t want = (size_t)(count - i) * block < chunk ? (size_t)(count - i) * block : chunk;
+        size_t got = 0;
+        while (got < want) {
+            ssize_t n = pread(old_fd, buffer + got, want - got, (off_t)i * block + got);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                free(buffer);
+                errno = n == 0 ? EIO : errno;
+                return -1;
+            }
+            got += n;
+        }
+        for (size_t off = 0; off < want; off += block, i++) {
+            uint32_t a, b;
+            put_be32(sig, weak_sum(buffer + off, block, &a, &b));
+            put_be32(sig + 4, crc32c(0, buffer + off, block));
+            put_be32(sig + 8, crc32(0, buffer + off, block));
+            if (data_stream_write(s, sig, sizeof(sig)) < 0) {
+                free(buffer);
+                return -1;
+            }
+        }
+    }
+    free(buffer);
+    return data_stream_finish(s);
+}
+
+static void index_free(struct delta_index *index) {
+    free(index->heads);
+    free(index->sigs);
+}
+
+static int read_signatures(struct data_stream *s, struct delta_index *index) {
+    unsigned char header[8], sig[12];
+
+    memset(index, 0, sizeof(*index));
+    if (data_stream_read(s, header, sizeof(header)) < 0) {
+        return -1;
+    }
+    index->block_size = get_be32(header);
+    index->count = get_be32(header + 4);
+    if (index->block_size < DELTA_MIN_BLOCK || index->block_size > DELTA_MAX_BLOCK ||
+        index->count > DELTA_MAX_BLOCKS) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    /* count is only the sender's word: grow the signatures as they arrive, and hash them after. */
+    uint32_t cap = 0;
+    for (uint32_t i = 0; i < index->count; i++) {
+        if (i == cap) {
+            cap = cap > 0 ? cap * 2 : 1024;
+            cap = cap < index->count ? cap : index->count;
+            struct delta_sig *grown = realloc(index->sigs, cap * sizeof(*index->sigs));
+            if (grown == NULL) {
+                index_free(index);
+                errno = ENOMEM;
+                return -1;
+            }
+            index->sigs = grown;
+        }
+        if (data_stream_read(s, sig, sizeof(sig)) < 0) {
+            index_free(index);
+            return -1;
+        }
+        struct delta_sig *d = &index->sigs[i];
+        d->weak = get_be32(sig);
+        d->crc32c = get_be32(sig + 4);
+        d->crc32 = get_be32(sig + 8);
+    }
+    if (data_stream_end(s) < 0) {
+        index_free(index);
+        return -1;
+    }
+
+    index->mask = 1;
+    while (index->mask < index->count * 2) {
+        index->mask <<= 1;
+    }
+    index->mask--;
+    index->heads = malloc((index->mask + 1) * sizeof(*index->heads));
+    if (index->heads == NULL) {
+        index_free(index);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(index->heads, -1, (index->mask + 1) * sizeof(*index->heads));
+
+    /* Chained newest first, so runs of identical blocks find the lowest index last; either is correct. */
+    for (uint32_t i = 0; i < index->count; i++) {
+        struct delta_sig *d = &index->sigs[i];
+        uint32_t bucket = weak_bucket(d->weak, index->mask);
+        d->next = index->heads[bucket];
+        index->heads[bucket] = i;
+    }
+    return 0;
+}
+
+/* The block whose signature matches the window at p, or -1; prefer the one after the last match. */
+static int find_block(const struct delta_index *index, const unsigned char *p, uint32_t weak, long hint) {
+    int found = -1;
+    int strong = 0;
+    uint32_t c1 = 0, c2 = 0;
+
+    for (int i = index->heads[weak_bucket(weak, index->mask)]; i >= 0; i = index->sigs[i].next) {
+        const struct delta_sig *d = &index->sigs[i];
+        if (d->weak != weak) {
+            continue;
+        }
+        if (!strong) {
+            c1 = crc32c(0, p, index->block_size);
+            c2 = crc32(0, p, index->block_size);
+            strong = 1;
+        }
+        if (d->crc32c == c1 && d->crc32 == c2) {
+            found = i;
+            if (i == hint) {
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+static int emit_literal(struct data_stream *s, const unsigned char *p, size_t len, struct delta_stats *stats) {
+    unsigned char record[5] = { 'L' };
+    if (len == 0) {
+        return 0;
+    }
+    put_be32(record + 1, len);
+    if (stats != NULL) {
+        stats->literal += len;
+    }
+    return data_stream_write(s, record, sizeof(record)) < 0 ? -1 : data_stream_write(s, p, len);
+}
+
+static int emit_copy(struct data_stream *s, long first, uint32_t blocks) {
+    unsigned char record[9] = { 'C' };
+    if (blocks == 0) {
+        return 0;
+    }
+    put_be32(record + 1, first);
+    put_be32(record + 5, blocks);
+    return data_stream_write(s, record, sizeof(record));
+}
+
+/*
+ * Sender side: reads the receiver's signatures from sock_fd, then sends
+ * file_fd from the start as block references and literal data.
+ */
+int delta_send(int sock_fd, int framed, int file_fd, struct delta_stats *stats) {
+    struct data_stream *s = data_stream_open(sock_fd, framed);
+    struct delta_index index;
+    if (s == NULL) {
+        return -1;
+    }
+    if (read_signatures(s, &index) < 0) {
+        data_stream_close(s);
+        return -1;
+    }
+
+    uint32_t block = index.block_size;
+    size_t size = DELTA_SCAN_SIZE + DELTA_MAX_BLOCK;
+    unsigned char *buf = malloc(size);
+    size_t len = 0, pos = 0, lit = 0;
+    off_t offset = 0;
+    uint32_t a = 0, b = 0, crc = 0;
+    int rolling = 0, eof = 0, status = 0;
+    long copy_first = -1;
+    uint32_t copy_blocks = 0;
+
+    if (buf == NULL) {
+        status = -1;
+    }
+
+    while (status == 0) {
+        if (!eof && len - pos <= block) {
+            memmove(buf, buf + lit, len - lit);
+            len -= lit;
+            pos -= lit;
+            lit = 0;
+            ssize_t n = pread(file_fd, buf + len, size - len, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                status = -1;
+                break;
+            }
+            eof = n == 0;
+            crc = crc32c(crc, buf + len, n);
+            offset += n;
+            len += n;
+            continue;
+        }
+        if (index.count == 0 || len - pos < block) {
+            break;
+        }
+
+        if (!rolling) {
+            weak_sum(buf + pos, block, &a, &b);
+            rolling = 1;
+        }
+        uint32_t weak = (a & 0xffff) | b << 16;
+        long hint = copy_first >= 0 ? copy_first + copy_blocks : -1;
+        int match = find_block(&index, buf + pos, weak, hint);
+        if (match >= 0) {
+            /* Runs of consecutive blocks go out as one reference. */
+            if (pos > lit || match != hint) {
+                if (emit_copy(s, copy_first, copy_blocks) < 0 ||
+                    emit_literal(s, buf + lit, pos - lit, stats) < 0) {
+                    status = -1;
+                    break;
+                }
+                copy_first = match;
+                copy_blocks = 0;
+            }
+            copy_blocks++;
+            if (stats != NULL) {
+                stats->matched += block;
+            }
+            pos += block;
+            lit = pos;
+            rolling = 0;
+            continue;
+        }
+
+        if (pos + block >= len) {
+            /* At end of file with no byte left to roll in. */
+            break;
+        }
+        uint32_t out = buf[pos], in = buf[pos + block];
+        a += in - out;
+        b += a - block * out;
+        pos++;
+        if (pos - lit >= DELTA_LITERAL_MAX) {
+            if (emit_copy(s, copy_first, copy_blocks) < 0 ||
+                emit_literal(s, buf + lit, pos - lit, stats) < 0) {
+                status = -1;
+                break;
+            }
+            copy_first = -1;
+            copy_blocks = 0;
+            lit = pos;
+        }
+    }
+
+    /* The unmatched tail, read to the end when there were no signatures to match. */
+    while (status == 0) {
+        if (emit_copy(s, copy_first, copy_blocks) < 0 || emit_literal(s, buf + lit, len - lit, stats) < 0) {
+            status = -1;
+            break;
+        }
+        copy_first = -1;
+        copy_blocks = 0;
+        lit = len = 0;
+        if (eof) {
+            break;
+        }
+        ssize_t n = pread(file_fd, buf, DELTA_LITERAL_MAX, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            status = -1;
+            break;
+        }
+        eof = n == 0;
+        crc = crc32c(crc, buf, n);
+        offset += n;
+        len = n;
+    }
+
+    if (status == 0) {
+        unsigned char end[13] = { 'E' };
+        put_be32(end + 1, (uint64_t)offset >> 32);
+        put_be32(end + 5, offset);
+        put_be32(end + 9, crc);
+        status = data_stream_write(s, end, sizeof(end)) < 0 ? -1 : data_stream_finish(s);
+    }
+
+    free(buf);
+    index_free(&index);
+    data_stream_close(s);
+    return status;
+}
+
+/*
+ * Receiver side: sends signatures of old_fd (which may be -1 for no old
+ * copy) and writes the file the delta describes to new_fd.
+ */
+int delta_receive(int sock_fd, int framed, int old_fd, int new_fd, struct delta_stats *stats) {
+    struct data_stream *s = data_stream_open(sock_fd, framed);
+    unsigned char record[13];
+    unsigned char *literal = malloc(DELTA_LITERAL_MAX);
+    uint32_t block;
+    off_t written = 0;
+    int status = -1;
+
+    if (s == NULL || literal == NULL || send_signatures(s, old_fd, &block) < 0) {
+        free(literal);
+        data_stream_close(s);
+        return -1;
+    }
+
+    while (data_stream_read(s, record, 1) == 0) {
+        if (record[0] == 'L') {
+            if (data_stream_read(s, record + 1, 4) < 0) {
+                break;
+            }
+            uint32_t len = get_be32(record + 1);
+            while (len > 0) {
+                uint32_t n = len < DELTA_LITERAL_MAX ? len : DELTA_LITERAL_MAX;
+                if (data_stream_read(s, literal, n) < 0 || write_all(new_fd, (char *)literal, n) < 0) {
+                    break;
+                }
+                written += n;
+                len -= n;
+            }
+            if (len > 0) {
+                break;
+            }
+            if (stats != NULL) {
+                stats->literal += get_be32(record + 1);
+            }
+
+        } else if (record[0] == 'C') {
+            if (data_stream_read(s, record + 1, 8) < 0) {
+                break;
+            }
+            off_t first = get_be32(record + 1), count = get_be32(record + 5);
+            off_t len = count * block;
+            if (old_fd < 0 || copy_file_data(old_fd, first * block, new_fd, len) < 0) {
+                errno = old_fd < 0 ? EPROTO : errno;
+                break;
+            }
+            written += len;
+            if (stats != NULL) {
+                stats->matched += len;
+            }
+
+        } else if (record[0] == 'E') {
+            uint32_t crc;
+            if (data_stream_read(s, record + 1, 12) < 0 || data_stream_end(s) < 0) {
+                break;
+            }
+            off_t size = (off_t)get_be32(record + 1) << 32 | get_be32(record + 5);
+            if (size != written || crc32c_file(new_fd, &crc) < 0 || crc != get_be32(record + 9)) {
+                errno = EIO;
+                break;
+            }
+            status = 0;
+            break;
+
+        } else {
+            errno = EPROTO;
+            break;
+        }
+    }
+
+    free(literal);
+    data_stream_close(s);
+    return status;
+}
+
+/* Creates the file a delta is rebuilt in, hidden beside pathname so rename() can replace it. */
+int delta_temp_file(int dir_fd, const char *pathname, char *temp, size_t size) {
+    const char *slash = strrchr(pathname, '/');
+    int dir_len = slash != NULL ? slash - pathname + 1 : 0;
+
+    if (pathname[dir_len] == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
+    for (int tries = 0; tries < 16; tries++) {
+        unsigned int serial = __atomic_fetch_add(&temp_serial, 1, __ATOMIC_RELAXED);
+        if ((size_t)snprintf(temp, size, "%.*s.%s.delta-%d-%u", dir_len, pathname, pathname + dir_len,
+                             (int)getpid(), serial) >= size) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        int fd = openat(dir_fd, temp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0 || errno != EEXIST) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/* Names the staging file a put of pathname writes to, .<name>.part beside it. */
+int upload_part_name(const char *pathname, char *part, size_t size) {
+    const char *slash = strrchr(pathname, '/');
+    int dir_len = slash != NULL ? slash - pathname + 1 : 0;
+
+    if (pathname[dir_len] == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
+    if ((size_t)snprintf(part, size, "%.*s.%s" UPLOAD_PART_SUFFIX, dir_len, pathname, pathname + dir_len) >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Receives a delta for pathname into temp_fd (made by delta_temp_file())
+ * and, if it checks out, renames it over pathname with the old file's
+ * permissions.  The temporary file is removed either way.
+ */
+int delta_rebuild(int sock_fd, int framed, int dir_fd, const char *pathname, int temp_fd, const char *temp,
+                  struct delta_stats *stats) {
+    struct stat st;
+    int old_fd = openat(dir_fd, pathname, O_RDONLY | O_CLOEXEC);
+    if (old_fd >= 0 && (fstat(old_fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+        close(old_fd);
+        old_fd = -1;
+    }
+
+    int status = delta_receive(sock_fd, framed, old_fd, temp_fd, stats);
+    if (status == 0 && old_fd >= 0) {
+        fchmod(temp_fd, st.st_mode & 07777);
+    }
+    if (status == 0) {
+        status = renameat(dir_fd, temp, dir_fd, pathname);
+    }
+    if (status < 0) {
+        int error = errno;
+        unlinkat(dir_fd, temp, 0);
+        errno = error;
+    }
+    if (old_fd >= 0) {
+        close(old_fd);
+    }
+    return status;
+}
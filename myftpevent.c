@@ -0,0 +1,1763 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "myftp.h"
+
+/*
+ * Event-driven server mode.
+ *
+ * Each reactor thread owns an epoll instance and a share of the sessions.
+ * A session is a small state machine: it parses commands from the control
+ * socket until a L/G/P needs the data connection, then pumps bytes between
+ * the data socket and a file (or a directory listing) until the transfer
+ * finishes, and only then goes back to parsing commands.  Every socket is
+ * non-blocking and the working directory is kept per session in dir_fd,
+ * since chdir() would be shared by every session in the process.
+ *
+ * Opens, stats, directory reads, compression and the file side of every
+ * transfer chunk run on the worker pool instead of the reactor: the
+ * reactor waits for the data socket to be ready, and a worker moves bytes
+ * until it would block (only hot-cache hits, which never touch the disk,
+ * are sent inline).  A session with a task in flight is busy: it parses
+ * no commands and ignores its data socket until the task comes back on
+ * the reactor's completion queue.
+ *
+ * A shaped transfer that runs out of credit stops watching its data
+ * socket and arms a per-session timerfd for when the shaper lets it go on.
+ */
+
+#define MAX_EVENTS 64
+#define PUMP_BUDGET 16
+
+enum { EV_LISTEN, EV_CONTROL, EV_DATA_LISTEN, EV_DATA, EV_NOTIFY, EV_POOL, EV_TIMER };
+enum { XFER_NONE, XFER_ACCEPT, XFER_GET, XFER_PUT, XFER_LIST, XFER_STRIPED, XFER_DELTA };
+enum { TASK_OPEN, TASK_RCD, TASK_SIZE, TASK_SUM, TASK_PREFIX_SUM, TASK_LIST_OPEN, TASK_LIST_NEXT, TASK_ENCODE, TASK_DECODE,
+       TASK_SEND, TASK_RECV, TASK_COMMIT };
+
+struct session;
+
+/* Striped and delta transfers run on their own thread and report back through notify_fd. */
+struct thread_task {
+    int listen_fd;
+    int file_fd;
+    int notify_fd;
+    int streams;
+    size_t chunk_size;
+    off_t offset;
+    int get;
+    int data_fd;
+    int dir_fd;
+    int framed;
+    char cmd;
+    int durability;
+    off_t size;
+    char path[BUFFER_SIZE];
+    char temp[BUFFER_SIZE];
+};
+
+struct ev_handle {
+    int kind;
+    int fd;
+    int registered;
+    struct session *s;
+};
+
+struct reactor {
+    int epfd;
+    int cpu;
+    struct ev_handle listen;
+    struct ev_handle pool;
+    struct completion_queue done;
+    struct session *dead;
+    pthread_t thread;
+};
+
+struct session {
+    struct reactor *r;
+    struct session *next_dead;
+    int id;
+    int dir_fd;
+    int closed;
+    int quitting;
+    int hangup;
+    struct ev_handle ctrl;
+    struct ev_handle data_listen;
+    struct ev_handle data;
+    struct ev_handle notify;
+    struct ev_handle timer;
+    struct line_reader reader;
+    char out[BUFFER_SIZE];
+    size_t out_len;
+    int xfer;
+    int keep_data;
+    int data_buffer;
+    int stripe_listen_fd;
+    int stripe_streams;
+    size_t stripe_chunk;
+    int framed;
+    char xfer_cmd;
+    char path[BUFFER_SIZE];
+    int file_fd;
+    off_t offset;
+    off_t file_size;
+    off_t frame_left;
+    int frame_end;
+    uint32_t header;
+    size_t header_off;
+    off_t upload_size;
+    off_t restart_offset;
+    int compress_level;
+    int xfer_level;
+    int durability;
+    int xfer_durability;
+    struct commit commit;
+    unsigned char *zbuf;
+    unsigned char *zscratch;
+    size_t zlen;
+    size_t zoff;
+    int splice_pipe[2];
+    struct dir_lister *lister;
+    int hot;
+    off_t hot_start;
+    int busy;
+    int task_op;
+    int task_fd;
+    int task_error;
+    ssize_t task_len;
+    size_t task_want;
+    struct pool_task task;
+    char task_reply[256];
+    char temp[BUFFER_SIZE];
+    struct shaper shape;
+    char cmd;
+    uint64_t cmd_start;
+    struct io_counters io;
+    struct io_counters io_start;
+    char buf[IO_BUFFER_SIZE];
+    size_t buf_len;
+    size_t buf_off;
+};
+
+static int next_session_id = 1;
+
+static void ev_watch(struct session *s, struct ev_handle *h, unsigned int events) {
+    struct epoll_event ev;
+    if (h->fd < 0) {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(s->r->epfd, h->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, h->fd, &ev) == 0) {
+        h->registered = 1;
+    }
+}
+
+static void ev_close(struct session *s, struct ev_handle *h) {
+    if (h->fd < 0) {
+        return;
+    }
+    if (h->registered) {
+        epoll_ctl(s->r->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+        h->registered = 0;
+    }
+    close(h->fd);
+    h->fd = -1;
+}
+
+/* Stops watching a handle without closing it; ev_watch() re-adds it. */
+static void ev_pause(struct session *s, struct ev_handle *h) {
+    if (h->fd >= 0 && h->registered) {
+        epoll_ctl(s->r->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+        h->registered = 0;
+    }
+}
+
+static void session_update_ctrl(struct session *s) {
+    unsigned int events = 0;
+    if (!s->quitting && !s->hangup && s->reader.count < LINE_BUFFER_SIZE) {
+        events |= EPOLLIN;
+    }
+    if (s->out_len > 0) {
+        events |= EPOLLOUT;
+    }
+    ev_watch(s, &s->ctrl, events);
+}
+
+/* Frees what a pool task may still be using; deferred while the session is busy. */
+static void session_release(struct session *s) {
+    shape_end(&s->shape);
+    if (s->hot >= 0) {
+        hotcache_release(s->hot, 0);
+    }
+    if (s->commit.file_fd >= 0) {
+        upload_discard(s->dir_fd, s->temp);
+    }
+    if (s->file_fd >= 0) {
+        close(s->file_fd);
+    }
+    if (s->stripe_listen_fd >= 0) {
+        close(s->stripe_listen_fd);
+    }
+    close_splice_pipe(s->splice_pipe);
+    slab_free(SLAB_BLOCK, s->zbuf);
+    slab_free(SLAB_BLOCK, s->zscratch);
+    s->zbuf = s->zscratch = NULL;
+    if (s->lister != NULL) {
+        dir_lister_close(s->lister);
+        s->lister = NULL;
+    }
+    close(s->dir_fd);
+
+    /* Freed once the current batch of events has been dispatched. */
+    s->next_dead = s->r->dead;
+    s->r->dead = s;
+}
+
+static void session_close(struct session *s) {
+    if (s->closed) {
+        return;
+    }
+    s->closed = 1;
+    ev_close(s, &s->ctrl);
+    ev_close(s, &s->data_listen);
+    ev_close(s, &s->data);
+    ev_close(s, &s->notify);
+    ev_close(s, &s->timer);
+    stats_sessions(-1);
+
+    log_event(LOG_INFO, LOG_QUIT, s->id, NULL, 0);
+
+    if (!s->busy) {
+        session_release(s);
+    }
+}
+
+static void session_flush(struct session *s) {
+    while (s->out_len > 0) {
+        ssize_t n = write(s->ctrl.fd, s->out, s->out_len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            session_close(s);
+            return;
+        }
+        memmove(s->out, s->out + n, s->out_len - n);
+        s->out_len -= n;
+    }
+
+    if (s->quitting && s->out_len == 0) {
+        session_close(s);
+        return;
+    }
+    session_update_ctrl(s);
+}
+
+static void session_reply(struct session *s, const char *msg) {
+    size_t len = strlen(msg);
+    if (s->closed) {
+        return;
+    }
+    if (s->out_len + len > sizeof(s->out)) {
+        session_close(s);
+        return;
+    }
+    memcpy(s->out + s->out_len, msg, len);
+    s->out_len += len;
+    session_flush(s);
+}
+
+static void session_process(struct session *s);
+
+/* Swaps a GET's file for its copy in the hot-file cache, when there is one. */
+static void session_open_hot(struct session *s) {
+    off_t base, size;
+    s->hot = hotcache_acquire(s->task_fd, &base, &size);
+    if (s->hot < 0) {
+        return;
+    }
+    int fd = s->offset <= size ? fcntl(hotcache_fd, F_DUPFD_CLOEXEC, 0) : -1;
+    if (fd < 0) {
+        hotcache_release(s->hot, 0);
+        s->hot = -1;
+        return;
+    }
+    close(s->task_fd);
+    s->task_fd = fd;
+    s->offset += base;
+    s->file_size = base + size;
+    s->hot_start = s->offset;
+}
+
+/*
+ * Moves up to want bytes between the file and the data socket, until the
+ * socket would block: the whole of a chunk's file I/O, run on a pool
+ * worker.  Returns the bytes moved, with errno EAGAIN if it stopped short
+ * for the socket and 0 otherwise, or what the first move returned.
+ */
+static ssize_t session_move_chunk(struct session *s, int get, size_t want) {
+    size_t done = 0;
+
+    while (done < want) {
+        ssize_t n = get ? send_file_chunk(s->data.fd, s->file_fd, &s->offset, want - done)
+                        : recv_file_chunk(s->file_fd, s->data.fd, s->splice_pipe, want - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 && done == 0) {
+            return n;
+        }
+        if (n <= 0) {
+            /* Report what moved: a full socket keeps its EAGAIN, EOF or an error shows on the next chunk. */
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                errno = 0;
+            }
+            return done;
+        }
+        done += n;
+    }
+    errno = 0;
+    return done;
+}
+
+/* Runs on a pool worker; touches only what the busy session leaves alone. */
+static void session_task_exec(struct session *s) {
+    int get = s->xfer_cmd == 'G' || s->xfer_cmd == 'V';
+    size_t header_len = s->framed ? sizeof(s->header) : 0;
+    struct stat st;
+
+    errno = 0;
+    switch (s->task_op) {
+    case TASK_OPEN:
+        if (s->xfer_cmd == 'X' && store_fd < 0) {
+            s->task_fd = -1;
+            break;
+        }
+        if (s->xfer_cmd == 'U' || s->xfer_cmd == 'X') {
+            s->task_fd = delta_temp_file(s->dir_fd, s->path, s->temp, sizeof(s->temp));
+            break;
+        }
+        s->task_fd = get ? open_transfer_file(s->dir_fd, s->path, 1, s->offset)
+                         : upload_open(s->dir_fd, s->path, s->offset, s->temp, sizeof(s->temp));
+        s->task_error = errno;
+        if (s->task_fd >= 0 && get) {
+            s->file_size = fstat(s->task_fd, &st) == 0 ? st.st_size : 0;
+            if (s->xfer_cmd == 'G' && s->xfer_level == 0 && s->stripe_listen_fd < 0) {
+                session_open_hot(s);
+            }
+        } else if (s->task_fd >= 0) {
+            preallocate_file(s->task_fd, s->upload_size);
+        }
+        return;
+    case TASK_RCD:
+        s->task_fd = openat(s->dir_fd, s->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        break;
+    case TASK_SIZE:
+        size_reply(s->dir_fd, s->path, s->task_reply, sizeof(s->task_reply));
+        break;
+    case TASK_SUM:
+        checksum_reply(s->dir_fd, s->path, s->task_reply, sizeof(s->task_reply));
+        break;
+    case TASK_PREFIX_SUM:
+        prefix_checksum_reply(s->dir_fd, s->path, s->task_reply, sizeof(s->task_reply));
+        break;
+    case TASK_LIST_OPEN:
+        s->lister = s->xfer_cmd == 'S' ? stats_listing() : open_listing(s->dir_fd, s->xfer_cmd, s->path);
+        break;
+    case TASK_LIST_NEXT:
+        s->task_len = dir_lister_next(s->lister, s->buf + header_len, sizeof(s->buf) - header_len);
+        break;
+    case TASK_ENCODE:
+        s->task_len = encode_block(s->file_fd, &s->offset, s->zbuf, s->zscratch, s->xfer_level);
+        break;
+    case TASK_DECODE:
+        s->task_len = decode_block(s->file_fd, s->frame_left, s->zbuf, s->zscratch);
+        break;
+    case TASK_SEND:
+    case TASK_RECV:
+        s->task_len = session_move_chunk(s, s->task_op == TASK_SEND, s->task_want);
+        break;
+    case TASK_COMMIT:
+        errno = s->commit.error;
+        s->commit.error = finish_upload(s->file_fd, s->dir_fd, s->temp, s->path, s->commit.size,
+                                        s->xfer_durability, s->commit.error != 0 ? -1 : 0);
+        break;
+    }
+    s->task_error = errno;
+}
+
+static void session_task_run(struct pool_task *task) {
+    struct session *s = task->arg;
+    struct io_counters *account = io_account;
+
+    io_account = &s->io;
+    session_task_exec(s);
+    io_account = account;
+}
+
+static void session_submit(struct session *s, int op) {
+    s->busy = 1;
+    s->task_op = op;
+    s->task = (struct pool_task){ session_task_run, s, &s->r->done, NULL };
+    if (s->xfer != XFER_NONE) {
+        ev_pause(s, &s->data);
+    }
+    pool_submit(&s->task);
+}
+
+/* The transfer never started; a one-shot data connection is spent. */
+static void session_abandon_xfer(struct session *s) {
+    if (!s->keep_data) {
+        ev_close(s, &s->data);
+    }
+    s->framed = 0;
+}
+
+/*
+ * A put's data is all in: rename it into place (or drop it, if error is
+ * set) off the reactor.  Group commits go straight to the flusher, which
+ * completes the session's task itself.
+ */
+static void session_commit(struct session *s, int error) {
+    s->commit.error = error;
+    if (error == 0 && s->xfer_durability == DURABLE_GROUP) {
+        s->busy = 1;
+        s->task_op = TASK_COMMIT;
+        s->task = (struct pool_task){ session_task_run, s, &s->r->done, NULL };
+        s->commit.dir_fd = s->dir_fd;
+        s->commit.task = &s->task;
+        snprintf(s->commit.temp, sizeof(s->commit.temp), "%s", s->temp);
+        snprintf(s->commit.name, sizeof(s->commit.name), "%s", s->path);
+        if (upload_commit_async(&s->commit) == 0) {
+            return;
+        }
+    }
+    session_submit(s, TASK_COMMIT);
+}
+
+static void session_committed(struct session *s) {
+    char response[256];
+
+    close(s->file_fd);
+    s->file_fd = -1;
+    if (s->commit.error != 0) {
+        log_event(LOG_ERROR, LOG_PUT_FAILED, s->id, s->path, s->commit.error);
+    }
+    if (s->xfer_durability >= 0) {
+        commit_reply(s->commit.error, response, sizeof(response));
+        session_reply(s, response);
+    }
+    s->xfer_durability = -1;
+}
+
+static void session_finish_xfer(struct session *s, int ok) {
+    int error = errno;
+
+    if (ok && s->xfer == XFER_PUT && s->commit.file_fd >= 0 &&
+        !upload_ended(s->commit.size, s->framed, s->zbuf != NULL)) {
+        ok = 0;
+        error = EPIPE;
+    }
+
+    if (s->xfer == XFER_GET && ok && s->file_size >= SOCK_MEASURE_MIN) {
+        s->data_buffer = sock_measure(s->data.fd, s->data_buffer);
+    }
+
+    /* Striped streams belong to the worker; s->data may be a parked K connection. */
+    if (s->xfer != XFER_STRIPED) {
+        if (s->framed && ok) {
+            /* Persistent data connection: park it until the next transfer. */
+            ev_watch(s, &s->data, 0);
+        } else {
+            ev_close(s, &s->data);
+        }
+    }
+    ev_close(s, &s->notify);
+    close_splice_pipe(s->splice_pipe);
+    shape_end(&s->shape);
+    if (s->file_fd >= 0 && s->commit.file_fd < 0) {
+        close(s->file_fd);
+        s->file_fd = -1;
+    }
+    if (s->hot >= 0) {
+        hotcache_release(s->hot, ok ? s->offset - s->hot_start : 0);
+        s->hot = -1;
+    }
+    slab_free(SLAB_BLOCK, s->zbuf);
+    slab_free(SLAB_BLOCK, s->zscratch);
+    s->zbuf = NULL;
+    s->zscratch = NULL;
+    s->zlen = 0;
+    s->zoff = 0;
+    s->xfer_level = 0;
+
+    int xfer = s->xfer;
+    s->xfer = XFER_NONE;
+    s->framed = 0;
+    s->frame_left = 0;
+    s->frame_end = 0;
+    s->header_off = 0;
+    s->buf_len = 0;
+    s->buf_off = 0;
+
+    if (xfer == XFER_LIST) {
+        char response[256];
+        error = ok ? dir_lister_error(s->lister) : error;
+        dir_lister_close(s->lister);
+        s->lister = NULL;
+        if (error == 0) {
+            snprintf(response, sizeof(response), "A\n");
+        } else {
+            listing_error_reply(s->xfer_cmd, error, response, sizeof(response));
+        }
+        session_reply(s, response);
+    }
+
+    if (s->commit.file_fd >= 0) {
+        session_commit(s, ok ? 0 : error != 0 ? error : EIO);
+    } else if (!s->closed) {
+        session_process(s);
+    }
+}
+
+/* Bytes the shaper lets the transfer move now; 0 once the timer is set to resume it. */
+static size_t session_shape(struct session *s, size_t want) {
+    uint64_t delay;
+    size_t n = shape_grant(&s->shape, want, &delay);
+    if (n > 0) {
+        return n;
+    }
+
+    if (s->timer.fd < 0) {
+        s->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+    struct itimerspec when = { { 0, 0 }, { delay / 1000000000ull, delay % 1000000000ull } };
+    if (s->timer.fd < 0 || timerfd_settime(s->timer.fd, 0, &when, NULL) < 0) {
+        /* No timer: go over the limit rather than stall. */
+        return want;
+    }
+    ev_pause(s, &s->data);
+    ev_watch(s, &s->timer, EPOLLIN);
+    return 0;
+}
+
+/* Streams a directory listing to the data connection one formatted batch at a time. */
+static void session_pump(struct session *s) {
+    for (int i = 0; i < PUMP_BUDGET; i++) {
+        if (s->buf_off == s->buf_len) {
+            if (s->frame_end) {
+                session_finish_xfer(s, 1);
+                return;
+            }
+            session_submit(s, TASK_LIST_NEXT);
+            return;
+        }
+
+        ssize_t n = write(s->data.fd, s->buf + s->buf_off, s->buf_len - s->buf_off);
+        io_count(1, 0, n);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n < 0) {
+            session_finish_xfer(s, 0);
+            return;
+        }
+        s->buf_off += n;
+    }
+
+    /* Blocked or out of budget: resume when the data socket drains. */
+    ev_watch(s, &s->data, EPOLLOUT);
+}
+
+static void session_list_batch(struct session *s) {
+    size_t header_len = s->framed ? sizeof(s->header) : 0;
+    ssize_t n = s->task_len;
+
+    if (n < 0 || (n == 0 && !s->framed)) {
+        errno = s->task_error;
+        session_finish_xfer(s, n == 0);
+        return;
+    }
+    if (s->framed) {
+        uint32_t header = htonl(n);
+        memcpy(s->buf, &header, sizeof(header));
+        s->frame_end = n == 0;
+    }
+    s->buf_len = n + header_len;
+    s->buf_off = 0;
+    session_pump(s);
+}
+
+/* Sends the rest of the pending frame header; 1 when done, 0 on EAGAIN, -1 on error. */
+static int session_send_header(struct session *s) {
+    const char *header = (const char *)&s->header;
+    while (s->header_off < sizeof(s->header)) {
+        ssize_t sent = send(s->data.fd, header + s->header_off, sizeof(s->header) - s->header_off,
+                            s->frame_end ? 0 : MSG_MORE);
+        io_count(1, 0, sent);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        s->header_off += sent;
+    }
+    return 1;
+}
+
+/* Reads the rest of the next frame header; 1 when done, 0 on EAGAIN, -1 on error or EOF. */
+static int session_recv_header(struct session *s) {
+    char *header = (char *)&s->header;
+    while (s->header_off < sizeof(s->header)) {
+        ssize_t received = read(s->data.fd, header + s->header_off, sizeof(s->header) - s->header_off);
+        io_count(1, received, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (received <= 0) {
+            return -1;
+        }
+        s->header_off += received;
+    }
+    s->header_off = 0;
+    s->frame_left = ntohl(s->header);
+    s->frame_end = s->frame_left == 0;
+    return 1;
+}
+
+/*
+ * Accounts for n bytes a chunk moved (blocked: it stopped for the socket).
+ * Returns 1 to go on, 0 to wait for the socket, -1 once the transfer ended.
+ */
+static int session_chunk_moved(struct session *s, ssize_t n, int blocked) {
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (n <= 0) {
+        /* EOF ends a raw transfer; inside a frame the file shrank or the client left. */
+        session_finish_xfer(s, n == 0 && !s->framed);
+        return -1;
+    }
+    shape_sent(&s->shape, n);
+    if (s->framed) {
+        s->frame_left -= n;
+    }
+    return !blocked;
+}
+
+static void session_send_file(struct session *s) {
+    for (int i = 0; i < PUMP_BUDGET; i++) {
+        if (s->framed && s->frame_left == 0) {
+            if (s->header_off == 0) {
+                off_t left = s->file_size - s->offset;
+                s->frame_left = left < IO_CHUNK_SIZE ? left : IO_CHUNK_SIZE;
+                s->frame_end = s->frame_left == 0;
+                s->header = htonl(s->frame_left);
+            }
+            int done = session_send_header(s);
+            if (done < 0) {
+                session_finish_xfer(s, 0);
+                return;
+            }
+            if (done == 0) {
+                break;
+            }
+            s->header_off = 0;
+            if (s->frame_end) {
+                session_finish_xfer(s, 1);
+                return;
+            }
+        }
+
+        size_t count = s->framed ? (size_t)s->frame_left : IO_CHUNK_SIZE;
+        if (!s->framed && s->hot >= 0) {
+            /* The cache arena goes on past this file: stop at its end, not at EOF. */
+            if (s->offset == s->file_size) {
+                session_finish_xfer(s, 1);
+                return;
+            }
+            if ((off_t)count > s->file_size - s->offset) {
+                count = s->file_size - s->offset;
+            }
+        }
+        if ((count = session_shape(s, count)) == 0) {
+            return;
+        }
+        if (s->hot < 0) {
+            /* sendfile() from a cold file waits on the disk: leave it to a pool worker. */
+            s->task_want = count;
+            session_submit(s, TASK_SEND);
+            return;
+        }
+        ssize_t sent = send_file_chunk(s->data.fd, s->file_fd, &s->offset, count);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        int more = session_chunk_moved(s, sent, 0);
+        if (more < 0) {
+            return;
+        }
+        if (more == 0) {
+            break;
+        }
+    }
+    ev_watch(s, &s->data, EPOLLOUT);
+}
+
+static void session_recv_file(struct session *s) {
+    if (s->framed && s->frame_left == 0) {
+        int done = session_recv_header(s);
+        if (done < 0) {
+            session_finish_xfer(s, 0);
+            return;
+        }
+        if (done == 0) {
+            ev_watch(s, &s->data, EPOLLIN);
+            return;
+        }
+        if (s->frame_end) {
+            session_finish_xfer(s, 1);
+            return;
+        }
+    }
+
+    size_t count = s->framed ? (size_t)s->frame_left : IO_CHUNK_SIZE;
+    if ((count = session_shape(s, count)) == 0) {
+        return;
+    }
+    /* Writing to the file can wait on the disk or on writeback: a pool worker does it. */
+    s->task_want = count;
+    session_submit(s, TASK_RECV);
+}
+
+/* A pool worker moved a chunk: carry on, or wait until the data socket is ready again. */
+static void session_chunk_done(struct session *s) {
+    int get = s->task_op == TASK_SEND;
+
+    errno = s->task_error;
+    int more = session_chunk_moved(s, s->task_len, s->task_error == EAGAIN || s->task_error == EWOULDBLOCK);
+    if (more > 0 && get) {
+        session_send_file(s);
+    } else if (more > 0) {
+        session_recv_file(s);
+    } else if (more == 0) {
+        ev_watch(s, &s->data, get ? EPOLLOUT : EPOLLIN);
+    }
+}
+
+/* Compressed GET: encode one block at a time and drain it before the next. */
+static void session_send_compressed(struct session *s) {
+    for (int i = 0; i < PUMP_BUDGET; i++) {
+        if (s->zoff == s->zlen) {
+            if (s->frame_end) {
+                session_finish_xfer(s, 1);
+                return;
+            }
+            session_submit(s, TASK_ENCODE);
+            return;
+        }
+
+        size_t count = session_shape(s, s->zlen - s->zoff);
+        if (count == 0) {
+            return;
+        }
+        ssize_t sent = write(s->data.fd, s->zbuf + s->zoff, count);
+        io_count(1, 0, sent);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (sent < 0) {
+            session_finish_xfer(s, 0);
+            return;
+        }
+        shape_sent(&s->shape, sent);
+        s->zoff += sent;
+    }
+    ev_watch(s, &s->data, EPOLLOUT);
+}
+
+/* Compressed PUT: collect a whole block, then decode it into the file. */
+static void session_recv_compressed(struct session *s) {
+    for (int i = 0; i < PUMP_BUDGET; i++) {
+        if (s->zlen == 0) {
+            int done = session_recv_header(s);
+            if (done < 0) {
+                session_finish_xfer(s, 0);
+                return;
+            }
+            if (done == 0) {
+                break;
+            }
+            if (s->frame_end) {
+                session_finish_xfer(s, 1);
+                return;
+            }
+            s->zlen = s->frame_left & ~FRAME_COMPRESSED;
+            s->zoff = 0;
+            if (s->zlen > COMPRESS_BLOCK_SIZE) {
+                session_finish_xfer(s, 0);
+                return;
+            }
+        }
+
+        size_t count = session_shape(s, s->zlen - s->zoff);
+        if (count == 0) {
+            return;
+        }
+        ssize_t received = read(s->data.fd, s->zbuf + s->zoff, count);
+        io_count(1, received, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (received <= 0) {
+            session_finish_xfer(s, 0);
+            return;
+        }
+        shape_sent(&s->shape, received);
+        s->zoff += received;
+        if (s->zoff == s->zlen) {
+            session_submit(s, TASK_DECODE);
+            return;
+        }
+    }
+    ev_watch(s, &s->data, EPOLLIN);
+}
+
+static void session_block_done(struct session *s) {
+    if (s->task_len < 0) {
+        errno = s->task_error;
+        session_finish_xfer(s, 0);
+    } else if (s->task_op == TASK_ENCODE) {
+        s->zlen = s->task_len;
+        s->zoff = 0;
+        s->frame_end = s->task_len == 4;
+        session_send_compressed(s);
+    } else {
+        s->zlen = 0;
+        s->frame_left = 0;
+        session_recv_compressed(s);
+    }
+}
+
+static void session_list_opened(struct session *s) {
+    if (s->lister == NULL) {
+        session_reply(s, "EError allocating directory listing\n");
+        session_abandon_xfer(s);
+        return;
+    }
+
+    s->xfer = XFER_LIST;
+    session_pump(s);
+}
+
+static void session_file_opened(struct session *s) {
+    char error_msg[256];
+    int get = s->xfer_cmd == 'G';
+    int upload = !get && s->file_fd >= 0;
+
+    errno = s->task_error;
+    if (s->file_fd >= 0 && s->xfer_level > 0) {
+        /* One block class serves both: COMPRESS_BUFFER_SIZE covers BLOCK_SIZE + 4. */
+        s->zbuf = slab_alloc(SLAB_BLOCK, COMPRESS_BUFFER_SIZE);
+        s->zscratch = slab_alloc(SLAB_BLOCK, COMPRESS_BUFFER_SIZE);
+        if (s->zbuf == NULL || s->zscratch == NULL) {
+            slab_free(SLAB_BLOCK, s->zbuf);
+            slab_free(SLAB_BLOCK, s->zscratch);
+            s->zbuf = s->zscratch = NULL;
+            close(s->file_fd);
+            s->file_fd = -1;
+            if (upload) {
+                upload_discard(s->dir_fd, s->temp);
+                upload = 0;
+            }
+            errno = ENOMEM;
+        }
+    }
+    if (s->file_fd < 0) {
+        snprintf(error_msg, sizeof(error_msg), "EError %s file: %s\n",
+                 get ? "opening" : "creating", strerror(errno));
+        session_reply(s, error_msg);
+        if (get || !s->framed || s->closed) {
+            session_abandon_xfer(s);
+            return;
+        }
+        /* A framed body follows a rejected P too (it may be pipelined); file_fd < 0 drops it. */
+    } else {
+        session_reply(s, "A\n");
+        if (s->closed) {
+            return;
+        }
+        log_event(LOG_INFO, get ? LOG_GET : LOG_PUT, s->id, s->path, 0);
+    }
+
+    off_t size = get ? s->file_size : s->upload_size;
+    shape_begin(&s->shape, size >= 0 ? size - s->offset : -1, 1);
+    if (get) {
+        s->xfer = XFER_GET;
+        if (s->zbuf != NULL) {
+            session_send_compressed(s);
+        } else {
+            session_send_file(s);
+        }
+    } else {
+        s->xfer = XFER_PUT;
+        if (upload) {
+            s->commit.file_fd = s->file_fd;
+            s->commit.size = s->upload_size;
+        }
+        s->upload_size = -1;
+        if (s->zbuf != NULL) {
+            session_recv_compressed(s);
+            return;
+        }
+        if (zero_copy) {
+            open_splice_pipe(s->splice_pipe);
+        }
+        session_recv_file(s);
+    }
+}
+
+static void *stripe_worker(void *arg) {
+    struct thread_task *task = arg;
+    struct io_counters io = { 0 };
+
+    io_account = &io;
+    int status = transfer_stripes(task->listen_fd, task->file_fd, task->streams,
+                                  task->chunk_size, task->offset, task->size, task->get);
+    uint64_t result = status < 0 ? 2 : 1;
+    if (!task->get) {
+        /* 2 + errno: the session reports it if the client asked with F. */
+        int error = finish_upload(task->file_fd, task->dir_fd, task->temp, task->path, task->size,
+                                  task->durability, status);
+        result = error == 0 ? 1 : 2 + error;
+        close(task->dir_fd);
+    }
+    stats_io(&io);
+
+    close(task->listen_fd);
+    close(task->file_fd);
+    write(task->notify_fd, &result, sizeof(result));
+    close(task->notify_fd);
+    slab_free(SLAB_TASK, task);
+    return NULL;
+}
+
+static void session_striped_opened(struct session *s) {
+    char error_msg[256];
+    int get = s->xfer_cmd == 'G';
+    int file_fd = s->task_fd;
+    int listen_fd = s->stripe_listen_fd;
+
+    s->stripe_listen_fd = -1;
+    if (file_fd < 0) {
+        snprintf(error_msg, sizeof(error_msg), "EError %s file: %s\n",
+                 get ? "opening" : "creating", strerror(s->task_error));
+        close(listen_fd);
+        session_reply(s, error_msg);
+        return;
+    }
+
+    struct thread_task *task = slab_alloc(SLAB_TASK, sizeof(*task));
+    int dir_fd = get ? -1 : fcntl(s->dir_fd, F_DUPFD_CLOEXEC, 0);
+    pthread_t thread;
+    s->notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (task == NULL || s->notify.fd < 0 || (!get && dir_fd < 0)) {
+        slab_free(SLAB_TASK, task);
+        close(file_fd);
+        close(listen_fd);
+        if (!get) {
+            upload_discard(s->dir_fd, s->temp);
+        }
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+        ev_close(s, &s->notify);
+        session_reply(s, "EError starting striped transfer\n");
+        return;
+    }
+    *task = (struct thread_task){ listen_fd, file_fd, fcntl(s->notify.fd, F_DUPFD_CLOEXEC, 0),
+                                  s->stripe_streams, s->stripe_chunk, s->offset, get, -1, dir_fd, 0,
+                                  s->xfer_cmd, s->xfer_durability, s->upload_size };
+
+    if (!get) {
+        snprintf(task->path, sizeof(task->path), "%s", s->path);
+        snprintf(task->temp, sizeof(task->temp), "%s", s->temp);
+        s->upload_size = -1;
+    }
+    session_reply(s, "A\n");
+    if (s->closed || pthread_create(&thread, NULL, stripe_worker, task) != 0) {
+        close(task->notify_fd);
+        close(file_fd);
+        close(listen_fd);
+        if (!get) {
+            upload_discard(s->dir_fd, s->temp);
+            close(dir_fd);
+        }
+        slab_free(SLAB_TASK, task);
+        ev_close(s, &s->notify);
+        return;
+    }
+    pthread_detach(thread);
+
+    log_event(LOG_INFO, get ? LOG_GET : LOG_PUT, s->id, s->path, s->stripe_streams);
+
+    s->xfer = XFER_STRIPED;
+    ev_watch(s, &s->notify, EPOLLIN);
+}
+
+static void *delta_worker(void *arg) {
+    struct thread_task *task = arg;
+    struct io_counters io = { 0 };
+    struct shaper shaper;
+
+    io_account = &io;
+    shape_begin(&shaper, -1, 1);
+    io_shaper = &shaper;
+    int status;
+    if (task->cmd == 'V') {
+        status = delta_send(task->data_fd, task->framed, task->file_fd, NULL);
+    } else if (task->cmd == 'U') {
+        status = delta_rebuild(task->data_fd, task->framed, task->dir_fd, task->path, task->file_fd, task->temp, NULL);
+    } else {
+        status = store_receive(task->data_fd, task->framed, task->dir_fd, task->path, task->file_fd, task->temp);
+    }
+    uint64_t result = status < 0 ? 2 : 1;
+    io_shaper = NULL;
+    shape_end(&shaper);
+    stats_io(&io);
+
+    close(task->data_fd);
+    close(task->dir_fd);
+    close(task->file_fd);
+    write(task->notify_fd, &result, sizeof(result));
+    close(task->notify_fd);
+    slab_free(SLAB_TASK, task);
+    return NULL;
+}
+
+static void delta_task_free(struct session *s, struct thread_task *task) {
+    close(task->file_fd);
+    if (!task->get) {
+        unlinkat(task->dir_fd >= 0 ? task->dir_fd : s->dir_fd, task->temp, 0);
+    }
+    if (task->data_fd >= 0) {
+        close(task->data_fd);
+    }
+    if (task->dir_fd >= 0) {
+        close(task->dir_fd);
+    }
+    if (task->notify_fd >= 0) {
+        close(task->notify_fd);
+    }
+    slab_free(SLAB_TASK, task);
+}
+
+/*
+ * A delta transfer talks both ways on the data connection, so it runs as
+ * blocking code on a thread of its own, with a duplicate of the data socket
+ * switched to blocking mode until the thread is done with it.
+ */
+static void session_delta_opened(struct session *s) {
+    char error_msg[256];
+    int get = s->xfer_cmd == 'V';
+    int file_fd = s->task_fd;
+
+    if (file_fd < 0 && s->xfer_cmd == 'X' && store_fd < 0) {
+        session_reply(s, "E No chunk store on this server\n");
+        session_abandon_xfer(s);
+        return;
+    }
+    if (file_fd < 0) {
+        snprintf(error_msg, sizeof(error_msg), "EError %s file: %s\n",
+                 get ? "opening" : "creating", strerror(s->task_error));
+        session_reply(s, error_msg);
+        session_abandon_xfer(s);
+        return;
+    }
+
+    struct thread_task *task = slab_alloc(SLAB_TASK, sizeof(*task));
+    pthread_t thread;
+    if (task == NULL) {
+        close(file_fd);
+        if (!get) {
+            unlinkat(s->dir_fd, s->temp, 0);
+        }
+        session_reply(s, "EError starting delta transfer\n");
+        session_abandon_xfer(s);
+        return;
+    }
+    s->notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    *task = (struct thread_task){ -1, file_fd, -1, 1, 0, 0, get,
+                                  fcntl(s->data.fd, F_DUPFD_CLOEXEC, 0), fcntl(s->dir_fd, F_DUPFD_CLOEXEC, 0),
+                                  s->framed, s->xfer_cmd };
+    snprintf(task->path, sizeof(task->path), "%s", s->path);
+    snprintf(task->temp, sizeof(task->temp), "%s", s->temp);
+    if (s->notify.fd >= 0) {
+        task->notify_fd = fcntl(s->notify.fd, F_DUPFD_CLOEXEC, 0);
+    }
+    if (task->notify_fd < 0 || task->data_fd < 0 || task->dir_fd < 0) {
+        delta_task_free(s, task);
+        ev_close(s, &s->notify);
+        session_reply(s, "EError starting delta transfer\n");
+        session_abandon_xfer(s);
+        return;
+    }
+
+    session_reply(s, "A\n");
+    ev_pause(s, &s->data);
+    fcntl(s->data.fd, F_SETFL, 0);
+    if (s->closed || pthread_create(&thread, NULL, delta_worker, task) != 0) {
+        delta_task_free(s, task);
+        ev_close(s, &s->notify);
+        session_abandon_xfer(s);
+        return;
+    }
+    pthread_detach(thread);
+
+    log_event(LOG_INFO, get ? LOG_GET : LOG_PUT, s->id, s->path, 0);
+
+    s->xfer = XFER_DELTA;
+    ev_watch(s, &s->notify, EPOLLIN);
+}
+
+static void session_thread_done(struct session *s) {
+    uint64_t result = 0;
+    if (read(s->notify.fd, &result, sizeof(result)) != sizeof(result)) {
+        return;
+    }
+    if (s->xfer == XFER_DELTA) {
+        fcntl(s->data.fd, F_SETFL, O_NONBLOCK);
+    }
+    if (s->xfer == XFER_STRIPED && s->xfer_cmd == 'P' && result > 2) {
+        log_event(LOG_ERROR, LOG_PUT_FAILED, s->id, s->path, (int)result - 2);
+    }
+    if (s->xfer == XFER_STRIPED && s->xfer_cmd == 'P' && s->xfer_durability >= 0) {
+        char response[256];
+        commit_reply(result == 1 ? 0 : (int)result - 2, response, sizeof(response));
+        session_reply(s, response);
+        s->xfer_durability = -1;
+    }
+    session_finish_xfer(s, result == 1);
+}
+
+static void session_start_xfer(struct session *s) {
+    s->framed = s->keep_data;
+    if (s->xfer_cmd == 'L' || s->xfer_cmd == 'M' || s->xfer_cmd == 'N' || s->xfer_cmd == 'S') {
+        session_submit(s, TASK_LIST_OPEN);
+        return;
+    }
+    if (s->xfer_cmd == 'U' || s->xfer_cmd == 'V' || s->xfer_cmd == 'X') {
+        s->offset = 0;
+        s->restart_offset = 0;
+        s->compress_level = 0;
+        s->xfer_level = 0;
+        s->upload_size = -1;
+        s->durability = -1;
+        session_submit(s, TASK_OPEN);
+        return;
+    }
+
+    s->offset = s->restart_offset;
+    s->restart_offset = 0;
+    s->xfer_level = s->compress_level;
+    s->compress_level = 0;
+    s->xfer_durability = s->xfer_cmd == 'P' ? s->durability : -1;
+    s->durability = -1;
+    session_submit(s, TASK_OPEN);
+}
+
+static void session_start_striped(struct session *s) {
+    s->offset = s->restart_offset;
+    s->restart_offset = 0;
+    s->compress_level = 0;
+    s->xfer_level = 0;
+    s->xfer_durability = s->xfer_cmd == 'P' ? s->durability : -1;
+    s->durability = -1;
+    session_submit(s, TASK_OPEN);
+}
+
+static void session_rcd_done(struct session *s) {
+    if (s->task_fd < 0) {
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), "EError changing directory: %s\n", strerror(s->task_error));
+        session_reply(s, error_msg);
+        return;
+    }
+
+    session_reply(s, "A\n");
+    log_event(LOG_INFO, LOG_CD, s->id, s->path, 0);
+}
+
+/* Back on the reactor: hand the task's result to whatever was waiting on it. */
+static void session_task_done(struct session *s) {
+    int delta = s->task_op == TASK_OPEN && (s->xfer_cmd == 'U' || s->xfer_cmd == 'V' || s->xfer_cmd == 'X');
+    int striped = s->task_op == TASK_OPEN && !delta && s->stripe_listen_fd >= 0;
+
+    s->busy = 0;
+    if (s->task_op == TASK_COMMIT) {
+        s->commit.file_fd = -1;
+    }
+
+    /* Adopt what the task opened so session_release() can close it. */
+    if (s->task_op == TASK_OPEN && !striped && !delta) {
+        s->file_fd = s->task_fd;
+    } else if (s->task_op == TASK_RCD && s->task_fd >= 0) {
+        close(s->dir_fd);
+        s->dir_fd = s->task_fd;
+    }
+    if (s->closed) {
+        if ((striped || delta) && s->task_fd >= 0) {
+            close(s->task_fd);
+        }
+        if (s->task_op == TASK_OPEN && s->xfer_cmd != 'G' && s->xfer_cmd != 'V' && s->task_fd >= 0) {
+            upload_discard(s->dir_fd, s->temp);
+        }
+        session_release(s);
+        return;
+    }
+
+    switch (s->task_op) {
+    case TASK_OPEN:
+        if (delta) {
+            session_delta_opened(s);
+        } else if (striped) {
+            session_striped_opened(s);
+        } else {
+            session_file_opened(s);
+        }
+        break;
+    case TASK_RCD:
+        session_rcd_done(s);
+        break;
+    case TASK_SIZE:
+    case TASK_SUM:
+    case TASK_PREFIX_SUM:
+        session_reply(s, s->task_reply);
+        break;
+    case TASK_LIST_OPEN:
+        session_list_opened(s);
+        break;
+    case TASK_LIST_NEXT:
+        session_list_batch(s);
+        break;
+    case TASK_ENCODE:
+    case TASK_DECODE:
+        session_block_done(s);
+        break;
+    case TASK_SEND:
+    case TASK_RECV:
+        session_chunk_done(s);
+        break;
+    case TASK_COMMIT:
+        session_committed(s);
+        break;
+    }
+
+    if (!s->closed && !s->busy && s->xfer == XFER_NONE) {
+        session_process(s);
+    }
+}
+
+static void session_accept_data(struct session *s) {
+    int fd = accept4(s->data_listen.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    ev_close(s, &s->data_listen);
+    s->xfer = XFER_NONE;
+
+    if (fd < 0) {
+        session_reply(s, "EError accepting data connection\n");
+        if (!s->closed) {
+            session_process(s);
+        }
+        return;
+    }
+
+    s->data.fd = fd;
+    sock_data(fd, s->data_buffer);
+    session_start_xfer(s);
+}
+
+static void session_command(struct session *s, char *line) {
+    char cmd = line[0];
+    char *arg = line + 1;
+    while (*arg == ' ') arg++;
+
+    if (cmd == 'D' || cmd == 'K') {
+        if (*arg != '\0') {
+            char error_msg[64];
+            snprintf(error_msg, sizeof(error_msg), "E %c command takes no arguments\n", cmd);
+            session_reply(s, error_msg);
+            return;
+        }
+        ev_close(s, &s->data_listen);
+        ev_close(s, &s->data);
+        s->keep_data = cmd == 'K';
+        int port;
+        int fd = open_data_listener(&port);
+        if (fd < 0) {
+            char error_msg[256];
+            snprintf(error_msg, sizeof(error_msg), "EError creating data socket: %s\n", strerror(errno));
+            session_reply(s, error_msg);
+            return;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        s->data_listen.fd = fd;
+
+        char response[32];
+        snprintf(response, sizeof(response), "A%d\n", port);
+        session_reply(s, response);
+
+    } else if (cmd == 'C') {
+        if (*arg == '\0') {
+            session_reply(s, "E Path required for 'C' command\n");
+        } else {
+            snprintf(s->path, sizeof(s->path), "%s", arg);
+            session_submit(s, TASK_RCD);
+        }
+
+    } else if (cmd == 'W') {
+        int port;
+        char response[256];
+        if (s->stripe_listen_fd >= 0) {
+            close(s->stripe_listen_fd);
+        }
+        s->stripe_listen_fd = open_stripe_listener(arg, &s->stripe_streams, &s->stripe_chunk, &port);
+        if (s->stripe_listen_fd >= 0) {
+            fcntl(s->stripe_listen_fd, F_SETFD, FD_CLOEXEC);
+            snprintf(response, sizeof(response), "A%d\n", port);
+        } else if (errno == EINVAL) {
+            snprintf(response, sizeof(response), "E Usage: W<streams> [chunk size]\n");
+        } else {
+            snprintf(response, sizeof(response), "EError creating data socket: %s\n", strerror(errno));
+        }
+        session_reply(s, response);
+
+    } else if ((cmd == 'G' || cmd == 'P') && s->stripe_listen_fd >= 0) {
+        s->xfer_cmd = cmd;
+        snprintf(s->path, sizeof(s->path), "%s", arg);
+        session_start_striped(s);
+
+    } else if (cmd == 'S' && *arg != '\0') {
+        session_reply(s, "E S command takes no arguments\n");
+
+    } else if (cmd == 'L' || cmd == 'M' || cmd == 'N' || cmd == 'S' || cmd == 'G' || cmd == 'P' ||
+               cmd == 'U' || cmd == 'V' || cmd == 'X') {
+        if (s->data.fd >= 0) {
+            s->xfer_cmd = cmd;
+            snprintf(s->path, sizeof(s->path), "%s", arg);
+            session_start_xfer(s);
+        } else if (s->data_listen.fd < 0) {
+            s->restart_offset = 0;
+            s->compress_level = 0;
+            s->durability = -1;
+            session_reply(s, "E No data connection established\n");
+        } else {
+            s->xfer = XFER_ACCEPT;
+            s->xfer_cmd = cmd;
+            snprintf(s->path, sizeof(s->path), "%s", arg);
+            ev_watch(s, &s->data_listen, EPOLLIN);
+        }
+
+    } else if (cmd == 'Z') {
+        char *end;
+        long long size = strtoll(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || size < 0) {
+            session_reply(s, "E Z command takes a file size\n");
+        } else {
+            s->upload_size = size;
+            session_reply(s, "A\n");
+        }
+
+    } else if (cmd == 'R') {
+        char *end;
+        long long offset = strtoll(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || offset < 0) {
+            session_reply(s, "E R command takes a byte offset\n");
+        } else {
+            s->restart_offset = offset;
+            session_reply(s, "A\n");
+        }
+
+    } else if (cmd == 'Y') {
+        char *end;
+        long level = strtol(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || level < 0 || level > 9) {
+            session_reply(s, "E Y command takes a compression level 0-9\n");
+        } else {
+            s->compress_level = level;
+            session_reply(s, "A\n");
+        }
+
+    } else if (cmd == 'F') {
+        int mode = durability_parse(arg);
+        if (mode < 0) {
+            session_reply(s, "E F command takes none, sync or group\n");
+        } else {
+            s->durability = mode;
+            session_reply(s, "A\n");
+        }
+
+    } else if (cmd == 'I') {
+        if (*arg == '\0') {
+            session_reply(s, "E Path required for 'I' command\n");
+        } else {
+            snprintf(s->path, sizeof(s->path), "%s", arg);
+            session_submit(s, TASK_SIZE);
+        }
+
+    } else if (cmd == 'H') {
+        if (*arg == '\0') {
+            session_reply(s, "E Path required for 'H' command\n");
+        } else {
+            snprintf(s->path, sizeof(s->path), "%s", arg);
+            session_submit(s, TASK_SUM);
+        }
+
+    } else if (cmd == 'O') {
+        snprintf(s->path, sizeof(s->path), "%s", arg);
+        session_submit(s, TASK_PREFIX_SUM);
+
+    } else if (cmd == 'Q') {
+        if (*arg == '\0') {
+            s->quitting = 1;
+            session_reply(s, "A\n");
+        } else {
+            session_reply(s, "E Q command takes no arguments\n");
+        }
+
+    } else {
+        session_reply(s, "E Unknown command\n");
+    }
+}
+
+static void session_process(struct session *s) {
+    char line[BUFFER_SIZE];
+
+    while (!s->closed && !s->quitting && !s->busy && s->xfer == XFER_NONE) {
+        if (s->cmd != '\0') {
+            /* Idle again: whatever the last command started has finished. */
+            stats_command(s->cmd, s->cmd_start, &s->io_start, &s->io);
+            s->cmd = '\0';
+        }
+        if (!line_reader_next(&s->reader, line, sizeof(line))) {
+            break;
+        }
+        if (line[0] != '\0') {
+            s->cmd = line[0];
+            s->cmd_start = stats_clock();
+            s->io_start = s->io;
+            log_event(LOG_DEBUG, LOG_COMMAND, s->id, line, 0);
+            session_command(s, line);
+        }
+    }
+
+    if (s->hangup && !s->busy && s->xfer == XFER_NONE) {
+        session_close(s);
+    } else if (!s->closed) {
+        session_update_ctrl(s);
+    }
+}
+
+static void session_read_ctrl(struct session *s) {
+    while (s->reader.count < LINE_BUFFER_SIZE) {
+        ssize_t n = line_reader_fill(&s->reader);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n == 0 && s->xfer != XFER_NONE) {
+            /* As in fork mode, a transfer under way (say a shaped upload) still finishes. */
+            s->hangup = 1;
+            break;
+        }
+        if (n <= 0) {
+            session_close(s);
+            return;
+        }
+    }
+    session_process(s);
+}
+
+static void reactor_accept(struct reactor *r) {
+    while (1) {
+        int fd = accept4(r->listen.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "Error: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        sock_control(fd);
+        struct session *s = slab_alloc(SLAB_SESSION, sizeof(*s));
+        int dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (s == NULL || dir_fd < 0) {
+            fprintf(stderr, "Error: unable to create session: %s\n", strerror(errno));
+            slab_free(SLAB_SESSION, s);
+            if (dir_fd >= 0) {
+                close(dir_fd);
+            }
+            close(fd);
+            continue;
+        }
+
+        /* Slab objects come back dirty; the I/O buffer need not be cleared. */
+        memset(s, 0, offsetof(struct session, buf));
+        s->buf_len = s->buf_off = 0;
+        s->r = r;
+        s->id = __atomic_fetch_add(&next_session_id, 1, __ATOMIC_RELAXED);
+        s->dir_fd = dir_fd;
+        s->file_fd = -1;
+        s->hot = -1;
+        s->upload_size = -1;
+        s->durability = s->xfer_durability = -1;
+        s->commit.file_fd = -1;
+        s->splice_pipe[0] = s->splice_pipe[1] = -1;
+        s->ctrl = (struct ev_handle){ EV_CONTROL, fd, 0, s };
+        line_reader_init(&s->reader, fd);
+        s->data_listen = (struct ev_handle){ EV_DATA_LISTEN, -1, 0, s };
+        s->data = (struct ev_handle){ EV_DATA, -1, 0, s };
+        s->notify = (struct ev_handle){ EV_NOTIFY, -1, 0, s };
+        s->timer = (struct ev_handle){ EV_TIMER, -1, 0, s };
+        s->stripe_listen_fd = -1;
+        session_update_ctrl(s);
+        stats_sessions(1);
+        stats_accept_queue(r->listen.fd);
+        log_event(LOG_INFO, LOG_CONNECT, s->id, NULL, 0);
+    }
+}
+
+/* Moves the transfer on: its data socket is ready or the shaper's timer went off. */
+static void session_resume(struct session *s) {
+    if (s->xfer == XFER_GET && s->zbuf != NULL) {
+        session_send_compressed(s);
+    } else if (s->xfer == XFER_GET) {
+        session_send_file(s);
+    } else if (s->xfer == XFER_PUT && s->zbuf != NULL) {
+        session_recv_compressed(s);
+    } else if (s->xfer == XFER_PUT) {
+        session_recv_file(s);
+    } else if (s->xfer == XFER_LIST) {
+        session_pump(s);
+    }
+}
+
+static void reactor_dispatch(struct ev_handle *h, unsigned int events) {
+    struct session *s = h->s;
+    if (s->closed || h->fd < 0) {
+        return;
+    }
+
+    io_account = &s->io;
+    switch (h->kind) {
+    case EV_CONTROL:
+        if (events & EPOLLOUT) {
+            session_flush(s);
+        }
+        if (!s->closed && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            session_read_ctrl(s);
+        }
+        break;
+    case EV_NOTIFY:
+        if (s->xfer == XFER_STRIPED || s->xfer == XFER_DELTA) {
+            session_thread_done(s);
+        }
+        break;
+    case EV_DATA_LISTEN:
+        if (s->xfer == XFER_ACCEPT) {
+            session_accept_data(s);
+        }
+        break;
+    case EV_DATA:
+        if (s->busy) {
+            /* The pool task's completion decides what to wait for next. */
+            ev_pause(s, h);
+            break;
+        }
+        if (s->xfer == XFER_NONE && (events & (EPOLLERR | EPOLLHUP))) {
+            ev_close(s, &s->data);
+            break;
+        }
+        if ((events & EPOLLERR) && s->xfer != XFER_NONE) {
+            session_finish_xfer(s, 0);
+            break;
+        }
+        session_resume(s);
+        break;
+    case EV_TIMER: {
+        uint64_t expired;
+        if (read(h->fd, &expired, sizeof(expired)) > 0 && !s->busy) {
+            session_resume(s);
+        }
+        break;
+    }
+    }
+    io_account = NULL;
+}
+
+static void reactor_complete(struct reactor *r) {
+    struct pool_task *task = completion_queue_take(&r->done);
+    while (task != NULL) {
+        /* The session may reuse its task before we move on. */
+        struct pool_task *next = task->next;
+        struct session *s = task->arg;
+        io_account = &s->io;
+        session_task_done(s);
+        io_account = NULL;
+        task = next;
+    }
+}
+
+static void *reactor_run(void *arg) {
+    struct reactor *r = arg;
+    struct epoll_event events[MAX_EVENTS];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (ncpu > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->cpu % ncpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &r->listen;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listen.fd, &ev) < 0) {
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        return NULL;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &r->pool;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->pool.fd, &ev) < 0) {
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    while (1) {
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct ev_handle *h = events[i].data.ptr;
+            if (h->kind == EV_LISTEN) {
+                reactor_accept(r);
+            } else if (h->kind == EV_POOL) {
+                reactor_complete(r);
+            } else {
+                reactor_dispatch(h, events[i].events);
+            }
+        }
+
+        while (r->dead != NULL) {
+            struct session *s = r->dead;
+            r->dead = s->next_dead;
+            slab_free(SLAB_SESSION, s);
+        }
+    }
+
+    return NULL;
+}
+
+void event_server(int *listen_fds, int nlisten, int nthreads, int nworkers) {
+    struct reactor *reactors = calloc(nthreads, sizeof(*reactors));
+    if (reactors == NULL) {
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        return;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for (int i = 0; i < nlisten; i++) {
+        fcntl(listen_fds[i], F_SETFL, O_NONBLOCK);
+        fcntl(listen_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        reactors[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactors[i].epfd < 0) {
+            fprintf(stderr, "Error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        reactors[i].cpu = i;
+        /* With -r each reactor owns a SO_REUSEPORT listener; otherwise they share one. */
+        reactors[i].listen = (struct ev_handle){ EV_LISTEN, listen_fds[i % nlisten], 1, NULL };
+        reactors[i].pool = (struct ev_handle){ EV_POOL, completion_queue_init(&reactors[i].done), 1, NULL };
+        if (reactors[i].pool.fd < 0) {
+            fprintf(stderr, "Error: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (nworkers > 0 && pool_start(nworkers) < 0) {
+        fprintf(stderr, "Error: unable to start I/O workers, running file I/O on the reactors\n");
+        nworkers = 0;
+    }
+
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_run, &reactors[i]) != 0) {
+            fprintf(stderr, "Error: unable to start reactor thread %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Event server running with %d reactor thread(s) and %d I/O worker(s).\n", nthreads, nworkers);
+    fflush(stdout);
+    reactor_run(&reactors[0]);
+
+    for (int i = 1; i < nthreads; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        close(reactors[i].epfd);
+    }
+    free(reactors);
+}
@@ -0,0 +1,929 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <endian.h>
+#include <pthread.h>
+#include <math.h>
+#include <zlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "myftp.h"
+
+int zero_copy = 1;
+
+/*
+ * Data-path accounting: every syscall that moves transfer data is counted,
+ * with the bytes it moved over the network, against io_account when a
+ * caller sets one (an epoll session) or else the thread's own counters.
+ */
+__thread struct io_counters *io_account;
+static __thread struct io_counters io_thread;
+
+void io_count(unsigned long syscalls, ssize_t bytes_in, ssize_t bytes_out) {
+    struct io_counters *c = io_account != NULL ? io_account : &io_thread;
+    c->syscalls += syscalls;
+    if (bytes_in > 0) {
+        c->bytes_in += bytes_in;
+    }
+    if (bytes_out > 0) {
+        c->bytes_out += bytes_out;
+    }
+}
+
+void io_snapshot(struct io_counters *out) {
+    *out = io_account != NULL ? *io_account : io_thread;
+}
+
+ssize_t send_file_chunk(int out_fd, int in_fd, off_t *offset, size_t count) {
+    if (zero_copy) {
+        ssize_t sent = sendfile(out_fd, in_fd, offset, count);
+        io_count(1, 0, sent);
+        if (sent >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+            return sent;
+        }
+    }
+
+    /* Source cannot be sendfile()d (or zero copy is off): copy through a buffer. */
+    char buffer[IO_BUFFER_SIZE];
+    if (count > sizeof(buffer)) {
+        count = sizeof(buffer);
+    }
+
+    ssize_t bytes_read = pread(in_fd, buffer, count, *offset);
+    io_count(1, 0, 0);
+    if (bytes_read <= 0) {
+        return bytes_read;
+    }
+
+    ssize_t sent = write(out_fd, buffer, bytes_read);
+    io_count(1, 0, sent);
+    if (sent > 0) {
+        *offset += sent;
+    }
+    return sent;
+}
+
+int send_file(int out_fd, int in_fd, off_t offset) {
+    int corked = 0;
+    while (1) {
+        size_t count = shape_wait(IO_CHUNK_SIZE);
+        ssize_t sent = send_file_chunk(out_fd, in_fd, &offset, count);
+        if (sent <= 0 && (sent == 0 || errno != EINTR)) {
+            if (corked) {
+                sock_cork(out_fd, 0);
+            }
+            return sent == 0 ? 0 : -1;
+        }
+        if (!corked && (size_t)sent == count) {
+            /* A full chunk: more is likely to follow, so send only full segments. */
+            sock_cork(out_fd, 1);
+            corked = 1;
+        }
+    }
+}
+
+int open_splice_pipe(int pipe_fd[2]) {
+    if (pipe2(pipe_fd, O_CLOEXEC) < 0) {
+        pipe_fd[0] = pipe_fd[1] = -1;
+        return -1;
+    }
+    fcntl(pipe_fd[1], F_SETPIPE_SZ, IO_CHUNK_SIZE);
+    return 0;
+}
+
+void close_splice_pipe(int pipe_fd[2]) {
+    if (pipe_fd[0] >= 0) {
+        close(pipe_fd[0]);
+        close(pipe_fd[1]);
+    }
+    pipe_fd[0] = pipe_fd[1] = -1;
+}
+
+int write_all(int fd, const char *buffer, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, buffer, len);
+        io_count(1, 0, 0);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        buffer += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static int drain_pipe(int file_fd, int pipe_rd, size_t len) {
+    while (len > 0) {
+        ssize_t written = splice(pipe_rd, NULL, file_fd, NULL, len, SPLICE_F_MOVE);
+        io_count(1, 0, 0);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && errno == EINVAL) {
+            /* Destination does not support splice(): empty the pipe by hand. */
+            char buffer[IO_BUFFER_SIZE];
+            ssize_t bytes_read = read(pipe_rd, buffer, len < sizeof(buffer) ? len : sizeof(buffer));
+            io_count(1, 0, 0);
+            if (bytes_read <= 0 || write_all(file_fd, buffer, bytes_read) < 0) {
+                return -1;
+            }
+            written = bytes_read;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        len -= written;
+    }
+    return 0;
+}
+
+/* A negative file_fd throws the data away, as for the body of a rejected put. */
+ssize_t recv_file_chunk(int file_fd, int sock_fd, int pipe_fd[2], size_t count) {
+    if (zero_copy && pipe_fd[0] >= 0 && file_fd >= 0) {
+        ssize_t received = splice(sock_fd, NULL, pipe_fd[1], NULL, count, SPLICE_F_MOVE);
+        io_count(1, received, 0);
+        if (received > 0) {
+            return drain_pipe(file_fd, pipe_fd[0], received) < 0 ? -1 : received;
+        }
+        if (received == 0 || errno != EINVAL) {
+            return received;
+        }
+    }
+
+    char buffer[IO_BUFFER_SIZE];
+    ssize_t received = read(sock_fd, buffer, count < sizeof(buffer) ? count : sizeof(buffer));
+    io_count(1, received, 0);
+    if (received > 0 && file_fd >= 0 && write_all(file_fd, buffer, received) < 0) {
+        return -1;
+    }
+    return received;
+}
+
+void preallocate_file(int file_fd, off_t size) {
+    if (size > 0) {
+        /* Only a hint: filesystems without fallocate() just grow as written. */
+        fallocate(file_fd, FALLOC_FL_KEEP_SIZE, 0, size);
+    }
+}
+
+int receive_file(int file_fd, int sock_fd) {
+    int pipe_fd[2];
+    int result = 0;
+
+    if (zero_copy) {
+        open_splice_pipe(pipe_fd);
+    } else {
+        pipe_fd[0] = pipe_fd[1] = -1;
+    }
+
+    while (1) {
+        ssize_t received = recv_file_chunk(file_fd, sock_fd, pipe_fd, shape_wait(IO_CHUNK_SIZE));
+        if (received == 0) {
+            break;
+        }
+        if (received < 0 && errno != EINTR) {
+            result = -1;
+            break;
+        }
+    }
+
+    close_splice_pipe(pipe_fd);
+    return result;
+}
+
+void line_reader_init(struct line_reader *reader, int fd) {
+    reader->fd = fd;
+    reader->head = 0;
+    reader->count = 0;
+}
+
+ssize_t line_reader_fill(struct line_reader *reader) {
+    struct iovec iov[2];
+    int iovcnt = 1;
+
+    if (reader->count == 0) {
+        reader->head = 0;
+    }
+    if (reader->count == LINE_BUFFER_SIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    /* Fill the free part of the ring, which may wrap, with a single readv(). */
+    size_t tail = (reader->head + reader->count) % LINE_BUFFER_SIZE;
+    if (tail >= reader->head) {
+        iov[0].iov_base = reader->buf + tail;
+        iov[0].iov_len = LINE_BUFFER_SIZE - tail;
+        if (reader->head > 0) {
+            iov[1].iov_base = reader->buf;
+            iov[1].iov_len = reader->head;
+            iovcnt = 2;
+        }
+    } else {
+        iov[0].iov_base = reader->buf + tail;
+        iov[0].iov_len = reader->head - tail;
+    }
+
+    ssize_t bytes_read = readv(reader->fd, iov, iovcnt);
+    if (bytes_read > 0) {
+        reader->count += bytes_read;
+    }
+    return bytes_read;
+}
+
+int line_reader_next(struct line_reader *reader, char *line, size_t size) {
+    size_t first = LINE_BUFFER_SIZE - reader->head;
+    size_t len;
+    size_t consumed;
+    char *nl;
+
+    if (first > reader->count) {
+        first = reader->count;
+    }
+
+    if ((nl = memchr(reader->buf + reader->head, '\n', first)) != NULL) {
+        len = nl - (reader->buf + reader->head);
+    } else if ((nl = memchr(reader->buf, '\n', reader->count - first)) != NULL) {
+        len = first + (nl - reader->buf);
+    } else if (reader->count == LINE_BUFFER_SIZE) {
+        /* A full ring with no newline: hand it out as one (truncated) line. */
+        len = reader->count;
+    } else {
+        return 0;
+    }
+    consumed = len < reader->count ? len + 1 : len;
+
+    size_t copy = len < size - 1 ? len : size - 1;
+    for (size_t i = 0; i < copy; i++) {
+        line[i] = reader->buf[(reader->head + i) % LINE_BUFFER_SIZE];
+    }
+    line[copy] = '\0';
+
+    reader->head = (reader->head + consumed) % LINE_BUFFER_SIZE;
+    reader->count -= consumed;
+    return 1;
+}
+
+int read_line(struct line_reader *reader, char *line, size_t size) {
+    while (!line_reader_next(reader, line, size)) {
+        ssize_t bytes_read = line_reader_fill(reader);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            line[0] = '\0';
+            return -1;
+        }
+    }
+    return strlen(line);
+}
+
+/*
+ * Framing for persistent data connections: each transfer is a run of
+ * frames, a 4-byte big-endian payload length followed by the payload,
+ * closed by a zero-length frame.
+ */
+
+int write_frame_header(int sock_fd, uint32_t len, int more) {
+    uint32_t header = htonl(len);
+    const char *p = (const char *)&header;
+    size_t left = sizeof(header);
+
+    while (left > 0) {
+        ssize_t sent = send(sock_fd, p, left, more ? MSG_MORE : 0);
+        io_count(1, 0, sent);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        p += sent;
+        left -= sent;
+    }
+    return 0;
+}
+
+int read_frame_header(int sock_fd, uint32_t *len) {
+    uint32_t header;
+    char *p = (char *)&header;
+    size_t left = sizeof(header);
+
+    while (left > 0) {
+        ssize_t bytes_read = read(sock_fd, p, left);
+        io_count(1, bytes_read, 0);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        p += bytes_read;
+        left -= bytes_read;
+    }
+    *len = ntohl(header);
+    return 0;
+}
+
+static int send_chunks(int out_fd, int in_fd, off_t offset, off_t end, int framed) {
+    while (offset < end) {
+        off_t stop = offset + (end - offset < IO_CHUNK_SIZE ? end - offset : IO_CHUNK_SIZE);
+        if (framed && write_frame_header(out_fd, stop - offset, 1) < 0) {
+            return -1;
+        }
+        while (offset < stop) {
+            ssize_t sent = send_file_chunk(out_fd, in_fd, &offset, shape_wait(stop - offset));
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                /* Short file: the promised frame cannot be completed. */
+                return -1;
+            }
+        }
+    }
+
+    return framed ? write_frame_header(out_fd, 0, 0) : 0;
+}
+
+/* Sends bytes [offset, end) of in_fd, as frames when framed. */
+int send_range(int out_fd, int in_fd, off_t offset, off_t end, int framed) {
+    int corked = end - offset > IO_CHUNK_SIZE;
+    if (corked) {
+        sock_cork(out_fd, 1);
+    }
+    int status = send_chunks(out_fd, in_fd, offset, end, framed);
+    if (corked) {
+        sock_cork(out_fd, 0);
+    }
+    return status;
+}
+
+int send_file_framed(int out_fd, int in_fd, off_t offset) {
+    struct stat st;
+
+    if (fstat(in_fd, &st) < 0) {
+        return -1;
+    }
+    return send_range(out_fd, in_fd, offset, st.st_size, 1);
+}
+
+int receive_framed(int out_fd, int sock_fd) {
+    int pipe_fd[2];
+    int result = 0;
+    uint32_t len;
+
+    if (zero_copy) {
+        open_splice_pipe(pipe_fd);
+    } else {
+        pipe_fd[0] = pipe_fd[1] = -1;
+    }
+
+    while (result == 0) {
+        if (read_frame_header(sock_fd, &len) < 0) {
+            result = -1;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+        while (len > 0) {
+            ssize_t received = recv_file_chunk(out_fd, sock_fd, pipe_fd, shape_wait(len));
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received <= 0) {
+                result = -1;
+                break;
+            }
+            len -= received;
+        }
+    }
+
+    close_splice_pipe(pipe_fd);
+    return result;
+}
+
+static int read_exact(int fd, void *buffer, size_t len) {
+    char *p = buffer;
+    while (len > 0) {
+        ssize_t bytes_read = read(fd, p, len);
+        io_count(1, bytes_read, 0);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return p == (char *)buffer && bytes_read == 0 ? 0 : -1;
+        }
+        p += bytes_read;
+        len -= bytes_read;
+    }
+    return 1;
+}
+
+/*
+ * Compressed transfers use the frame layout with bit 31 of the header set
+ * on blocks that were deflated; other blocks are stored raw.  Each block
+ * covers at most COMPRESS_BLOCK_SIZE bytes of the file and a zero header
+ * ends the stream, on plain and persistent data connections alike.
+ */
+
+/* Shannon entropy of a sample of the block: near 8 bits/byte will not shrink. */
+static int worth_compressing(const unsigned char *data, size_t len) {
+    unsigned int counts[256] = { 0 };
+    size_t step = len > ENTROPY_SAMPLE ? len / ENTROPY_SAMPLE : 1;
+    size_t samples = 0;
+    double bits = 0;
+
+    for (size_t i = 0; i < len; i += step) {
+        counts[data[i]]++;
+        samples++;
+    }
+    for (int c = 0; c < 256; c++) {
+        if (counts[c] > 0) {
+            double p = (double)counts[c] / samples;
+            bits -= p * log2(p);
+        }
+    }
+    return bits < ENTROPY_LIMIT;
+}
+
+ssize_t encode_block(int in_fd, off_t *offset, unsigned char *out, unsigned char *scratch, int level) {
+    ssize_t bytes_read;
+    do {
+        bytes_read = pread(in_fd, out + 4, COMPRESS_BLOCK_SIZE, *offset);
+        io_count(1, 0, 0);
+    } while (bytes_read < 0 && errno == EINTR);
+    if (bytes_read < 0) {
+        return -1;
+    }
+
+    uint32_t header = bytes_read;
+    if (bytes_read > 0 && worth_compressing(out + 4, bytes_read)) {
+        uLongf packed = COMPRESS_BUFFER_SIZE;
+        if (compress2(scratch, &packed, out + 4, bytes_read, level) == Z_OK && packed < (uLongf)bytes_read) {
+            memcpy(out + 4, scratch, packed);
+            header = packed | FRAME_COMPRESSED;
+        }
+    }
+    *offset += bytes_read;
+
+    uint32_t net = htonl(header);
+    memcpy(out, &net, 4);
+    return 4 + (header & ~FRAME_COMPRESSED);
+}
+
+int decode_block(int out_fd, uint32_t header, const unsigned char *payload, unsigned char *scratch) {
+    uLongf len = header & ~FRAME_COMPRESSED;
+    if (header & FRAME_COMPRESSED) {
+        uLongf unpacked = COMPRESS_BLOCK_SIZE;
+        if (uncompress(scratch, &unpacked, payload, len) != Z_OK) {
+            return -1;
+        }
+        payload = scratch;
+        len = unpacked;
+    }
+    return write_all(out_fd, (const char *)payload, len);
+}
+
+int send_file_compressed(int out_fd, int in_fd, off_t offset, int level) {
+    unsigned char *out = malloc(COMPRESS_BLOCK_SIZE + 4);
+    unsigned char *scratch = malloc(COMPRESS_BUFFER_SIZE);
+    int result = out != NULL && scratch != NULL ? 0 : -1;
+
+    while (result == 0) {
+        ssize_t len = encode_block(in_fd, &offset, out, scratch, level);
+        if (len >= 0) {
+            shape_take(len);
+        }
+        if (len < 0 || write_all(out_fd, (const char *)out, len) < 0) {
+            result = -1;
+            break;
+        }
+        io_count(0, 0, len);
+        if (len == 4) {
+            break;
+        }
+    }
+
+    free(out);
+    free(scratch);
+    return result;
+}
+
+int receive_compressed(int out_fd, int sock_fd) {
+    unsigned char *payload = malloc(COMPRESS_BLOCK_SIZE);
+    unsigned char *scratch = malloc(COMPRESS_BLOCK_SIZE);
+    int result = payload != NULL && scratch != NULL ? 0 : -1;
+    uint32_t header;
+
+    while (result == 0) {
+        if (read_frame_header(sock_fd, &header) < 0) {
+            result = -1;
+            break;
+        }
+        if (header == 0) {
+            break;
+        }
+        uint32_t len = header & ~FRAME_COMPRESSED;
+        if (len <= COMPRESS_BLOCK_SIZE) {
+            shape_take(len);
+        }
+        if (len > COMPRESS_BLOCK_SIZE || read_exact(sock_fd, payload, len) <= 0 ||
+            decode_block(out_fd, header, payload, scratch) < 0) {
+            result = -1;
+        }
+    }
+
+    free(payload);
+    free(scratch);
+    return result;
+}
+
+/*
+ * Striped transfers: the file is cut into chunk_size ranges dealt round
+ * robin over the streams.  Each range travels as a 12-byte header (8-byte
+ * offset, 4-byte length, big-endian) and its payload, and the receiver
+ * pwrite()s it in place.  A stream ends when its sender closes it.
+ *
+ * The receiver holds every header to that layout and to the announced
+ * size: each stream must carry exactly one stripe's ranges, in order and
+ * to the end, so no stream can write outside the file or over another.
+ */
+
+struct stripe {
+    int sock_fd;
+    int file_fd;
+    int index;
+    int streams;
+    size_t chunk_size;
+    off_t offset;
+    off_t size;
+    int status;
+    unsigned int *claimed;
+    pthread_t thread;
+    void *(*run)(void *);
+    struct io_counters io;
+    struct shaper shape;
+};
+
+/* Extra stream threads count into their stripe; run_stripes() adds it to the caller. */
+static void *stripe_thread(void *arg) {
+    struct stripe *stripe = arg;
+    io_account = &stripe->io;
+    io_shaper = &stripe->shape;
+    return stripe->run(stripe);
+}
+
+static void *stripe_send(void *arg) {
+    struct stripe *stripe = arg;
+    off_t step = (off_t)stripe->chunk_size * stripe->streams;
+
+    for (off_t start = stripe->offset + (off_t)stripe->chunk_size * stripe->index; start < stripe->size; start += step) {
+        off_t end = start + (off_t)stripe->chunk_size < stripe->size ? start + (off_t)stripe->chunk_size : stripe->size;
+        unsigned char header[12];
+        uint64_t offset = htobe64(start);
+        uint32_t len = htonl(end - start);
+        memcpy(header, &offset, 8);
+        memcpy(header + 8, &len, 4);
+
+        ssize_t sent = send(stripe->sock_fd, header, sizeof(header), MSG_MORE);
+        io_count(1, 0, sent);
+        if (sent != sizeof(header)) {
+            stripe->status = -1;
+            break;
+        }
+        off_t pos = start;
+        while (pos < end) {
+            ssize_t sent = send_file_chunk(stripe->sock_fd, stripe->file_fd, &pos, shape_wait(end - pos));
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                stripe->status = -1;
+                return NULL;
+            }
+        }
+    }
+    shutdown(stripe->sock_fd, SHUT_WR);
+    return NULL;
+}
+
+/* Checks a received range against the layout; next is where this stream's next range must start. */
+static int stripe_check(struct stripe *stripe, off_t pos, uint32_t len, off_t *next) {
+    off_t chunk = stripe->chunk_size;
+    if (pos < stripe->offset || pos >= stripe->size || (pos - stripe->offset) % chunk != 0 ||
+        len != (stripe->size - pos < chunk ? stripe->size - pos : chunk)) {
+        return -1;
+    }
+    if (*next < 0) {
+        /* The first range names this stream's stripe; no other stream may take it. */
+        off_t index = (pos - stripe->offset) / chunk;
+        if (index >= stripe->streams ||
+            __atomic_fetch_or(stripe->claimed, 1u << index, __ATOMIC_RELAXED) & (1u << index)) {
+            return -1;
+        }
+        stripe->index = index;
+    } else if (pos != *next) {
+        return -1;
+    }
+    *next = pos + chunk * stripe->streams;
+    return 0;
+}
+
+static void *stripe_receive(void *arg) {
+    struct stripe *stripe = arg;
+    char buffer[IO_BUFFER_SIZE];
+    unsigned char header[12];
+    off_t next = -1;
+    int more;
+
+    while ((more = read_exact(stripe->sock_fd, header, sizeof(header))) > 0) {
+        uint64_t offset;
+        uint32_t len;
+        memcpy(&offset, header, 8);
+        memcpy(&len, header + 8, 4);
+        off_t pos = be64toh(offset);
+        len = ntohl(len);
+        if (stripe_check(stripe, pos, len, &next) < 0) {
+            stripe->status = -1;
+            return NULL;
+        }
+
+        while (len > 0) {
+            size_t want = shape_wait(len < sizeof(buffer) ? len : sizeof(buffer));
+            if (read_exact(stripe->sock_fd, buffer, want) <= 0) {
+                stripe->status = -1;
+                return NULL;
+            }
+            for (size_t done = 0; done < want; ) {
+                ssize_t written = pwrite(stripe->file_fd, buffer + done, want - done, pos + done);
+                io_count(1, 0, 0);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (written <= 0) {
+                    stripe->status = -1;
+                    return NULL;
+                }
+                done += written;
+            }
+            pos += want;
+            len -= want;
+        }
+    }
+    /* A stream that stops early would leave a hole. */
+    if (more < 0 || (next >= 0 && next < stripe->size)) {
+        stripe->status = -1;
+    }
+    return NULL;
+}
+
+static int run_stripes(int *socks, int streams, int file_fd, size_t chunk_size, off_t offset, off_t size,
+                       void *(*run)(void *)) {
+    struct stripe stripes[MAX_STREAMS];
+    struct stat st;
+    unsigned int claimed = 0;
+    int status = 0;
+
+    if (streams < 1 || streams > MAX_STREAMS || chunk_size == 0) {
+        return -1;
+    }
+    if (size < 0) {
+        if (fstat(file_fd, &st) < 0) {
+            return -1;
+        }
+        size = st.st_size;
+    }
+
+    /* Each stream is shaped on its own, with a share of the session's rate. */
+    for (int i = 0; i < streams; i++) {
+        stripes[i] = (struct stripe){ socks[i], file_fd, i, streams, chunk_size, offset, size, 0, &claimed, 0, run };
+        shape_begin(&stripes[i].shape, -1, streams);
+    }
+    /* The calling thread carries stream 0 itself. */
+    for (int i = 1; i < streams; i++) {
+        if (pthread_create(&stripes[i].thread, NULL, stripe_thread, &stripes[i]) != 0) {
+            stripes[i].status = -1;
+            stripes[i].thread = 0;
+        }
+    }
+    struct shaper *shaper = io_shaper;
+    io_shaper = &stripes[0].shape;
+    run(&stripes[0]);
+    io_shaper = shaper;
+    for (int i = 0; i < streams; i++) {
+        if (i > 0 && stripes[i].thread != 0) {
+            pthread_join(stripes[i].thread, NULL);
+            io_count(stripes[i].io.syscalls, stripes[i].io.bytes_in, stripes[i].io.bytes_out);
+        }
+        shape_end(&stripes[i].shape);
+        if (stripes[i].status < 0) {
+            status = -1;
+        }
+    }
+    /* Every stripe with a range below the size must have arrived. */
+    for (int i = 0; run == stripe_receive && i < streams; i++) {
+        if (offset + (off_t)chunk_size * i < size && !(claimed & (1u << i))) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+int send_file_striped(int *socks, int streams, int file_fd, size_t chunk_size, off_t offset) {
+    return run_stripes(socks, streams, file_fd, chunk_size, offset, -1, stripe_send);
+}
+
+/* Receives the ranges [offset, size) that send_file_striped() deals with the same chunk size. */
+int receive_file_striped(int *socks, int streams, int file_fd, size_t chunk_size, off_t offset, off_t size) {
+    if (size < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return run_stripes(socks, streams, file_fd, chunk_size, offset, size, stripe_receive);
+}
+
+/*
+ * Messages that need both directions of a data connection (delta and
+ * chunk-store transfers) go through a buffered stream: raw on a D
+ * connection, or as frames ended by an empty one on a K connection, so a
+ * reader never takes bytes of the message after it.
+ */
+struct data_stream {
+    int fd;
+    int framed;
+    uint32_t frame_left;
+    size_t len;
+    size_t off;
+    unsigned char buf[DATA_STREAM_SIZE];
+};
+
+struct data_stream *data_stream_open(int fd, int framed) {
+    struct data_stream *s = malloc(sizeof(*s));
+    if (s != NULL) {
+        s->fd = fd;
+        s->framed = framed;
+        s->frame_left = 0;
+        s->len = s->off = 0;
+    }
+    return s;
+}
+
+static int data_stream_flush(struct data_stream *s) {
+    if (s->len == 0) {
+        return 0;
+    }
+    if (s->framed && write_frame_header(s->fd, s->len, 1) < 0) {
+        return -1;
+    }
+    shape_take(s->len);
+    for (size_t off = 0; off < s->len; ) {
+        ssize_t sent = send(s->fd, s->buf + off, s->len - off, 0);
+        io_count(1, 0, sent);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        off += sent;
+    }
+    s->len = 0;
+    return 0;
+}
+
+int data_stream_write(struct data_stream *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        size_t n = sizeof(s->buf) - s->len < len ? sizeof(s->buf) - s->len : len;
+        memcpy(s->buf + s->len, p, n);
+        s->len += n;
+        p += n;
+        len -= n;
+        if (s->len == sizeof(s->buf) && data_stream_flush(s) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Ends a message: flushes it and, on a framed connection, closes it with an empty frame. */
+int data_stream_finish(struct data_stream *s) {
+    if (data_stream_flush(s) < 0) {
+        return -1;
+    }
+    return s->framed ? write_frame_header(s->fd, 0, 0) : 0;
+}
+
+/* Refills the buffer without reading past the current frame, so the next message stays on the socket. */
+static int data_stream_fill(struct data_stream *s) {
+    size_t want = sizeof(s->buf);
+    if (s->framed) {
+        while (s->frame_left == 0) {
+            if (read_frame_header(s->fd, &s->frame_left) < 0 || s->frame_left == 0) {
+                errno = EPROTO;
+                return -1;
+            }
+        }
+        want = s->frame_left < want ? s->frame_left : want;
+    }
+
+    ssize_t n;
+    do {
+        n = read(s->fd, s->buf, want);
+        io_count(1, n, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        errno = n == 0 ? EPROTO : errno;
+        return -1;
+    }
+    shape_take(n);
+    if (s->framed) {
+        s->frame_left -= n;
+    }
+    s->len = n;
+    s->off = 0;
+    return 0;
+}
+
+int data_stream_read(struct data_stream *s, void *data, size_t len) {
+    unsigned char *p = data;
+    while (len > 0) {
+        if (s->off == s->len && data_stream_fill(s) < 0) {
+            return -1;
+        }
+        size_t n = s->len - s->off < len ? s->len - s->off : len;
+        if (p != NULL) {
+            memcpy(p, s->buf + s->off, n);
+            p += n;
+        }
+        s->off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Consumes the empty frame that ends a framed message. */
+int data_stream_end(struct data_stream *s) {
+    uint32_t len;
+    if (s->framed && (s->off != s->len || s->frame_left != 0 || read_frame_header(s->fd, &len) < 0 || len != 0)) {
+        errno = EPROTO;
+        return -1;
+    }
+    /* The stream may now carry a reply the other way. */
+    s->len = s->off = 0;
+    return 0;
+}
+
+void data_stream_close(struct data_stream *s) {
+    free(s);
+}
+
+/* Copies len bytes at offset in in_fd to out_fd's file position, inside the kernel where it can. */
+int copy_file_data(int in_fd, off_t offset, int out_fd, off_t len) {
+    static const int no_copy_range[] = { EXDEV, ENOSYS, EINVAL, EOPNOTSUPP };
+    char buffer[IO_BUFFER_SIZE];
+
+    while (len > 0) {
+        ssize_t n = copy_file_range(in_fd, &offset, out_fd, NULL, len, 0);
+        io_count(1, 0, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            int fallback = 0;
+            for (size_t i = 0; i < sizeof(no_copy_range) / sizeof(no_copy_range[0]); i++) {
+                fallback |= errno == no_copy_range[i];
+            }
+            if (!fallback) {
+                return -1;
+            }
+            n = pread(in_fd, buffer, len < (off_t)sizeof(buffer) ? len : (off_t)sizeof(buffer), offset);
+            io_count(1, 0, 0);
+            if (n > 0 && write_all(out_fd, buffer, n) < 0) {
+                return -1;
+            }
+            offset += n > 0 ? n : 0;
+        }
+        if (n <= 0) {
+            errno = n == 0 ? EIO : errno;
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,675 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "myftp.h"
+
+/*
+ * In-process directory listings.  Entries are read with getdents64() and
+ * formatted in directory order, one output buffer at a time, so the first
+ * batch is ready without reading (or sorting) the whole directory:
+ *   LIST_LONG     `ls -l` style lines, dot files hidden
+ *   LIST_MACHINE  MLSD-style "type=..;size=..;modify=..;UNIX.mode=..; name"
+ *   LIST_NAMES    regular files matching a glob pattern, one path per line
+ * start/count select a page of the entries that would be listed.  A lister
+ * that failed to open is kept as an empty listing carrying its error, so
+ * the data connection still sees a complete (empty) transfer.
+ */
+
+/* A finished listing, shared by the cache and every lister replaying it. */
+struct list_blob {
+    int refs;
+    size_t len;
+    char data[];
+};
+
+struct dir_lister {
+    int fd;
+    int error;
+    int format;
+    struct list_blob *blob;
+    size_t blob_off;
+    char *record;
+    size_t record_len;
+    size_t record_cap;
+    dev_t dev;
+    ino_t ino;
+    int wd;
+    unsigned long gen;
+    long skip;
+    long left;
+    time_t now;
+    uid_t uid;
+    gid_t gid;
+    char owner[32];
+    char group[32];
+    char prefix[BUFFER_SIZE];
+    char match[BUFFER_SIZE];
+    size_t len;
+    size_t off;
+    char dents[LIST_DENTS_SIZE];
+};
+
+/*
+ * Listing cache.  Complete L and M listings are kept per directory inode
+ * and format, shared by every session in the process.  Each cached
+ * directory has an inotify watch; any event on it drops its listings and
+ * bumps the watch generation, so a listing that raced with a change is
+ * never stored.  Pending events are drained before every lookup, which
+ * keeps hits exact without a separate thread.
+ */
+
+struct cache_entry {
+    dev_t dev;
+    ino_t ino;
+    int format;
+    int wd;
+    unsigned long used;
+    struct list_blob *blob;
+};
+
+struct cache_watch {
+    int wd;
+    unsigned long gen;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int inotify_fd;
+    unsigned long clock;
+    size_t bytes;
+    int entries_used;
+    int watches_used;
+    struct cache_entry entries[LIST_CACHE_ENTRIES];
+    struct cache_watch watches[LIST_CACHE_WATCHES];
+    struct list_cache_stats stats;
+} list_cache = { PTHREAD_MUTEX_INITIALIZER, -1 };
+
+static void blob_release(struct list_blob *blob) {
+    if (blob != NULL && --blob->refs == 0) {
+        free(blob);
+    }
+}
+
+static void cache_drop(int i) {
+    list_cache.bytes -= list_cache.entries[i].blob->len;
+    blob_release(list_cache.entries[i].blob);
+    list_cache.entries[i] = list_cache.entries[--list_cache.entries_used];
+}
+
+static struct cache_watch *cache_find_watch(int wd) {
+    for (int i = 0; i < list_cache.watches_used; i++) {
+        if (list_cache.watches[i].wd == wd) {
+            return &list_cache.watches[i];
+        }
+    }
+    return NULL;
+}
+
+static void cache_invalidate(int wd) {
+    struct cache_watch *watch = cache_find_watch(wd);
+    if (watch != NULL) {
+        watch->gen++;
+    }
+    for (int i = list_cache.entries_used - 1; i >= 0; i--) {
+        if (wd < 0 || list_cache.entries[i].wd == wd) {
+            cache_drop(i);
+            list_cache.stats.invalidations++;
+        }
+    }
+}
+
+static void cache_drain_events(void) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (list_cache.inotify_fd >= 0) {
+        ssize_t n = read(list_cache.inotify_fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        for (char *p = buffer; p < buffer + n; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                for (int i = 0; i < list_cache.watches_used; i++) {
+                    list_cache.watches[i].gen++;
+                }
+                cache_invalidate(-1);
+            } else {
+                cache_invalidate(event->wd);
+            }
+            if (event->mask & IN_IGNORED) {
+                struct cache_watch *watch = cache_find_watch(event->wd);
+                if (watch != NULL) {
+                    *watch = list_cache.watches[--list_cache.watches_used];
+                }
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/* Watches the directory and notes its generation; -1 if it cannot be watched. */
+static int cache_watch(int dir_fd, unsigned long *gen) {
+    char path[64];
+
+    if (list_cache.inotify_fd == -1) {
+        list_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (list_cache.inotify_fd < 0) {
+            list_cache.inotify_fd = -2;
+        }
+    }
+    if (list_cache.inotify_fd < 0) {
+        return -1;
+    }
+
+    if (dir_fd == AT_FDCWD) {
+        snprintf(path, sizeof(path), ".");
+    } else {
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", dir_fd);
+    }
+    int wd = inotify_add_watch(list_cache.inotify_fd, path,
+                               IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM |
+                               IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd < 0) {
+        return -1;
+    }
+
+    struct cache_watch *watch = cache_find_watch(wd);
+    if (watch == NULL) {
+        if (list_cache.watches_used == LIST_CACHE_WATCHES) {
+            /* Retire a watch that no cached listing depends on. */
+            for (int i = 0; i < list_cache.watches_used && watch == NULL; i++) {
+                int busy = 0;
+                for (int j = 0; j < list_cache.entries_used; j++) {
+                    busy |= list_cache.entries[j].wd == list_cache.watches[i].wd;
+                }
+                if (!busy) {
+                    inotify_rm_watch(list_cache.inotify_fd, list_cache.watches[i].wd);
+                    watch = &list_cache.watches[i];
+                }
+            }
+            if (watch == NULL) {
+                return -1;
+            }
+        } else {
+            watch = &list_cache.watches[list_cache.watches_used++];
+        }
+        *watch = (struct cache_watch){ wd, 0 };
+    }
+    *gen = watch->gen;
+    return wd;
+}
+
+static struct list_blob *cache_lookup(const struct stat *st, int format) {
+    struct list_blob *blob = NULL;
+
+    pthread_mutex_lock(&list_cache.lock);
+    cache_drain_events();
+    for (int i = 0; i < list_cache.entries_used; i++) {
+        struct cache_entry *entry = &list_cache.entries[i];
+        if (entry->dev == st->st_dev && entry->ino == st->st_ino && entry->format == format) {
+            entry->used = ++list_cache.clock;
+            blob = entry->blob;
+            blob->refs++;
+            break;
+        }
+    }
+    if (blob != NULL) {
+        list_cache.stats.hits++;
+    } else {
+        list_cache.stats.misses++;
+    }
+    pthread_mutex_unlock(&list_cache.lock);
+    return blob;
+}
+
+static void cache_insert(struct dir_lister *l) {
+    struct list_blob *blob = malloc(sizeof(*blob) + l->record_len);
+    if (blob == NULL) {
+        return;
+    }
+    blob->refs = 1;
+    blob->len = l->record_len;
+    memcpy(blob->data, l->record, l->record_len);
+
+    pthread_mutex_lock(&list_cache.lock);
+    cache_drain_events();
+    struct cache_watch *watch = cache_find_watch(l->wd);
+    if (watch == NULL || watch->gen != l->gen) {
+        /* The directory changed while it was being listed. */
+        blob_release(blob);
+        pthread_mutex_unlock(&list_cache.lock);
+        return;
+    }
+
+    for (int i = list_cache.entries_used - 1; i >= 0; i--) {
+        struct cache_entry *entry = &list_cache.entries[i];
+        if (entry->dev == l->dev && entry->ino == l->ino && entry->format == l->format) {
+            cache_drop(i);
+        }
+    }
+    while (list_cache.entries_used > 0 &&
+           (list_cache.entries_used == LIST_CACHE_ENTRIES || list_cache.bytes + blob->len > LIST_CACHE_BYTES)) {
+        int oldest = 0;
+        for (int i = 1; i < list_cache.entries_used; i++) {
+            if (list_cache.entries[i].used < list_cache.entries[oldest].used) {
+                oldest = i;
+            }
+        }
+        cache_drop(oldest);
+    }
+    list_cache.entries[list_cache.entries_used++] =
+        (struct cache_entry){ l->dev, l->ino, l->format, l->wd, ++list_cache.clock, blob };
+    list_cache.bytes += blob->len;
+    pthread_mutex_unlock(&list_cache.lock);
+}
+
+void list_cache_stats(struct list_cache_stats *stats) {
+    pthread_mutex_lock(&list_cache.lock);
+    *stats = list_cache.stats;
+    stats->entries = list_cache.entries_used;
+    stats->bytes = list_cache.bytes;
+    pthread_mutex_unlock(&list_cache.lock);
+}
+
+/* Copies the next whole lines of a cached listing, honouring start/count. */
+static ssize_t blob_next(struct dir_lister *l, char *out, size_t size) {
+    const char *data = l->blob->data;
+    size_t len = l->blob->len;
+    size_t used = 0;
+
+    while (l->left != 0 && l->blob_off < len) {
+        const char *end = memchr(data + l->blob_off, '\n', len - l->blob_off);
+        size_t line = end != NULL ? (size_t)(end - data) + 1 - l->blob_off : len - l->blob_off;
+        if (l->skip > 0) {
+            l->skip--;
+        } else if (used + line > size) {
+            break;
+        } else {
+            memcpy(out + used, data + l->blob_off, line);
+            used += line;
+            if (l->left > 0) {
+                l->left--;
+            }
+        }
+        l->blob_off += line;
+    }
+    return used;
+}
+
+static void record_append(struct dir_lister *l, const char *line, size_t len) {
+    if (l->record_len + len > l->record_cap) {
+        size_t cap = l->record_cap > 0 ? l->record_cap * 2 : IO_BUFFER_SIZE;
+        char *record = cap <= LIST_CACHE_BYTES / 4 ? realloc(l->record, cap) : NULL;
+        if (record == NULL) {
+            /* Too big (or no memory) to cache; keep streaming without it. */
+            free(l->record);
+            l->record = NULL;
+            return;
+        }
+        l->record = record;
+        l->record_cap = cap;
+    }
+    memcpy(l->record + l->record_len, line, len);
+    l->record_len += len;
+}
+
+struct dir_lister *dir_lister_open(int dir_fd, const char *pattern, int format, long start, long count) {
+    struct dir_lister *l = slab_alloc(SLAB_LISTER, sizeof(*l));
+    if (l == NULL) {
+        return NULL;
+    }
+
+    memset(l, 0, offsetof(struct dir_lister, dents));
+    l->wd = -1;
+    l->format = format;
+    l->skip = start;
+    l->left = count;
+    l->now = time(NULL);
+    l->uid = (uid_t)-1;
+    l->gid = (gid_t)-1;
+
+    const char *dir = ".";
+    if (format == LIST_NAMES) {
+        /* Only the last component is a pattern; the directory part is taken literally. */
+        const char *slash = strrchr(pattern, '/');
+        snprintf(l->match, sizeof(l->match), "%s", slash != NULL ? slash + 1 : pattern);
+        if (slash != NULL) {
+            snprintf(l->prefix, sizeof(l->prefix), "%.*s", (int)(slash - pattern + 1), pattern);
+            dir = slash == pattern ? "/" : l->prefix;
+        }
+    }
+
+    l->fd = openat(dir_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    /* A pattern in a missing directory simply matches nothing, as with glob(). */
+    if (l->fd < 0 && format != LIST_NAMES) {
+        l->error = errno;
+    }
+    return l;
+}
+
+/* Serves a ready-made text, such as the S command's statistics, like a listing. */
+struct dir_lister *dir_lister_text(const char *text, size_t len) {
+    struct list_blob *blob = malloc(sizeof(*blob) + len);
+    struct dir_lister *l = slab_alloc(SLAB_LISTER, sizeof(*l));
+    if (blob == NULL || l == NULL) {
+        free(blob);
+        slab_free(SLAB_LISTER, l);
+        return NULL;
+    }
+    blob->refs = 1;
+    blob->len = len;
+    memcpy(blob->data, text, len);
+
+    memset(l, 0, offsetof(struct dir_lister, dents));
+    l->fd = -1;
+    l->wd = -1;
+    l->left = -1;
+    l->blob = blob;
+    return l;
+}
+
+int dir_lister_error(const struct dir_lister *l) {
+    return l->error;
+}
+
+void dir_lister_close(struct dir_lister *l) {
+    if (l->fd >= 0) {
+        close(l->fd);
+    }
+    if (l->blob != NULL) {
+        pthread_mutex_lock(&list_cache.lock);
+        blob_release(l->blob);
+        pthread_mutex_unlock(&list_cache.lock);
+    }
+    free(l->record);
+    slab_free(SLAB_LISTER, l);
+}
+
+static int entry_visible(struct dir_lister *l, const struct dirent64 *d) {
+    const char *name = d->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return 0;
+    }
+    if (l->format == LIST_MACHINE) {
+        return 1;
+    }
+    if (l->format == LIST_LONG) {
+        return name[0] != '.';
+    }
+
+    if (fnmatch(l->match, name, FNM_PERIOD) != 0) {
+        return 0;
+    }
+    if (d->d_type == DT_REG) {
+        return 1;
+    }
+    struct stat st;
+    return (d->d_type == DT_LNK || d->d_type == DT_UNKNOWN) &&
+           fstatat(l->fd, name, &st, 0) == 0 && S_ISREG(st.st_mode);
+}
+
+static void mode_string(mode_t mode, char *out) {
+    const char *rwx = "rwxrwxrwx";
+    out[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' : S_ISBLK(mode) ? 'b' :
+             S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' : '-';
+    for (int i = 0; i < 9; i++) {
+        out[i + 1] = mode & (0400 >> i) ? rwx[i] : '-';
+    }
+    if (mode & S_ISUID) {
+        out[3] = out[3] == 'x' ? 's' : 'S';
+    }
+    if (mode & S_ISGID) {
+        out[6] = out[6] == 'x' ? 's' : 'S';
+    }
+    if (mode & S_ISVTX) {
+        out[9] = out[9] == 'x' ? 't' : 'T';
+    }
+    out[10] = '\0';
+}
+
+/* Owner and group names are cached for the last id, which covers most directories. */
+static const char *owner_name(struct dir_lister *l, uid_t uid) {
+    if (uid != l->uid) {
+        struct passwd pw;
+        struct passwd *found = NULL;
+        char buffer[1024];
+        l->uid = uid;
+        if (getpwuid_r(uid, &pw, buffer, sizeof(buffer), &found) == 0 && found != NULL) {
+            snprintf(l->owner, sizeof(l->owner), "%s", pw.pw_name);
+        } else {
+            snprintf(l->owner, sizeof(l->owner), "%u", (unsigned)uid);
+        }
+    }
+    return l->owner;
+}
+
+static const char *group_name(struct dir_lister *l, gid_t gid) {
+    if (gid != l->gid) {
+        struct group gr;
+        struct group *found = NULL;
+        char buffer[1024];
+        l->gid = gid;
+        if (getgrgid_r(gid, &gr, buffer, sizeof(buffer), &found) == 0 && found != NULL) {
+            snprintf(l->group, sizeof(l->group), "%s", gr.gr_name);
+        } else {
+            snprintf(l->group, sizeof(l->group), "%u", (unsigned)gid);
+        }
+    }
+    return l->group;
+}
+
+/* Formats one entry into line; returns its length, or 0 if it vanished meanwhile. */
+static int format_entry(struct dir_lister *l, const char *name, char *line, size_t size) {
+    struct stat st;
+    struct tm tm;
+    char mode[11];
+    char date[32];
+    char target[BUFFER_SIZE];
+    int len;
+
+    if (l->format == LIST_NAMES) {
+        len = snprintf(line, size, "%s%s\n", l->prefix, name);
+        return len < (int)size ? len : 0;
+    }
+
+    if (fstatat(l->fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        return 0;
+    }
+
+    if (l->format == LIST_MACHINE) {
+        const char *type = S_ISREG(st.st_mode) ? "file" : S_ISDIR(st.st_mode) ? "dir" :
+                           S_ISLNK(st.st_mode) ? "OS.unix=symlink" : "OS.unix=other";
+        gmtime_r(&st.st_mtime, &tm);
+        strftime(date, sizeof(date), "%Y%m%d%H%M%S", &tm);
+        len = snprintf(line, size, "type=%s;size=%lld;modify=%s;UNIX.mode=0%o; %s\n", type,
+                       (long long)st.st_size, date, (unsigned)(st.st_mode & 07777), name);
+        return len < (int)size ? len : 0;
+    }
+
+    mode_string(st.st_mode, mode);
+    localtime_r(&st.st_mtime, &tm);
+    if (st.st_mtime > l->now - 180 * 24 * 3600 && st.st_mtime <= l->now + 3600) {
+        strftime(date, sizeof(date), "%b %e %H:%M", &tm);
+    } else {
+        strftime(date, sizeof(date), "%b %e  %Y", &tm);
+    }
+
+    target[0] = '\0';
+    if (S_ISLNK(st.st_mode)) {
+        ssize_t n = readlinkat(l->fd, name, target, sizeof(target) - 1);
+        target[n > 0 ? n : 0] = '\0';
+    }
+
+    len = snprintf(line, size, "%s %3lu %-8s %-8s %10lld %s %s%s%s\n", mode, (unsigned long)st.st_nlink,
+                   owner_name(l, st.st_uid), group_name(l, st.st_gid), (long long)st.st_size, date,
+                   name, target[0] != '\0' ? " -> " : "", target);
+    return len < (int)size ? len : 0;
+}
+
+ssize_t dir_lister_next(struct dir_lister *l, char *out, size_t size) {
+    char line[LIST_LINE_SIZE];
+    size_t used = 0;
+
+    if (l->blob != NULL) {
+        return blob_next(l, out, size);
+    }
+
+    while (l->fd >= 0 && l->left != 0) {
+        if (l->off == l->len) {
+            ssize_t n = getdents64(l->fd, l->dents, sizeof(l->dents));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && used == 0) {
+                l->error = errno;
+                return -1;
+            }
+            if (n == 0 && l->record != NULL) {
+                cache_insert(l);
+                free(l->record);
+                l->record = NULL;
+            }
+            if (n <= 0) {
+                break;
+            }
+            l->len = n;
+            l->off = 0;
+        }
+
+        struct dirent64 *d = (struct dirent64 *)(l->dents + l->off);
+        if (!entry_visible(l, d)) {
+            l->off += d->d_reclen;
+            continue;
+        }
+        if (l->skip > 0) {
+            l->skip--;
+            l->off += d->d_reclen;
+            continue;
+        }
+
+        int len = format_entry(l, d->d_name, line, sizeof(line));
+        if (used + len > size) {
+            /* Keep the entry for the next batch. */
+            break;
+        }
+        l->off += d->d_reclen;
+        if (len == 0) {
+            continue;
+        }
+        memcpy(out + used, line, len);
+        used += len;
+        if (l->record != NULL) {
+            record_append(l, line, len);
+        }
+        if (l->left > 0) {
+            l->left--;
+        }
+    }
+    return used;
+}
+
+int send_listing(int out_fd, struct dir_lister *l, int framed) {
+    char buffer[IO_BUFFER_SIZE];
+
+    while (1) {
+        ssize_t len = dir_lister_next(l, buffer, sizeof(buffer));
+        if (len < 0) {
+            return -1;
+        }
+        if (framed && write_frame_header(out_fd, len, len > 0) < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            return 0;
+        }
+        if (write_all(out_fd, buffer, len) < 0) {
+            return -1;
+        }
+        io_count(0, 0, len);
+    }
+}
+
+/* Parses the arguments of L, M or N and opens the matching listing. */
+struct dir_lister *open_listing(int dir_fd, char cmd, const char *arg) {
+    long start = 0;
+    long count = -1;
+    char extra;
+    int valid;
+
+    if (cmd == 'N') {
+        valid = *arg != '\0';
+    } else {
+        valid = *arg == '\0' || (sscanf(arg, "%ld %ld %c", &start, &count, &extra) == 2 && start >= 0 && count >= 1);
+    }
+
+    if (!valid) {
+        struct dir_lister *l = slab_alloc(SLAB_LISTER, sizeof(*l));
+        if (l != NULL) {
+            memset(l, 0, offsetof(struct dir_lister, dents));
+            l->fd = -1;
+            l->error = EINVAL;
+        }
+        return l;
+    }
+    if (cmd == 'N') {
+        return dir_lister_open(dir_fd, arg, LIST_NAMES, 0, -1);
+    }
+
+    int format = cmd == 'M' ? LIST_MACHINE : LIST_LONG;
+    struct stat st;
+    if (fstatat(dir_fd, ".", &st, 0) < 0) {
+        return dir_lister_open(dir_fd, NULL, format, start, count);
+    }
+
+    struct list_blob *blob = cache_lookup(&st, format);
+    if (blob != NULL) {
+        struct dir_lister *l = slab_alloc(SLAB_LISTER, sizeof(*l));
+        if (l == NULL) {
+            pthread_mutex_lock(&list_cache.lock);
+            blob_release(blob);
+            pthread_mutex_unlock(&list_cache.lock);
+            return NULL;
+        }
+        memset(l, 0, offsetof(struct dir_lister, dents));
+        l->fd = -1;
+        l->wd = -1;
+        l->format = format;
+        l->skip = start;
+        l->left = count;
+        l->blob = blob;
+        return l;
+    }
+
+    struct dir_lister *l = dir_lister_open(dir_fd, NULL, format, start, count);
+    if (l != NULL && l->fd >= 0 && start == 0 && count < 0) {
+        /* Watch before reading, so changes made during the listing are seen. */
+        pthread_mutex_lock(&list_cache.lock);
+        l->wd = cache_watch(dir_fd, &l->gen);
+        pthread_mutex_unlock(&list_cache.lock);
+        if (l->wd >= 0) {
+            l->dev = st.st_dev;
+            l->ino = st.st_ino;
+            l->record = malloc(IO_BUFFER_SIZE);
+            l->record_cap = l->record != NULL ? IO_BUFFER_SIZE : 0;
+        }
+    }
+    return l;
+}
@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "myftp.h"
+
+/*
+ * Server event log.
+ *
+ * Sessions never write to stdout themselves.  log_event() copies a fixed
+ * size record into a ring in shared anonymous memory and returns; a
+ * flusher thread in the parent drains every ring, orders the batch by
+ * time, formats it as text or JSON lines and writes it with one write().
+ * Like the statistics shards, a thread (or forked session) takes a ring
+ * of its own on first use; each ring is a bounded multi-producer queue,
+ * so threads that end up sharing one stay correct.
+ *
+ * Nothing on the request path blocks: records above the level are
+ * ignored, records over the per-ring rate limit or arriving at a full
+ * ring are dropped and counted, and the count is logged instead.
+ */
+
+struct log_record {
+    uint64_t time;
+    int session;
+    short streams; /* or, for LOG_PUT_FAILED, the errno */
+    char level;
+    char event;
+    char path[LOG_PATH_SIZE];
+};
+
+struct log_slot {
+    unsigned long seq;
+    struct log_record record;
+};
+
+struct log_ring {
+    unsigned long tail;
+    unsigned long head;
+    unsigned long second;
+    unsigned long count;
+    unsigned long dropped;
+    struct log_slot slots[LOG_RING_SIZE];
+} __attribute__((aligned(64)));
+
+struct log_region {
+    unsigned int next_ring;
+    struct log_ring rings[LOG_RINGS];
+};
+
+static const char *event_names[] = { "connect", "cd", "get", "put", "quit", "command", "put_failed" };
+static const char *level_names[] = { "error", "info", "debug" };
+
+static struct log_region *region;
+static int log_level = LOG_INFO;
+static int log_json;
+static const char *log_label = "Child";
+static __thread struct log_ring *ring;
+
+static uint64_t log_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t format_json_string(char *out, size_t size, const char *s) {
+    size_t n = 0;
+    for (; *s != '\0' && n + 7 < size; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = c;
+        } else if (c < 0x20) {
+            n += snprintf(out + n, size - n, "\\u%04x", c);
+        } else {
+            out[n++] = c;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static size_t format_record(char *out, size_t size, const struct log_record *r) {
+    if (log_json) {
+        char path[LOG_PATH_SIZE * 6 + 8];
+        format_json_string(path, sizeof(path), r->path);
+        int n = snprintf(out, size, "{\"time\":%llu.%06llu,\"level\":\"%s\",\"event\":\"%s\",\"session\":%d",
+                         (unsigned long long)(r->time / 1000000000ull),
+                         (unsigned long long)(r->time % 1000000000ull / 1000),
+                         level_names[(int)r->level], event_names[(int)r->event], r->session);
+        if (r->path[0] != '\0') {
+            n += snprintf(out + n, size - n, ",\"path\":\"%s\"", path);
+        }
+        if (r->event == LOG_PUT_FAILED) {
+            n += snprintf(out + n, size - n, ",\"error\":\"%s\"", strerror(r->streams));
+        } else if (r->streams > 0) {
+            n += snprintf(out + n, size - n, ",\"streams\":%d", r->streams);
+        }
+        n += snprintf(out + n, size - n, "}\n");
+        return (size_t)n < size ? (size_t)n : size - 1;
+    }
+
+    int n;
+    switch (r->event) {
+    case LOG_CONNECT:
+        n = snprintf(out, size, "Connection established with client.\n");
+        break;
+    case LOG_CD:
+        n = snprintf(out, size, "%s %d: changed directory to '%s'\n", log_label, r->session, r->path);
+        break;
+    case LOG_GET:
+    case LOG_PUT:
+        n = snprintf(out, size, "%s %d: %s file '%s' %s client", log_label, r->session,
+                     r->event == LOG_GET ? "Transmitting" : "Receiving", r->path,
+                     r->event == LOG_GET ? "to" : "from");
+        if (r->streams > 0) {
+            n += snprintf(out + n, size - n, " over %d streams", r->streams);
+        }
+        n += snprintf(out + n, size - n, "\n");
+        break;
+    case LOG_PUT_FAILED:
+        n = snprintf(out, size, "%s %d: File '%s' not committed: %s\n", log_label, r->session, r->path,
+                     strerror(r->streams));
+        break;
+    case LOG_QUIT:
+        n = snprintf(out, size, "%s %d: Quitting\n", log_label, r->session);
+        break;
+    default:
+        n = snprintf(out, size, "%s %d: command '%s'\n", log_label, r->session, r->path);
+        break;
+    }
+    return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+/* Must run before the server forks or starts threads. */
+int log_init(int level, int json, const char *label) {
+    log_level = level;
+    log_json = json;
+    log_label = label;
+
+    region = mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        return -1;
+    }
+    for (int i = 0; i < LOG_RINGS; i++) {
+        for (int j = 0; j < LOG_RING_SIZE; j++) {
+            region->rings[i].slots[j].seq = j;
+        }
+    }
+    return 0;
+}
+
+/* Takes a fresh ring in a forked session. */
+void log_attach(void) {
+    ring = NULL;
+}
+
+static struct log_ring *log_ring(void) {
+    if (ring == NULL) {
+        unsigned int i = __atomic_fetch_add(&region->next_ring, 1, __ATOMIC_RELAXED);
+        ring = &region->rings[i % LOG_RINGS];
+    }
+    return ring;
+}
+
+/* Fixed one-second window per ring; errors are never rate limited. */
+static int log_admit(struct log_ring *r, int level, uint64_t now) {
+    if (level == LOG_ERROR) {
+        return 1;
+    }
+    unsigned long second = now / 1000000000ull;
+    unsigned long seen = __atomic_load_n(&r->second, __ATOMIC_RELAXED);
+    if (seen != second &&
+        __atomic_compare_exchange_n(&r->second, &seen, second, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&r->count, 0, __ATOMIC_RELAXED);
+    }
+    return __atomic_fetch_add(&r->count, 1, __ATOMIC_RELAXED) < LOG_RATE;
+}
+
+void log_event(int level, int event, int session, const char *path, int streams) {
+    if (level > log_level) {
+        return;
+    }
+
+    struct log_record record;
+    record.time = log_clock();
+    record.session = session;
+    record.streams = streams;
+    record.level = level;
+    record.event = event;
+    record.path[0] = '\0';
+    if (path != NULL) {
+        strncat(record.path, path, sizeof(record.path) - 1);
+    }
+
+    if (region == NULL) {
+        char line[LOG_LINE_SIZE];
+        write_all(STDOUT_FILENO, line, format_record(line, sizeof(line), &record));
+        return;
+    }
+
+    struct log_ring *r = log_ring();
+    if (!log_admit(r, level, record.time)) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    unsigned long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    struct log_slot *slot;
+    for (;;) {
+        slot = &r->slots[pos % LOG_RING_SIZE];
+        long diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->record = record;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int log_take(struct log_ring *r, struct log_record *out) {
+    struct log_slot *slot = &r->slots[r->head % LOG_RING_SIZE];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != r->head + 1) {
+        return 0;
+    }
+    *out = slot->record;
+    __atomic_store_n(&slot->seq, r->head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    r->head++;
+    return 1;
+}
+
+static int record_order(const void *a, const void *b) {
+    const struct log_record *x = a, *y = b;
+    return x->time < y->time ? -1 : x->time > y->time;
+}
+
+static void *log_flusher(void *arg) {
+    static struct log_record batch[LOG_BATCH];
+    static char out[LOG_BATCH_BYTES];
+    (void)arg;
+
+    while (1) {
+        int n = 0;
+        unsigned long dropped = 0;
+        for (int i = 0; i < LOG_RINGS; i++) {
+            struct log_ring *r = &region->rings[i];
+            while (n < LOG_BATCH && log_take(r, &batch[n])) {
+                n++;
+            }
+            dropped += __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+        }
+        if (n == 0 && dropped == 0) {
+            struct timespec pause = { 0, LOG_FLUSH_INTERVAL_MS * 1000000L };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        qsort(batch, n, sizeof(batch[0]), record_order);
+        size_t len = 0;
+        for (int i = 0; i < n; i++) {
+            if (sizeof(out) - len < LOG_LINE_SIZE) {
+                write_all(STDOUT_FILENO, out, len);
+                len = 0;
+            }
+            len += format_record(out + len, LOG_LINE_SIZE, &batch[i]);
+        }
+        if (dropped > 0) {
+            if (sizeof(out) - len < LOG_LINE_SIZE) {
+                write_all(STDOUT_FILENO, out, len);
+                len = 0;
+            }
+            len += snprintf(out + len, sizeof(out) - len, log_json ?
+                            "{\"level\":\"error\",\"event\":\"dropped\",\"records\":%lu}\n" :
+                            "Log: dropped %lu records\n", dropped);
+        }
+        write_all(STDOUT_FILENO, out, len);
+    }
+    return NULL;
+}
+
+int log_start(void) {
+    if (region == NULL) {
+        return 0;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_flusher, NULL) != 0) {
+        /* Nobody would drain the rings: log synchronously instead. */
+        munmap(region, sizeof(*region));
+        region = NULL;
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
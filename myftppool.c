@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "myftp.h"
+
+/*
+ * Worker pool for blocking file I/O in epoll mode.
+ *
+ * Every worker owns a bounded deque.  Reactors deal new tasks round-robin
+ * onto the deques; a worker pops from the bottom of its own deque and,
+ * when that is empty, steals from the top of the others, so one slow disk
+ * cannot strand work behind it while other workers sit idle.  A finished
+ * task is handed back on the submitter's completion queue, whose eventfd
+ * wakes the reactor that owns the session.  Sessions keep at most one
+ * task in flight, which is what keeps each session's I/O in order.
+ */
+
+struct work_deque {
+    pthread_mutex_t lock;
+    unsigned long top;
+    unsigned long bottom;
+    struct pool_task *tasks[POOL_DEQUE_SIZE];
+};
+
+static struct {
+    int workers;
+    struct work_deque *deques;
+    unsigned long next;
+    unsigned long queued;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+} pool = { 0, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int deque_push(struct work_deque *d, struct pool_task *task) {
+    int ok = 0;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top < POOL_DEQUE_SIZE) {
+        d->tasks[d->bottom++ % POOL_DEQUE_SIZE] = task;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return ok;
+}
+
+static struct pool_task *deque_pop(struct work_deque *d) {
+    struct pool_task *task = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top) {
+        task = d->tasks[--d->bottom % POOL_DEQUE_SIZE];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+static struct pool_task *deque_steal(struct work_deque *d) {
+    struct pool_task *task = NULL;
+    if (pthread_mutex_trylock(&d->lock) != 0) {
+        return NULL;
+    }
+    if (d->bottom != d->top) {
+        task = d->tasks[d->top++ % POOL_DEQUE_SIZE];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return task;
+}
+
+/* Hands a finished task back to its reactor; also used by the group-commit flusher. */
+void pool_complete(struct pool_task *task) {
+    struct completion_queue *q = task->done;
+    uint64_t one = 1;
+
+    task->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail != NULL) {
+        q->tail->next = task;
+    } else {
+        q->head = task;
+    }
+    q->tail = task;
+    pthread_mutex_unlock(&q->lock);
+    write(q->fd, &one, sizeof(one));
+}
+
+static struct pool_task *pool_take(int self) {
+    struct pool_task *task = deque_pop(&pool.deques[self]);
+    for (int i = 1; task == NULL && i < pool.workers; i++) {
+        task = deque_steal(&pool.deques[(self + i) % pool.workers]);
+    }
+    if (task != NULL) {
+        __atomic_fetch_sub(&pool.queued, 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+static void *pool_worker(void *arg) {
+    int self = (int)(long)arg;
+
+    while (1) {
+        struct pool_task *task = pool_take(self);
+        if (task == NULL) {
+            pthread_mutex_lock(&pool.idle_lock);
+            while (__atomic_load_n(&pool.queued, __ATOMIC_RELAXED) == 0) {
+                pthread_cond_wait(&pool.idle, &pool.idle_lock);
+            }
+            pthread_mutex_unlock(&pool.idle_lock);
+            continue;
+        }
+        task->run(task);
+        pool_complete(task);
+    }
+    return NULL;
+}
+
+int pool_start(int workers) {
+    pool.deques = calloc(workers, sizeof(*pool.deques));
+    if (pool.deques == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, (void *)(long)i) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        pool.workers++;
+    }
+    return pool.workers > 0 ? 0 : -1;
+}
+
+void pool_submit(struct pool_task *task) {
+    unsigned long start = __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < pool.workers; i++) {
+        if (deque_push(&pool.deques[(start + i) % pool.workers], task)) {
+            __atomic_fetch_add(&pool.queued, 1, __ATOMIC_RELAXED);
+            pthread_mutex_lock(&pool.idle_lock);
+            pthread_cond_signal(&pool.idle);
+            pthread_mutex_unlock(&pool.idle_lock);
+            return;
+        }
+    }
+
+    /* No pool, or every deque is full: do the work on the caller's thread. */
+    task->run(task);
+    pool_complete(task);
+}
+
+int completion_queue_init(struct completion_queue *q) {
+    pthread_mutex_init(&q->lock, NULL);
+    q->head = q->tail = NULL;
+    q->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return q->fd;
+}
+
+struct pool_task *completion_queue_take(struct completion_queue *q) {
+    uint64_t count;
+    read(q->fd, &count, sizeof(count));
+
+    pthread_mutex_lock(&q->lock);
+    struct pool_task *list = q->head;
+    q->head = q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+    return list;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,10 +13,16 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <sys/time.h>
+#include <sys/prctl.h>
+#include <sched.h>
 
 #include "myftp.h"
 
-int setup_server(int port) {
+/* This session's pinned data-socket buffer size (0 leaves autotuning on); see myftpsock.c. */
+static int data_buffer;
+
+int setup_server(int port, int reuseport) {
     int sockfd;
     struct sockaddr_in server_addr;
 
@@ -26,7 +33,8 @@ int setup_server(int port) {
     }
 
     int opt = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)) {
         fprintf(stderr, "Error: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
@@ -42,7 +50,7 @@ int setup_server(int port) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(sockfd, BACKLOG) < 0) {
+    if (sock_listen(sockfd) < 0) {
         fprintf(stderr, "Error: %s\n", strerror(errno));
         close(sockfd);
         exit(EXIT_FAILURE);
@@ -51,14 +59,13 @@ int setup_server(int port) {
     return sockfd;
 }
 
-int handle_data_connection(int client_sock) {
+int open_data_listener(int *port) {
     int data_sock;
     struct sockaddr_in data_addr;
     socklen_t addr_len = sizeof(data_addr);
 
     data_sock = socket(AF_INET, SOCK_STREAM, 0);
     if (data_sock < 0) {
-        write(client_sock, "EError creating data socket\n", 28);
         return -1;
     }
 
@@ -67,25 +74,27 @@ int handle_data_connection(int client_sock) {
     data_addr.sin_addr.s_addr = INADDR_ANY;
     data_addr.sin_port = 0;
 
-    if (bind(data_sock, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0) {
-        write(client_sock, "EError binding data socket\n", 27);
+    if (bind(data_sock, (struct sockaddr *)&data_addr, sizeof(data_addr)) < 0 ||
+        sock_listen(data_sock) < 0 ||
+        getsockname(data_sock, (struct sockaddr *)&data_addr, &addr_len) < 0) {
         close(data_sock);
         return -1;
     }
 
-    if (listen(data_sock, BACKLOG) < 0) {
-        write(client_sock, "EError listening on data socket\n", 32);
-        close(data_sock);
-        return -1;
-    }
+    *port = ntohs(data_addr.sin_port);
+    return data_sock;
+}
 
-    if (getsockname(data_sock, (struct sockaddr *)&data_addr, &addr_len) < 0) {
-        write(client_sock, "EError getting socket name\n", 27);
-        close(data_sock);
+int handle_data_connection(int client_sock) {
+    int port;
+    int data_sock = open_data_listener(&port);
+    if (data_sock < 0) {
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), "EError creating data socket: %s\n", strerror(errno));
+        write(client_sock, error_msg, strlen(error_msg));
         return -1;
     }
 
-    int port = ntohs(data_addr.sin_port);
     char response[32];
     snprintf(response, sizeof(response), "A%d\n", port);
     write(client_sock, response, strlen(response));
@@ -102,8 +111,7 @@ void handle_rcd(int client_sock, const char *pathname) {
 
     if (chdir(pathname) == 0) {
         write(client_sock, "A\n", 2);
-        printf("Child %d: changed directory to '%s'\n", pid, pathname);
-        fflush(stdout);
+        log_event(LOG_INFO, LOG_CD, pid, pathname, 0);
     } else {
         char error_msg[256];
         snprintf(error_msg, sizeof(error_msg), "EError changing directory: %s\n", strerror(errno));
@@ -111,129 +119,426 @@ void handle_rcd(int client_sock, const char *pathname) {
     }
 }
 
-void handle_rls(int client_sock, int data_sock) {
-    int data_conn = accept(data_sock, NULL, NULL);
+int accept_data_connection(int client_sock, int *data_listen_fd, int *data_fd, int keep_data) {
+    if (*data_fd >= 0) {
+        return *data_fd;
+    }
+    if (*data_listen_fd < 0) {
+        write(client_sock, "E No data connection established\n", 33);
+        return -1;
+    }
+
+    int data_conn = accept(*data_listen_fd, NULL, NULL);
+    close(*data_listen_fd);
+    *data_listen_fd = -1;
     if (data_conn < 0) {
         write(client_sock, "EError accepting data connection\n", 33);
-        return;
+        return -1;
     }
+    sock_data(data_conn, data_buffer);
 
-    pid_t pid = fork();
-    if (pid == 0) {
-        close(data_sock);
-        dup2(data_conn, STDOUT_FILENO);
-        dup2(data_conn, STDERR_FILENO);
-        close(data_conn);
-        execlp("ls", "ls", "-l", NULL);
-        _exit(EXIT_FAILURE);
-    } else if (pid > 0) {
-        close(data_conn);
-        waitpid(pid, NULL, 0);
+    if (keep_data) {
+        *data_fd = data_conn;
+    }
+    return data_conn;
+}
+
+void release_data_connection(int data_conn, int *data_fd, int status) {
+    if (data_conn == *data_fd) {
+        if (status == 0) {
+            return;
+        }
+        *data_fd = -1;
+    }
+    close(data_conn);
+}
+
+void listing_error_reply(char cmd, int error, char *response, size_t size) {
+    if (error != EINVAL) {
+        snprintf(response, size, "EError reading directory: %s\n", strerror(error));
+    } else if (cmd == 'N') {
+        snprintf(response, size, "E N command takes a pattern\n");
+    } else {
+        snprintf(response, size, "E Usage: %c [start count]\n", cmd);
+    }
+}
+
+int handle_rls(int client_sock, int data_conn, int framed, char cmd, struct dir_lister *lister) {
+    int status = send_listing(data_conn, lister, framed);
+    int error = status < 0 ? errno : dir_lister_error(lister);
+    dir_lister_close(lister);
+    if (error != 0) {
+        char error_msg[256];
+        listing_error_reply(cmd, error, error_msg, sizeof(error_msg));
+        write(client_sock, error_msg, strlen(error_msg));
+    } else {
         write(client_sock, "A\n", 2);
+    }
+    return status;
+}
+
+
+int open_transfer_file(int dir_fd, const char *pathname, int get, off_t offset) {
+    if (get) {
+        /* A restart offset past the end would leave nothing to frame but a negative length. */
+        struct stat st;
+        int file_fd = openat(dir_fd, pathname, O_RDONLY | O_CLOEXEC);
+        if (file_fd >= 0 && offset > 0 && (fstat(file_fd, &st) < 0 || offset > st.st_size)) {
+            close(file_fd);
+            errno = EINVAL;
+            return -1;
+        }
+        return file_fd;
+    }
+    /* Never write through a hard link into the chunk store. */
+    if (store_unshare(dir_fd, pathname, offset) < 0) {
+        return -1;
+    }
+    if (offset == 0) {
+        return openat(dir_fd, pathname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+
+    /* Resumed upload: keep the first offset bytes and continue after them. */
+    struct stat st;
+    int file_fd = openat(dir_fd, pathname, O_WRONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        return -1;
+    }
+    if (fstat(file_fd, &st) < 0 || offset > st.st_size) {
+        close(file_fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if (ftruncate(file_fd, offset) < 0 || lseek(file_fd, offset, SEEK_SET) < 0) {
+        close(file_fd);
+        return -1;
+    }
+    return file_fd;
+}
+
+void size_reply(int dir_fd, const char *pathname, char *response, size_t size) {
+    struct stat st;
+    if (fstatat(dir_fd, pathname, &st, 0) < 0) {
+        snprintf(response, size, "EError reading file size: %s\n", strerror(errno));
+    } else if (!S_ISREG(st.st_mode)) {
+        snprintf(response, size, "E Not a regular file\n");
     } else {
-        write(client_sock, "EError forking for ls command\n", 30);
+        snprintf(response, size, "A%lld\n", (long long)st.st_size);
     }
 }
 
+static void crc_reply(int dir_fd, const char *pathname, off_t length, char *response, size_t size) {
+    struct stat st;
+    uint32_t crc;
+    int fd = openat(dir_fd, pathname, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        snprintf(response, size, "EError opening file: %s\n", strerror(errno));
+    } else if (!S_ISREG(st.st_mode)) {
+        snprintf(response, size, "E Not a regular file\n");
+    } else if (st.st_size < length) {
+        snprintf(response, size, "E File is shorter than %lld bytes\n", (long long)length);
+    } else if (crc32c_prefix(fd, length, &crc) < 0) {
+        snprintf(response, size, "EError reading file: %s\n", strerror(errno));
+    } else {
+        snprintf(response, size, "A%08x\n", crc);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
 
-void handle_get(int client_sock, int data_sock, const char *pathname) {
-    pid_t pid = getpid();
-    int data_conn = accept(data_sock, NULL, NULL);
-    if (data_conn < 0) {
-        write(client_sock, "EError accepting data connection\n", 33);
-        return;
+void checksum_reply(int dir_fd, const char *pathname, char *response, size_t size) {
+    crc_reply(dir_fd, pathname, -1, response, size);
+}
+
+/* O<length> <path>: the checksum of a file's first length bytes, so a resume can check its prefix. */
+void prefix_checksum_reply(int dir_fd, const char *arg, char *response, size_t size) {
+    char *end;
+    long long length = strtoll(arg, &end, 10);
+    if (end == arg || *end != ' ' || end[1] == '\0' || length < 0) {
+        snprintf(response, size, "E O command takes a length and a path\n");
+    } else {
+        crc_reply(dir_fd, end + 1, length, response, size);
     }
+}
 
-    int file_fd = open(pathname, O_RDONLY);
+/* The reply a put sent after F gets once its upload is committed (or not). */
+void commit_reply(int error, char *response, size_t size) {
+    if (error == 0) {
+        snprintf(response, size, "A\n");
+    } else {
+        snprintf(response, size, "EError committing file: %s\n", strerror(error));
+    }
+}
+
+/* Commits a finished put, or discards it if status says it failed; returns the error for commit_reply(). */
+int finish_upload(int file_fd, int dir_fd, const char *temp, const char *pathname, off_t size, int mode,
+                  int status) {
+    if (status < 0) {
+        int error = errno != 0 ? errno : EIO;
+        upload_discard(dir_fd, temp);
+        return error;
+    }
+    return upload_commit(file_fd, dir_fd, temp, pathname, size, mode < 0 ? DURABLE_NONE : mode) < 0 ? errno : 0;
+}
+
+int handle_get(int client_sock, int data_conn, const char *pathname, off_t offset, int level, int framed) {
+    pid_t pid = getpid();
+    int file_fd = open_transfer_file(AT_FDCWD, pathname, 1, offset);
     if (file_fd < 0) {
         char error_msg[256];
         snprintf(error_msg, sizeof(error_msg), "EError opening file: %s\n", strerror(errno));
         write(client_sock, error_msg, strlen(error_msg));
-        close(data_conn);
-        return;
+        return 0;
     }
 
     write(client_sock, "A\n", 2);
-    printf("Child %d: Transmitting file '%s' to client\n", pid, pathname);
-    fflush(stdout);
+    log_event(LOG_INFO, LOG_GET, pid, pathname, 0);
+
+    struct shaper shaper;
+    struct stat st;
+    off_t length = fstat(file_fd, &st) == 0 ? st.st_size - offset : -1;
+    shape_begin(&shaper, length, 1);
+    io_shaper = &shaper;
+
+    off_t base, size;
+    int hot = level > 0 ? -1 : hotcache_acquire(file_fd, &base, &size);
+    int status;
+    if (level > 0) {
+        status = send_file_compressed(data_conn, file_fd, offset, level);
+    } else if (hot >= 0) {
+        status = send_range(data_conn, hotcache_fd, base + offset, base + size, framed);
+        hotcache_release(hot, status == 0 && offset < size ? size - offset : 0);
+    } else if (uring_ready()) {
+        status = uring_send_file(data_conn, file_fd, offset, framed);
+    } else {
+        status = framed ? send_file_framed(data_conn, file_fd, offset) : send_file(data_conn, file_fd, offset);
+    }
 
-    char buffer[1024];
-    ssize_t bytes_read;
-    while ((bytes_read = read(file_fd, buffer, sizeof(buffer))) > 0) {
-        if (write(data_conn, buffer, bytes_read) < 0) {
-            break;
+    io_shaper = NULL;
+    shape_end(&shaper);
+    close(file_fd);
+    if (status == 0 && length >= SOCK_MEASURE_MIN) {
+        data_buffer = sock_measure(data_conn, data_buffer);
+    }
+    return status;
+}
+
+int handle_put(int client_sock, int data_conn, const char *pathname, off_t size, off_t offset,
+               int level, int durability, int framed) {
+    pid_t pid = getpid();
+    char temp[BUFFER_SIZE];
+    int file_fd = upload_open(AT_FDCWD, pathname, offset, temp, sizeof(temp));
+    if (file_fd < 0) {
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), "EError creating file: %s\n", strerror(errno));
+        write(client_sock, error_msg, strlen(error_msg));
+        if (!framed) {
+            return 0;
         }
+        /* A framed body follows a rejected P too (it may be pipelined); drop it. */
+        return receive_framed(-1, data_conn);
     }
 
+    write(client_sock, "A\n", 2);
+    log_event(LOG_INFO, LOG_PUT, pid, pathname, 0);
+
+    struct shaper shaper;
+    shape_begin(&shaper, size >= 0 ? size - offset : -1, 1);
+    io_shaper = &shaper;
+
+    preallocate_file(file_fd, size);
+    int status;
+    if (level > 0) {
+        status = receive_compressed(file_fd, data_conn);
+    } else if (uring_ready()) {
+        status = uring_receive_file(file_fd, data_conn, framed);
+    } else {
+        status = framed ? receive_framed(file_fd, data_conn) : receive_file(file_fd, data_conn);
+    }
+
+    io_shaper = NULL;
+    shape_end(&shaper);
+    if (status == 0 && !upload_ended(size, framed, level)) {
+        errno = EPIPE;
+        status = -1;
+    }
+    int error = finish_upload(file_fd, AT_FDCWD, temp, pathname, size, durability, status);
+    if (error != 0) {
+        log_event(LOG_ERROR, LOG_PUT_FAILED, pid, pathname, error);
+    }
+    if (durability >= 0) {
+        char response[256];
+        commit_reply(error, response, sizeof(response));
+        write(client_sock, response, strlen(response));
+    }
     close(file_fd);
-    close(data_conn);
+    return status;
 }
 
-void handle_put(int client_sock, int data_sock, const char *pathname) {
+/*
+ * U rebuilds pathname from the client's delta, V sends one against the
+ * client's copy and X stores pathname from the client's chunk list.
+ */
+int handle_delta(int client_sock, int data_conn, const char *pathname, char cmd, int framed) {
     pid_t pid = getpid();
-    int data_conn = accept(data_sock, NULL, NULL);
-    if (data_conn < 0) {
-        write(client_sock, "EError accepting data connection\n", 33);
-        return;
+    char temp[BUFFER_SIZE];
+    int get = cmd == 'V';
+    if (cmd == 'X' && store_fd < 0) {
+        write(client_sock, "E No chunk store on this server\n", 32);
+        return 0;
     }
-
-    int file_fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int file_fd = get ? open_transfer_file(AT_FDCWD, pathname, 1, 0)
+                      : delta_temp_file(AT_FDCWD, pathname, temp, sizeof(temp));
     if (file_fd < 0) {
         char error_msg[256];
-        snprintf(error_msg, sizeof(error_msg), "EError creating file: %s\n", strerror(errno));
+        snprintf(error_msg, sizeof(error_msg), "EError %s file: %s\n", get ? "opening" : "creating", strerror(errno));
         write(client_sock, error_msg, strlen(error_msg));
-        close(data_conn);
-        return;
+        return 0;
     }
 
     write(client_sock, "A\n", 2);
-    printf("Child %d: Receiving file '%s' from client\n", pid, pathname);
-    fflush(stdout);
+    log_event(LOG_INFO, get ? LOG_GET : LOG_PUT, pid, pathname, 0);
 
-    char buffer[1024];
-    ssize_t bytes_read;
-    while ((bytes_read = read(data_conn, buffer, sizeof(buffer))) > 0) {
-        if (write(file_fd, buffer, bytes_read) < 0) {
-            break;
-        }
+    struct shaper shaper;
+    shape_begin(&shaper, -1, 1);
+    io_shaper = &shaper;
+
+    int status;
+    if (cmd == 'V') {
+        status = delta_send(data_conn, framed, file_fd, NULL);
+    } else if (cmd == 'U') {
+        status = delta_rebuild(data_conn, framed, AT_FDCWD, pathname, file_fd, temp, NULL);
+    } else {
+        status = store_receive(data_conn, framed, AT_FDCWD, pathname, file_fd, temp);
     }
 
+    io_shaper = NULL;
+    shape_end(&shaper);
     close(file_fd);
-    close(data_conn);
+    return status;
 }
 
-int receive_command(int sock_fd, char *buffer, size_t buffer_size) {
-    ssize_t total_read = 0;
-    while (1) {
-        char c;
-        ssize_t r = read(sock_fd, &c, 1);
-        if (r <= 0) {
+int open_stripe_listener(const char *arg, int *streams, size_t *chunk_size, int *port) {
+    char *end;
+    long n = strtol(arg, &end, 10);
+    long long chunk = *end == ' ' ? strtoll(end + 1, &end, 10) : IO_CHUNK_SIZE;
+
+    if (*arg == '\0' || *end != '\0' || n < 1 || n > MAX_STREAMS || chunk < 4096 || chunk > MAX_CHUNK_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int listen_fd = open_data_listener(port);
+    if (listen_fd < 0) {
+        return -1;
+    }
+
+    /* Never wait forever for streams the client does not open. */
+    struct timeval timeout = { STRIPE_ACCEPT_TIMEOUT, 0 };
+    setsockopt(listen_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    listen(listen_fd, n);
+
+    *streams = n;
+    *chunk_size = chunk;
+    return listen_fd;
+}
+
+int accept_stripes(int listen_fd, int *socks, int streams) {
+    for (int i = 0; i < streams; i++) {
+        socks[i] = accept(listen_fd, NULL, NULL);
+        if (socks[i] < 0) {
+            while (--i >= 0) {
+                close(socks[i]);
+            }
             return -1;
         }
+    }
+    return 0;
+}
 
-        if (c == '\n') {
-            buffer[total_read] = '\0';
-            break;
-        }
+int transfer_stripes(int listen_fd, int file_fd, int streams, size_t chunk_size, off_t offset, off_t size,
+                     int get) {
+    int socks[MAX_STREAMS];
+    int status;
 
-        if (total_read < (ssize_t)(buffer_size - 1)) {
-            buffer[total_read++] = c;
-        } else {
-            buffer[total_read] = '\0';
-            break;
+    if (accept_stripes(listen_fd, socks, streams) < 0) {
+        return -1;
+    }
+    if (get) {
+        status = send_file_striped(socks, streams, file_fd, chunk_size, offset);
+    } else {
+        status = receive_file_striped(socks, streams, file_fd, chunk_size, offset, size);
+    }
+    for (int i = 0; i < streams; i++) {
+        close(socks[i]);
+    }
+    return status;
+}
+
+void handle_striped(int client_sock, int listen_fd, int streams, size_t chunk_size,
+                    const char *pathname, int get, off_t size, off_t offset, int durability) {
+    pid_t pid = getpid();
+    char temp[BUFFER_SIZE];
+    int file_fd = get ? open_transfer_file(AT_FDCWD, pathname, 1, offset)
+                      : upload_open(AT_FDCWD, pathname, offset, temp, sizeof(temp));
+    if (file_fd < 0) {
+        char error_msg[256];
+        snprintf(error_msg, sizeof(error_msg), "EError %s file: %s\n", get ? "opening" : "creating", strerror(errno));
+        write(client_sock, error_msg, strlen(error_msg));
+        return;
+    }
+
+    write(client_sock, "A\n", 2);
+    log_event(LOG_INFO, get ? LOG_GET : LOG_PUT, pid, pathname, streams);
+
+    if (!get) {
+        preallocate_file(file_fd, size);
+    }
+    int status = transfer_stripes(listen_fd, file_fd, streams, chunk_size, offset, size, get);
+    if (!get) {
+        int error = finish_upload(file_fd, AT_FDCWD, temp, pathname, size, durability, status);
+        if (error != 0) {
+            log_event(LOG_ERROR, LOG_PUT_FAILED, pid, pathname, error);
+        }
+        if (durability >= 0) {
+            char response[256];
+            commit_reply(error, response, sizeof(response));
+            write(client_sock, response, strlen(response));
         }
     }
-    return 0;
+    close(file_fd);
+}
+
+int receive_command(struct line_reader *reader, char *buffer, size_t buffer_size) {
+    return read_line(reader, buffer, buffer_size) < 0 ? -1 : 0;
 }
 
 void handle_client(int client_sock) {
     pid_t pid = getpid();
     int data_listen_fd = -1;
     int data_fd = -1;
+    int data_conn;
+    int keep_data = 0;
+    int stripe_listen_fd = -1;
+    int stripe_streams = 0;
+    size_t stripe_chunk = 0;
+    int status;
+    off_t upload_size = -1;
+    off_t restart_offset = 0;
+    int compress_level = 0;
+    int durability = -1;
     char buffer[BUFFER_SIZE];
+    struct line_reader reader;
+
+    line_reader_init(&reader, client_sock);
+    stats_attach();
+    log_attach();
 
     while (1) {
-        if (receive_command(client_sock, buffer, sizeof(buffer)) < 0) {
+        struct io_counters before, after;
+
+        if (receive_command(&reader, buffer, sizeof(buffer)) < 0) {
             break;
         }
 
@@ -241,18 +546,28 @@ void handle_client(int client_sock) {
             continue;
         }
 
+        log_event(LOG_DEBUG, LOG_COMMAND, pid, buffer, 0);
         char cmd = buffer[0];
         char *arg = buffer + 1;
         while (*arg == ' ') arg++;
+        uint64_t start = stats_clock();
+        io_snapshot(&before);
 
-        if (cmd == 'D') {
+        if (cmd == 'D' || cmd == 'K') {
             if (*arg != '\0') {
-                write(client_sock, "E D command takes no arguments\n", 31);
+                char error_msg[64];
+                snprintf(error_msg, sizeof(error_msg), "E %c command takes no arguments\n", cmd);
+                write(client_sock, error_msg, strlen(error_msg));
             } else {
-                data_listen_fd = handle_data_connection(client_sock);
-                if (data_listen_fd < 0) {
-                    write(client_sock, "E data connection failed\n", 25);
+                if (data_listen_fd >= 0) {
+                    close(data_listen_fd);
                 }
+                if (data_fd >= 0) {
+                    close(data_fd);
+                    data_fd = -1;
+                }
+                data_listen_fd = handle_data_connection(client_sock);
+                keep_data = cmd == 'K';
             }
 
         } else if (cmd == 'C') {
@@ -262,35 +577,138 @@ void handle_client(int client_sock) {
                 handle_rcd(client_sock, arg);
             }
 
-        } else if (cmd == 'L') {
-            if (*arg != '\0') {
-                write(client_sock, "E L command takes no arguments\n", 31);
-            } else if (data_listen_fd < 0) {
-                write(client_sock, "E No data connection established\n", 33);
+        } else if (cmd == 'S' && *arg != '\0') {
+            write(client_sock, "E S command takes no arguments\n", 31);
+
+        } else if (cmd == 'L' || cmd == 'M' || cmd == 'N' || cmd == 'S') {
+            struct dir_lister *lister = cmd == 'S' ? stats_listing() : open_listing(AT_FDCWD, cmd, arg);
+            if (lister == NULL) {
+                write(client_sock, "EError allocating directory listing\n", 36);
+            } else if ((data_conn = accept_data_connection(client_sock, &data_listen_fd, &data_fd, keep_data)) >= 0) {
+                status = handle_rls(client_sock, data_conn, data_conn == data_fd, cmd, lister);
+                release_data_connection(data_conn, &data_fd, status);
             } else {
-                handle_rls(client_sock, data_listen_fd);
-                close(data_listen_fd);
-                data_listen_fd = -1;
+                dir_lister_close(lister);
             }
 
-        } else if (cmd == 'G') {
-            if (data_listen_fd < 0) {
-                write(client_sock, "E No data connection established\n", 33);
+        } else if ((cmd == 'G' || cmd == 'P') && stripe_listen_fd >= 0) {
+            handle_striped(client_sock, stripe_listen_fd, stripe_streams, stripe_chunk, arg, cmd == 'G',
+                           upload_size, restart_offset, durability);
+            close(stripe_listen_fd);
+            stripe_listen_fd = -1;
+            upload_size = -1;
+            restart_offset = 0;
+            compress_level = 0;
+            durability = -1;
+
+        } else if (cmd == 'W') {
+            if (stripe_listen_fd >= 0) {
+                close(stripe_listen_fd);
+            }
+            int port;
+            char response[256];
+            stripe_listen_fd = open_stripe_listener(arg, &stripe_streams, &stripe_chunk, &port);
+            if (stripe_listen_fd >= 0) {
+                snprintf(response, sizeof(response), "A%d\n", port);
+            } else if (errno == EINVAL) {
+                snprintf(response, sizeof(response), "E Usage: W<streams> [chunk size]\n");
             } else {
-                handle_get(client_sock, data_listen_fd, arg);
-                close(data_listen_fd);
-                data_listen_fd = -1;
+                snprintf(response, sizeof(response), "EError creating data socket: %s\n", strerror(errno));
             }
+            write(client_sock, response, strlen(response));
+
+        } else if (cmd == 'G') {
+            if ((data_conn = accept_data_connection(client_sock, &data_listen_fd, &data_fd, keep_data)) >= 0) {
+                status = handle_get(client_sock, data_conn, arg, restart_offset, compress_level, data_conn == data_fd);
+                release_data_connection(data_conn, &data_fd, status);
+            }
+            restart_offset = 0;
+            compress_level = 0;
+            durability = -1;
 
         } else if (cmd == 'P') {
-            if (data_listen_fd < 0) {
-                write(client_sock, "E No data connection established\n", 33);
+            if ((data_conn = accept_data_connection(client_sock, &data_listen_fd, &data_fd, keep_data)) >= 0) {
+                status = handle_put(client_sock, data_conn, arg, upload_size, restart_offset, compress_level,
+                                    durability, data_conn == data_fd);
+                release_data_connection(data_conn, &data_fd, status);
+            }
+            upload_size = -1;
+            restart_offset = 0;
+            compress_level = 0;
+            durability = -1;
+
+        } else if (cmd == 'U' || cmd == 'V' || cmd == 'X') {
+            if ((data_conn = accept_data_connection(client_sock, &data_listen_fd, &data_fd, keep_data)) >= 0) {
+                status = handle_delta(client_sock, data_conn, arg, cmd, data_conn == data_fd);
+                release_data_connection(data_conn, &data_fd, status);
+            }
+            upload_size = -1;
+            restart_offset = 0;
+            compress_level = 0;
+            durability = -1;
+
+        } else if (cmd == 'Z') {
+            char *end;
+            long long size = strtoll(arg, &end, 10);
+            if (*arg == '\0' || *end != '\0' || size < 0) {
+                write(client_sock, "E Z command takes a file size\n", 30);
             } else {
-                handle_put(client_sock, data_listen_fd, arg);
-                close(data_listen_fd);
-                data_listen_fd = -1;
+                upload_size = size;
+                write(client_sock, "A\n", 2);
             }
 
+        } else if (cmd == 'R') {
+            char *end;
+            long long offset = strtoll(arg, &end, 10);
+            if (*arg == '\0' || *end != '\0' || offset < 0) {
+                write(client_sock, "E R command takes a byte offset\n", 32);
+            } else {
+                restart_offset = offset;
+                write(client_sock, "A\n", 2);
+            }
+
+        } else if (cmd == 'Y') {
+            char *end;
+            long level = strtol(arg, &end, 10);
+            if (*arg == '\0' || *end != '\0' || level < 0 || level > 9) {
+                write(client_sock, "E Y command takes a compression level 0-9\n", 42);
+            } else {
+                compress_level = level;
+                write(client_sock, "A\n", 2);
+            }
+
+        } else if (cmd == 'F') {
+            int mode = durability_parse(arg);
+            if (mode < 0) {
+                write(client_sock, "E F command takes none, sync or group\n", 38);
+            } else {
+                durability = mode;
+                write(client_sock, "A\n", 2);
+            }
+
+        } else if (cmd == 'I') {
+            char response[256];
+            if (*arg == '\0') {
+                snprintf(response, sizeof(response), "E Path required for 'I' command\n");
+            } else {
+                size_reply(AT_FDCWD, arg, response, sizeof(response));
+            }
+            write(client_sock, response, strlen(response));
+
+        } else if (cmd == 'H') {
+            char response[256];
+            if (*arg == '\0') {
+                snprintf(response, sizeof(response), "E Path required for 'H' command\n");
+            } else {
+                checksum_reply(AT_FDCWD, arg, response, sizeof(response));
+            }
+            write(client_sock, response, strlen(response));
+
+        } else if (cmd == 'O') {
+            char response[256];
+            prefix_checksum_reply(AT_FDCWD, arg, response, sizeof(response));
+            write(client_sock, response, strlen(response));
+
         } else if (cmd == 'Q') {
             if (*arg == '\0') {
                 write(client_sock, "A\n", 2);
@@ -302,6 +720,9 @@ void handle_client(int client_sock) {
         } else {
             write(client_sock, "E Unknown command\n", 18);
         }
+
+        io_snapshot(&after);
+        stats_command(cmd, start, &before, &after);
     }
 
     if (data_fd >= 0) {
@@ -312,18 +733,26 @@ void handle_client(int client_sock) {
         close(data_listen_fd);
         data_listen_fd = -1;
     }
+    if (stripe_listen_fd >= 0) {
+        close(stripe_listen_fd);
+    }
 
     close(client_sock);
-    printf("Child %d: Quitting\n", pid);
-    fflush(stdout);
+    log_event(LOG_INFO, LOG_QUIT, pid, NULL, 0);
 
     exit(0);
 }
 
 void handle_sigchld(int sig) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    while (waitpid(-1, NULL, WNOHANG) > 0) {
+        stats_sessions(-1);
+    }
 }
 
+/* What this server could run on before accept_shards() pinned it; sessions get it back. */
+static cpu_set_t server_cpus;
+static int server_pinned;
+
 void client_connection(int server_sock) {
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
@@ -343,39 +772,226 @@ void client_connection(int server_sock) {
             }
         }
 
-        printf("Connection established with client.\n");
-        fflush(stdout);
+        stats_sessions(1);
+        stats_accept_queue(server_sock);
+        sock_control(client_sock);
 
         pid_t pid = fork();
         if (pid < 0) {
             fprintf(stderr, "Error: fork failed: %s\n", strerror(errno));
             fflush(stdout);
+            stats_sessions(-1);
             close(client_sock);
         } else if (pid == 0) {
             close(server_sock);
+            /* Only the accept process is pinned; its sessions go where the scheduler puts them. */
+            if (server_pinned) {
+                sched_setaffinity(0, sizeof(server_cpus), &server_cpus);
+            }
             handle_client(client_sock);
         } else {
+            log_event(LOG_INFO, LOG_CONNECT, pid, NULL, 0);
             close(client_sock);
         }
     }
 }
 
+static void pin_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+/*
+ * CPU steering sends a connection taken on CPU c to shard c % n, and shard
+ * i runs on CPU i; the two agree only when the online CPUs are exactly 0
+ * to n-1 and this server may run on all of them.
+ */
+static int shards_cover_cpus(int n) {
+    cpu_set_t set;
+
+    if (sysconf(_SC_NPROCESSORS_ONLN) != n || sched_getaffinity(0, sizeof(set), &set) < 0 ||
+        CPU_COUNT(&set) != n) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!CPU_ISSET(i, &set)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Fork mode with -r: one accept loop per SO_REUSEPORT listener.  This
+ * process serves the first; a forked accept process serves each other,
+ * pinned to its shard's CPU when the kernel steers by CPU.
+ */
+void accept_shards(int *listen_fds, int n, int steer) {
+    server_pinned = steer == SHARD_CPU && sched_getaffinity(0, sizeof(server_cpus), &server_cpus) == 0;
+    for (int i = 1; i < n; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Error: unable to start accept process %d: %s\n", i, strerror(errno));
+        } else if (pid == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            for (int j = 0; j < n; j++) {
+                if (j != i) {
+                    close(listen_fds[j]);
+                }
+            }
+            if (steer == SHARD_CPU) {
+                pin_cpu(i);
+            }
+            stats_attach();
+            log_attach();
+            client_connection(listen_fds[i]);
+            exit(EXIT_FAILURE);
+        }
+        close(listen_fds[i]);
+    }
+
+    if (steer == SHARD_CPU) {
+        pin_cpu(0);
+    }
+    client_connection(listen_fds[0]);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
+    int event_mode = 0;
+    int nthreads = 1;
+    int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    long cache_mb = 0;
+    int stats_port = 0;
+    int log_level = LOG_INFO;
+    int log_json = 0;
+    const char *store_dir = NULL;
+    long global_kbps = 0;
+    long session_kbps = 0;
+    int backlog = 0;
+    int shard_mode = SHARD_NONE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:t:w:u:H:P:L:JB:b:cD:q:r:")) != -1) {
+        if (opt == 'c') {
+            zero_copy = 0;
+        } else if (opt == 'm' && strcmp(optarg, "fork") == 0) {
+            event_mode = 0;
+        } else if (opt == 'm' && strcmp(optarg, "epoll") == 0) {
+            event_mode = 1;
+        } else if (opt == 't' && atoi(optarg) > 0) {
+            nthreads = atoi(optarg);
+        } else if (opt == 'w' && atoi(optarg) >= 0) {
+            nworkers = atoi(optarg);
+        } else if (opt == 'u' && atoi(optarg) >= 0 && atoi(optarg) <= URING_MAX_DEPTH) {
+            uring_depth = atoi(optarg);
+        } else if (opt == 'H' && atol(optarg) >= 0) {
+            cache_mb = atol(optarg);
+        } else if (opt == 'P' && atoi(optarg) > 0 && atoi(optarg) <= 65535) {
+            stats_port = atoi(optarg);
+        } else if (opt == 'L' && strcmp(optarg, "error") == 0) {
+            log_level = LOG_ERROR;
+        } else if (opt == 'L' && strcmp(optarg, "info") == 0) {
+            log_level = LOG_INFO;
+        } else if (opt == 'L' && strcmp(optarg, "debug") == 0) {
+            log_level = LOG_DEBUG;
+        } else if (opt == 'J') {
+            log_json = 1;
+        } else if (opt == 'B' && atol(optarg) >= 0) {
+            global_kbps = atol(optarg);
+        } else if (opt == 'b' && atol(optarg) >= 0) {
+            session_kbps = atol(optarg);
+        } else if (opt == 'D') {
+            store_dir = optarg;
+        } else if (opt == 'q' && atoi(optarg) > 0) {
+            backlog = atoi(optarg);
+        } else if (opt == 'r' && strcmp(optarg, "hash") == 0) {
+            shard_mode = SHARD_HASH;
+        } else if (opt == 'r' && strcmp(optarg, "cpu") == 0) {
+            shard_mode = SHARD_CPU;
+        } else {
+            fprintf(stderr, "Usage: %s [-m fork|epoll] [-t threads] [-w workers] [-u depth] [-H cache_mb] [-P stats_port] [-L level] [-J] [-B kbps] [-b kbps] [-c] [-D store_dir] [-q backlog] [-r hash|cpu] <port>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-m fork|epoll] [-t threads] [-w workers] [-u depth] [-H cache_mb] [-P stats_port] [-L level] [-J] [-B kbps] [-b kbps] [-c] [-D store_dir] [-q backlog] [-r hash|cpu] <port>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    int port = atoi(argv[1]);
+    int port = atoi(argv[optind]);
 
     if (port <= 0) {
         fprintf(stderr, "Error: invalid port number\n");
         exit(EXIT_FAILURE);
     }
 
-    int server_sock = setup_server(port);
-    client_connection(server_sock);
+    if (uring_depth > 0 && event_mode) {
+        fprintf(stderr, "Error: io_uring data path is only used in fork mode\n");
+        uring_depth = 0;
+    }
+    if (uring_depth > 0 && uring_probe(uring_depth) < 0) {
+        fprintf(stderr, "Error: io_uring unavailable (%s), using the standard data path\n", strerror(errno));
+        uring_depth = 0;
+    }
+
+    if (cache_mb > 0 && hotcache_init((off_t)cache_mb << 20) < 0) {
+        fprintf(stderr, "Error: unable to create hot-file cache: %s\n", strerror(errno));
+    }
+
+    if (commit_start() < 0) {
+        fprintf(stderr, "Error: unable to start the group-commit flusher: %s\n", strerror(errno));
+    }
+
+    if (store_dir != NULL && store_init(store_dir) < 0) {
+        fprintf(stderr, "Error: unable to open chunk store %s: %s\n", store_dir, strerror(errno));
+    }
+
+    if (shape_init((uint64_t)global_kbps * 1024, (uint64_t)session_kbps * 1024) < 0) {
+        fprintf(stderr, "Error: unable to share the global rate limit: %s\n", strerror(errno));
+    }
 
-    close(server_sock);
+    sock_init(backlog);
+    if (shard_mode == SHARD_CPU && !shards_cover_cpus(nthreads)) {
+        fprintf(stderr, "Error: CPU steering needs -t equal to the number of online CPUs (%ld), using hash steering\n",
+                sysconf(_SC_NPROCESSORS_ONLN));
+        shard_mode = SHARD_HASH;
+    }
+    int nlisten = shard_mode != SHARD_NONE ? nthreads : 1;
+    int *listen_fds = calloc(nlisten, sizeof(*listen_fds));
+    if (listen_fds == NULL) {
+        fprintf(stderr, "Error: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nlisten; i++) {
+        listen_fds[i] = setup_server(port, shard_mode != SHARD_NONE);
+    }
+    if (shard_mode == SHARD_CPU && sock_steer_cpu(listen_fds[0], nlisten) < 0) {
+        fprintf(stderr, "Error: unable to steer connections by CPU (%s), using hash steering\n", strerror(errno));
+        shard_mode = SHARD_HASH;
+    }
+
+    if (stats_init() < 0) {
+        fprintf(stderr, "Error: unable to create statistics: %s\n", strerror(errno));
+    } else if (stats_port > 0 && stats_serve(stats_port, event_mode) < 0) {
+        fprintf(stderr, "Error: unable to serve statistics on port %d: %s\n", stats_port, strerror(errno));
+    }
+    if (log_init(log_level, log_json, event_mode ? "Session" : "Child") < 0 || log_start() < 0) {
+        fprintf(stderr, "Error: unable to start the log flusher, logging synchronously\n");
+    }
+    if (event_mode) {
+        event_server(listen_fds, nlisten, nthreads, nworkers > 0 ? nworkers : 0);
+    } else if (shard_mode != SHARD_NONE) {
+        accept_shards(listen_fds, nlisten, shard_mode);
+    } else {
+        client_connection(listen_fds[0]);
+    }
+
+    for (int i = 0; i < nlisten; i++) {
+        close(listen_fds[i]);
+    }
+    free(listen_fds);
     return 0;
-}
\ No newline at end of file
+}
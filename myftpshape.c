@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "myftp.h"
+
+/*
+ * Transfer shaping.
+ *
+ * Rate limits are token buckets kept as GCRA clocks: a clock holds the
+ * time at which its bucket will next be empty, sending n bytes pushes it
+ * n / rate seconds further, and the bytes may go once the clock is no
+ * more than SHAPE_BURST bytes' worth ahead of now.  The global clock sits
+ * in shared memory so forked sessions draw from one bucket with a single
+ * compare-and-swap; a session's own clocks are private.
+ *
+ * Fairness: every bulk transfer in flight adds its weight to a shared
+ * total and may use at most weight/total of the global rate, so N equal
+ * transfers get a rate each of about 1/N.  The streams of a striped
+ * transfer split one weight between them.  Transfers known to be small
+ * (SHAPE_SMALL bytes or less) are charged to the global bucket but never
+ * wait on it, so a short get or put does not queue behind bulk traffic;
+ * the bulk transfers pay the bytes back.
+ *
+ * Credit is taken a quantum at a time.  Blocking callers sleep in
+ * shape_wait(); the epoll reactors use shape_grant() and arm a timer.
+ */
+
+struct shape_region {
+    uint64_t tat;
+    unsigned int weight;
+} __attribute__((aligned(64)));
+
+static struct shape_region *region;
+static uint64_t global_rate;
+static uint64_t session_rate;
+
+__thread struct shaper *io_shaper;
+
+static uint64_t shape_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t shape_ns(size_t bytes, uint64_t rate) {
+    return (uint64_t)((double)bytes * 1e9 / rate);
+}
+
+/* Charges n bytes to a private clock; returns when they may be sent. */
+static uint64_t gcra(uint64_t *tat, size_t n, uint64_t rate, uint64_t now) {
+    uint64_t start = *tat > now ? *tat : now;
+    uint64_t burst = shape_ns(SHAPE_BURST, rate);
+    *tat = start + shape_ns(n, rate);
+    return start > now + burst ? start - burst : now;
+}
+
+static uint64_t gcra_shared(size_t n, uint64_t now) {
+    uint64_t tat = __atomic_load_n(&region->tat, __ATOMIC_RELAXED);
+    uint64_t start, burst = shape_ns(SHAPE_BURST, global_rate);
+    do {
+        start = tat > now ? tat : now;
+    } while (!__atomic_compare_exchange_n(&region->tat, &tat, start + shape_ns(n, global_rate), 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return start > now + burst ? start - burst : now;
+}
+
+/* Rates in bytes per second, 0 for none; must run before the server forks. */
+int shape_init(uint64_t global, uint64_t session) {
+    global_rate = global;
+    session_rate = session;
+    if (global_rate == 0) {
+        return 0;
+    }
+    region = mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        global_rate = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* size is what the transfer will move, or -1 when unknown. */
+void shape_begin(struct shaper *sh, off_t size, int streams) {
+    memset(sh, 0, sizeof(*sh));
+    if (global_rate == 0 && session_rate == 0) {
+        return;
+    }
+    sh->active = 1;
+    sh->rate = session_rate / (streams > 0 ? streams : 1);
+    sh->small = size >= 0 && size <= SHAPE_SMALL;
+    if (region != NULL && !sh->small) {
+        sh->weight = SHAPE_WEIGHT / streams > 0 ? SHAPE_WEIGHT / streams : 1;
+        __atomic_add_fetch(&region->weight, sh->weight, __ATOMIC_RELAXED);
+    }
+}
+
+void shape_end(struct shaper *sh) {
+    if (sh->weight > 0) {
+        __atomic_sub_fetch(&region->weight, sh->weight, __ATOMIC_RELAXED);
+    }
+    sh->active = 0;
+    sh->weight = 0;
+}
+
+/* Bytes the transfer may move now, at most want; 0 with *delay set when it must wait. */
+size_t shape_grant(struct shaper *sh, size_t want, uint64_t *delay) {
+    if (sh == NULL || !sh->active || want == 0) {
+        return want;
+    }
+
+    uint64_t now = shape_clock();
+    if (sh->credit == 0) {
+        size_t n = want < SHAPE_QUANTUM ? want : SHAPE_QUANTUM;
+        uint64_t ready = now;
+        if (sh->rate > 0) {
+            ready = gcra(&sh->tat, n, sh->rate, now);
+        }
+        if (region != NULL) {
+            uint64_t global = gcra_shared(n, now);
+            if (!sh->small) {
+                unsigned int total = __atomic_load_n(&region->weight, __ATOMIC_RELAXED);
+                uint64_t share = global_rate * sh->weight / (total > sh->weight ? total : sh->weight);
+                uint64_t fair = gcra(&sh->share_tat, n, share > 0 ? share : 1, now);
+                ready = global > ready ? global : ready;
+                ready = fair > ready ? fair : ready;
+            }
+        }
+        sh->credit = n;
+        sh->ready = ready;
+    }
+
+    if (now < sh->ready) {
+        *delay = sh->ready - now;
+        return 0;
+    }
+    return want < sh->credit ? want : sh->credit;
+}
+
+void shape_sent(struct shaper *sh, size_t n) {
+    if (sh != NULL && sh->active) {
+        sh->credit -= n < sh->credit ? n : sh->credit;
+    }
+}
+
+/* Blocking form for the current thread's transfer: sleeps, then spends what it returns. */
+size_t shape_wait(size_t want) {
+    uint64_t delay;
+    size_t n;
+    while ((n = shape_grant(io_shaper, want, &delay)) == 0 && want > 0) {
+        struct timespec pause = { delay / 1000000000ull, delay % 1000000000ull };
+        nanosleep(&pause, NULL);
+    }
+    shape_sent(io_shaper, n);
+    return n;
+}
+
+void shape_take(size_t n) {
+    while (n > 0) {
+        n -= shape_wait(n);
+    }
+}
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "myftp.h"
+
+/*
+ * Slab pools for objects the servers make and drop at high rates:
+ * sessions, directory listers, compression blocks and stripe tasks.
+ *
+ * Each class carves fixed-size objects out of large mmap()ed slabs into a
+ * shared depot.  Threads keep a small free list per class and only take
+ * the depot lock to move SLAB_BATCH objects at a time, so allocation and
+ * release are a pointer pop/push in the common case.  An object may be
+ * freed on a different thread than allocated it (a lister opened on a pool
+ * worker is closed on its reactor); it just joins the freeing thread's
+ * list.  Slabs are never unmapped; the pools stay at their high-water mark.
+ */
+
+struct slab_class {
+    const char *name;
+    size_t size;
+    size_t stride;
+    pthread_mutex_t lock;
+    void *depot;
+    size_t depot_count;
+    size_t capacity;
+    size_t slabs;
+    size_t bytes;
+    size_t in_use;
+    size_t peak;
+};
+
+struct slab_local {
+    void *free[SLAB_CLASSES];
+    int count[SLAB_CLASSES];
+};
+
+static struct slab_class classes[SLAB_CLASSES] = {
+    [SLAB_SESSION] = { "session", 0, 0, PTHREAD_MUTEX_INITIALIZER },
+    [SLAB_LISTER] = { "lister", 0, 0, PTHREAD_MUTEX_INITIALIZER },
+    [SLAB_BLOCK] = { "block", 0, 0, PTHREAD_MUTEX_INITIALIZER },
+    [SLAB_TASK] = { "task", 0, 0, PTHREAD_MUTEX_INITIALIZER },
+};
+
+static __thread struct slab_local *local;
+static pthread_key_t local_key;
+static pthread_once_t local_once = PTHREAD_ONCE_INIT;
+
+/* Moves up to count objects from a thread list to the depot; lock held. */
+static void depot_put(struct slab_class *c, struct slab_local *l, int id, int count) {
+    while (count-- > 0 && l->free[id] != NULL) {
+        void *p = l->free[id];
+        l->free[id] = *(void **)p;
+        l->count[id]--;
+        *(void **)p = c->depot;
+        c->depot = p;
+        c->depot_count++;
+    }
+}
+
+/* Returns a dying thread's free objects to their depots. */
+static void local_flush(void *arg) {
+    struct slab_local *l = arg;
+    for (int id = 0; id < SLAB_CLASSES; id++) {
+        pthread_mutex_lock(&classes[id].lock);
+        depot_put(&classes[id], l, id, l->count[id]);
+        pthread_mutex_unlock(&classes[id].lock);
+    }
+    free(l);
+}
+
+static void local_key_create(void) {
+    pthread_key_create(&local_key, local_flush);
+}
+
+static struct slab_local *local_get(void) {
+    if (local == NULL) {
+        pthread_once(&local_once, local_key_create);
+        local = calloc(1, sizeof(*local));
+        if (local != NULL) {
+            pthread_setspecific(local_key, local);
+        }
+    }
+    return local;
+}
+
+/* Carves a new slab into the depot; lock held. */
+static int slab_grow(struct slab_class *c) {
+    size_t count = SLAB_BYTES / c->stride;
+    if (count < SLAB_MIN_OBJECTS) {
+        count = SLAB_MIN_OBJECTS;
+    }
+
+    char *slab = mmap(NULL, count * c->stride, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        return -1;
+    }
+    for (size_t i = count; i-- > 0; ) {
+        void *p = slab + i * c->stride;
+        *(void **)p = c->depot;
+        c->depot = p;
+    }
+    c->depot_count += count;
+    c->capacity += count;
+    c->slabs++;
+    c->bytes += count * c->stride;
+    return 0;
+}
+
+void *slab_alloc(int id, size_t size) {
+    struct slab_class *c = &classes[id];
+    struct slab_local *l = local_get();
+
+    if (l == NULL) {
+        return NULL;
+    }
+    if (l->free[id] == NULL) {
+        pthread_mutex_lock(&c->lock);
+        if (c->size == 0) {
+            /* The first caller fixes the object size for the class. */
+            c->size = size;
+            c->stride = (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+        }
+        if (c->depot == NULL && slab_grow(c) < 0) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
+        }
+        for (int i = 0; i < SLAB_BATCH && c->depot != NULL; i++) {
+            void *p = c->depot;
+            c->depot = *(void **)p;
+            c->depot_count--;
+            *(void **)p = l->free[id];
+            l->free[id] = p;
+            l->count[id]++;
+        }
+        pthread_mutex_unlock(&c->lock);
+    }
+
+    void *p = l->free[id];
+    l->free[id] = *(void **)p;
+    l->count[id]--;
+
+    size_t in_use = __atomic_add_fetch(&c->in_use, 1, __ATOMIC_RELAXED);
+    if (in_use > __atomic_load_n(&c->peak, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&c->peak, in_use, __ATOMIC_RELAXED);
+    }
+    return p;
+}
+
+void slab_free(int id, void *p) {
+    struct slab_class *c = &classes[id];
+    struct slab_local *l = local_get();
+
+    if (p == NULL) {
+        return;
+    }
+    __atomic_sub_fetch(&c->in_use, 1, __ATOMIC_RELAXED);
+    if (l == NULL) {
+        /* No thread list to keep it on: straight back to the depot. */
+        pthread_mutex_lock(&c->lock);
+        *(void **)p = c->depot;
+        c->depot = p;
+        c->depot_count++;
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+
+    *(void **)p = l->free[id];
+    l->free[id] = p;
+    if (++l->count[id] > SLAB_LOCAL_MAX) {
+        pthread_mutex_lock(&c->lock);
+        depot_put(c, l, id, SLAB_BATCH);
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+void slab_stats(int id, struct slab_stats *stats) {
+    struct slab_class *c = &classes[id];
+
+    pthread_mutex_lock(&c->lock);
+    stats->name = c->name;
+    stats->object_size = c->size;
+    stats->in_use = __atomic_load_n(&c->in_use, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+    stats->capacity = c->capacity;
+    stats->depot = c->depot_count;
+    stats->slabs = c->slabs;
+    stats->bytes = c->bytes;
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/tcp.h>
+#include <linux/filter.h>
+
+#include "myftp.h"
+
+/*
+ * Socket policy shared by the server and the client.
+ *
+ * Control connections turn Nagle off: every command and reply is a short
+ * line, and a reply often follows another before the peer has acked it.
+ *
+ * Data connections keep the kernel's buffer autotuning until a transfer
+ * shows it is not enough.  After a large send, sock_measure() takes the
+ * bandwidth-delay product from the delivery rate and minimum RTT that
+ * TCP_INFO tracked; when twice that is beyond the tcp_wmem/tcp_rmem
+ * ceiling autotuning stops at, the buffers are pinned at that size on
+ * this and every later data connection of the session.  Sends spanning
+ * several chunks are corked so no chunk ends on a short segment.
+ *
+ * The control listener's backlog defaults to net.core.somaxconn.  With
+ * -r the server binds one SO_REUSEPORT listener per reactor thread or
+ * accept process, and the kernel deals each connection to one of them:
+ * by its 4-tuple hash, or with sock_steer_cpu() to the shard running on
+ * the CPU that took the SYN, so a connection is accepted on the core that
+ * handles its packets.  That needs one shard per online CPU.
+ */
+
+static int listen_backlog = SOMAXCONN;
+static long sndbuf_ceiling, rcvbuf_ceiling;
+static long sndbuf_max, rcvbuf_max;
+
+/* Reads the field'th number of a sysctl file, or -1. */
+static long read_sysctl(const char *path, int field) {
+    FILE *f = fopen(path, "r");
+    long value = -1;
+
+    if (f == NULL) {
+        return -1;
+    }
+    for (int i = 0; i <= field; i++) {
+        if (fscanf(f, "%ld", &value) != 1) {
+            value = -1;
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+void sock_init(int backlog) {
+    if (backlog <= 0) {
+        backlog = read_sysctl("/proc/sys/net/core/somaxconn", 0);
+    }
+    listen_backlog = backlog > 0 ? backlog : SOMAXCONN;
+
+    sndbuf_ceiling = read_sysctl("/proc/sys/net/ipv4/tcp_wmem", 2);
+    rcvbuf_ceiling = read_sysctl("/proc/sys/net/ipv4/tcp_rmem", 2);
+    sndbuf_max = 2 * read_sysctl("/proc/sys/net/core/wmem_max", 0);
+    rcvbuf_max = 2 * read_sysctl("/proc/sys/net/core/rmem_max", 0);
+}
+
+int sock_listen(int fd) {
+    return listen(fd, listen_backlog);
+}
+
+/* Steers the reuseport group of fd by receiving CPU; shard i must be the i'th listener bound. */
+int sock_steer_cpu(int fd, int shards) {
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, shards),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+void sock_control(int fd) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/* Leaves errno alone: it is called on the way out of failed sends. */
+void sock_cork(int fd, int on) {
+    int error = errno;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    errno = error;
+}
+
+/* Pins one buffer at bytes, but only where that beats what autotuning would reach. */
+static void pin_buffer(int fd, int option, long bytes, long ceiling, long max) {
+    if (bytes > max) {
+        bytes = max;
+    }
+    if (ceiling < 0 || bytes <= ceiling) {
+        return;
+    }
+    /* The kernel doubles the value for its bookkeeping overhead. */
+    int half = bytes / 2;
+    setsockopt(fd, SOL_SOCKET, option, &half, sizeof(half));
+}
+
+void sock_data(int fd, int bytes) {
+    if (bytes > 0) {
+        pin_buffer(fd, SO_SNDBUF, bytes, sndbuf_ceiling, sndbuf_max);
+        pin_buffer(fd, SO_RCVBUF, bytes, rcvbuf_ceiling, rcvbuf_max);
+    }
+}
+
+int sock_measure(int fd, int current) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 ||
+        len < offsetof(struct tcp_info, tcpi_delivery_rate) + sizeof(info.tcpi_delivery_rate) ||
+        info.tcpi_delivery_rate == 0 || info.tcpi_min_rtt == 0) {
+        return current;
+    }
+
+    /* Twice the BDP leaves room for the window to grow past loss. */
+    uint64_t bytes = 2 * info.tcpi_delivery_rate * info.tcpi_min_rtt / 1000000;
+    if (bytes > SOCK_BUFFER_MAX) {
+        bytes = SOCK_BUFFER_MAX;
+    }
+    /* An application-limited sample only bounds the rate from below. */
+    if (info.tcpi_delivery_rate_app_limited && (int)bytes < current) {
+        return current;
+    }
+    if ((int)bytes > current) {
+        sock_data(fd, bytes);
+    }
+    return bytes;
+}
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "myftp.h"
+
+/*
+ * Server statistics.
+ *
+ * Counters live in shards in shared anonymous memory, created before the
+ * server forks or starts threads.  Each thread (or forked session) takes a
+ * shard of its own on first use, so updates are uncontended relaxed atomic
+ * adds on cache lines nobody else writes; shards are only summed when the
+ * S command or the Prometheus endpoint asks.  With more threads than
+ * shards two writers may share one, which the atomics keep exact.
+ *
+ * Latencies and per-transfer syscall counts go into log2 histograms:
+ * bucket i holds values below 2^i (microseconds, or syscalls), the last
+ * bucket everything larger.
+ */
+
+#define STATS_NCOMMANDS ((int)sizeof(STATS_COMMANDS))
+
+struct stats_shard {
+    unsigned long long commands[STATS_NCOMMANDS];
+    unsigned long long latency_us[STATS_NCOMMANDS];
+    unsigned long long latency[STATS_NCOMMANDS][STATS_BUCKETS];
+    unsigned long long bytes_in;
+    unsigned long long bytes_out;
+    unsigned long long syscalls;
+    unsigned long long transfers;
+    unsigned long long transfer_syscalls[STATS_BUCKETS];
+    long long sessions;
+    unsigned long long sessions_total;
+} __attribute__((aligned(64)));
+
+struct stats_region {
+    unsigned int next_shard;
+    unsigned int accept_queue;
+    unsigned int accept_queue_peak;
+    unsigned int accept_backlog;
+    struct stats_shard shards[STATS_SHARDS];
+};
+
+static struct stats_region *region;
+static int exporter_fd = -1;
+static int exporter_local;
+static __thread struct stats_shard *shard;
+
+int stats_init(void) {
+    region = mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        region = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Takes a fresh shard in a forked session or accept process. */
+void stats_attach(void) {
+    shard = NULL;
+}
+
+static struct stats_shard *stats_shard(void) {
+    if (shard == NULL && region != NULL) {
+        unsigned int i = __atomic_fetch_add(&region->next_shard, 1, __ATOMIC_RELAXED);
+        shard = &region->shards[i % STATS_SHARDS];
+    }
+    return shard;
+}
+
+static void add(unsigned long long *counter, unsigned long long n) {
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static int bucket(unsigned long long value) {
+    int i = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    return i < STATS_BUCKETS ? i : STATS_BUCKETS - 1;
+}
+
+uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_command(char cmd, uint64_t start, const struct io_counters *before, const struct io_counters *after) {
+    struct stats_shard *sh = stats_shard();
+    if (sh == NULL) {
+        return;
+    }
+
+    const char *p = cmd != '\0' ? strchr(STATS_COMMANDS, cmd) : NULL;
+    int c = p != NULL ? p - STATS_COMMANDS : STATS_NCOMMANDS - 1;
+    unsigned long long us = (stats_clock() - start) / 1000;
+    add(&sh->commands[c], 1);
+    add(&sh->latency_us[c], us);
+    add(&sh->latency[c][bucket(us)], 1);
+
+    unsigned long syscalls = after->syscalls - before->syscalls;
+    add(&sh->bytes_in, after->bytes_in - before->bytes_in);
+    add(&sh->bytes_out, after->bytes_out - before->bytes_out);
+    add(&sh->syscalls, syscalls);
+    if (cmd != '\0' && strchr("GPLMNS", cmd) != NULL) {
+        add(&sh->transfers, 1);
+        add(&sh->transfer_syscalls[bucket(syscalls)], 1);
+    }
+}
+
+/* Data moved outside any command's accounting, such as a striped worker's. */
+void stats_io(const struct io_counters *io) {
+    struct stats_shard *sh = stats_shard();
+    if (sh != NULL) {
+        add(&sh->bytes_in, io->bytes_in);
+        add(&sh->bytes_out, io->bytes_out);
+        add(&sh->syscalls, io->syscalls);
+    }
+}
+
+/* Async-signal-safe, so the fork-mode SIGCHLD handler can count exits. */
+void stats_sessions(int delta) {
+    struct stats_shard *sh = stats_shard();
+    if (sh == NULL) {
+        return;
+    }
+    __atomic_add_fetch(&sh->sessions, delta, __ATOMIC_RELAXED);
+    if (delta > 0) {
+        add(&sh->sessions_total, delta);
+    }
+}
+
+/* Samples a listener's accept queue: TCP_INFO reports it as unacked/sacked. */
+void stats_accept_queue(int listen_fd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+
+    if (region == NULL || getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return;
+    }
+    __atomic_store_n(&region->accept_queue, info.tcpi_unacked, __ATOMIC_RELAXED);
+    __atomic_store_n(&region->accept_backlog, info.tcpi_sacked, __ATOMIC_RELAXED);
+    if (info.tcpi_unacked > __atomic_load_n(&region->accept_queue_peak, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&region->accept_queue_peak, info.tcpi_unacked, __ATOMIC_RELAXED);
+    }
+}
+
+struct text {
+    char *out;
+    size_t size;
+    size_t len;
+};
+
+static void emit(struct text *t, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(t->out + t->len, t->size - t->len, format, ap);
+    va_end(ap);
+    if (n > 0) {
+        t->len = t->len + n < t->size ? t->len + n : t->size - 1;
+    }
+}
+
+static void emit_counter(struct text *t, const char *name, const char *help, const char *type,
+                         unsigned long long value) {
+    emit(t, "# HELP myftp_%s %s\n# TYPE myftp_%s %s\nmyftp_%s %llu\n", name, help, name, type, name, value);
+}
+
+static void sum_shards(struct stats_shard *total) {
+    unsigned long long *sum = (unsigned long long *)total;
+    size_t words = sizeof(*total) / sizeof(*sum);
+
+    memset(total, 0, sizeof(*total));
+    for (int i = 0; i < STATS_SHARDS; i++) {
+        unsigned long long *word = (unsigned long long *)&region->shards[i];
+        for (size_t w = 0; w < words; w++) {
+            sum[w] += __atomic_load_n(&word[w], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Renders Prometheus text exposition.  local adds what only this process
+ * can see (its listing cache and slab pools), which in fork mode belongs to
+ * one session rather than the server.
+ */
+size_t stats_format(char *out, size_t size, int local) {
+    struct text t = { out, size, 0 };
+    struct stats_shard total;
+
+    out[0] = '\0';
+    if (region == NULL) {
+        return 0;
+    }
+    sum_shards(&total);
+
+    emit(&t, "# HELP myftp_command_latency_seconds Time from a command to its last reply or byte.\n"
+             "# TYPE myftp_command_latency_seconds histogram\n");
+    for (int c = 0; c < STATS_NCOMMANDS; c++) {
+        char name[8];
+        unsigned long long cumulative = 0;
+        if (total.commands[c] == 0) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%c", c < STATS_NCOMMANDS - 1 ? STATS_COMMANDS[c] : '?');
+        for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+            cumulative += total.latency[c][b];
+            emit(&t, "myftp_command_latency_seconds_bucket{command=\"%s\",le=\"%g\"} %llu\n",
+                 name, (double)(1ull << b) / 1e6, cumulative);
+        }
+        emit(&t, "myftp_command_latency_seconds_bucket{command=\"%s\",le=\"+Inf\"} %llu\n", name, total.commands[c]);
+        emit(&t, "myftp_command_latency_seconds_sum{command=\"%s\"} %.6f\n", name, total.latency_us[c] / 1e6);
+        emit(&t, "myftp_command_latency_seconds_count{command=\"%s\"} %llu\n", name, total.commands[c]);
+    }
+
+    emit(&t, "# HELP myftp_transfer_syscalls Data-path syscalls per get, put or listing.\n"
+             "# TYPE myftp_transfer_syscalls histogram\n");
+    unsigned long long cumulative = 0;
+    for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+        cumulative += total.transfer_syscalls[b];
+        emit(&t, "myftp_transfer_syscalls_bucket{le=\"%llu\"} %llu\n", (1ull << b) - 1, cumulative);
+    }
+    emit(&t, "myftp_transfer_syscalls_bucket{le=\"+Inf\"} %llu\n", total.transfers);
+    emit(&t, "myftp_transfer_syscalls_sum %llu\nmyftp_transfer_syscalls_count %llu\n", total.syscalls, total.transfers);
+
+    emit_counter(&t, "bytes_in_total", "Bytes received on data connections.", "counter", total.bytes_in);
+    emit_counter(&t, "bytes_out_total", "Bytes sent on data connections.", "counter", total.bytes_out);
+    emit_counter(&t, "sessions_total", "Control connections accepted.", "counter", total.sessions_total);
+    emit_counter(&t, "sessions_active", "Control connections open now.", "gauge",
+                 total.sessions > 0 ? (unsigned long long)total.sessions : 0);
+    emit_counter(&t, "accept_queue_depth", "Connections waiting in the listen backlog at the last accept.",
+                 "gauge", __atomic_load_n(&region->accept_queue, __ATOMIC_RELAXED));
+    emit_counter(&t, "accept_queue_peak", "Deepest listen backlog seen.", "gauge",
+                 __atomic_load_n(&region->accept_queue_peak, __ATOMIC_RELAXED));
+    emit_counter(&t, "accept_queue_limit", "Listen backlog size.", "gauge",
+                 __atomic_load_n(&region->accept_backlog, __ATOMIC_RELAXED));
+
+    struct hotcache_stats hot;
+    hotcache_stats(&hot);
+    emit_counter(&t, "hotcache_hits_total", "Gets served from the hot-file cache.", "counter", hot.hits);
+    emit_counter(&t, "hotcache_misses_total", "Gets the hot-file cache could not serve.", "counter", hot.misses);
+    emit_counter(&t, "hotcache_evictions_total", "Files evicted from the hot-file cache.", "counter", hot.evictions);
+    emit_counter(&t, "hotcache_bytes", "Bytes held in the hot-file cache.", "gauge", hot.bytes);
+    emit_counter(&t, "hotcache_files", "Files held in the hot-file cache.", "gauge", hot.files);
+
+    if (local) {
+        struct list_cache_stats list;
+        list_cache_stats(&list);
+        emit_counter(&t, "list_cache_hits_total", "Listings replayed from the listing cache.", "counter", list.hits);
+        emit_counter(&t, "list_cache_misses_total", "Listings read from disk.", "counter", list.misses);
+        emit_counter(&t, "list_cache_invalidations_total", "Cached listings dropped on change.", "counter",
+                     list.invalidations);
+        emit_counter(&t, "list_cache_bytes", "Bytes held in the listing cache.", "gauge", list.bytes);
+
+        emit(&t, "# HELP myftp_slab_objects Slab pool objects, by class and state.\n"
+                 "# TYPE myftp_slab_objects gauge\n");
+        for (int i = 0; i < SLAB_CLASSES; i++) {
+            struct slab_stats slab;
+            slab_stats(i, &slab);
+            emit(&t, "myftp_slab_objects{class=\"%s\",state=\"in_use\"} %zu\n", slab.name, slab.in_use);
+            emit(&t, "myftp_slab_objects{class=\"%s\",state=\"peak\"} %zu\n", slab.name, slab.peak);
+            emit(&t, "myftp_slab_objects{class=\"%s\",state=\"capacity\"} %zu\n", slab.name, slab.capacity);
+            emit(&t, "myftp_slab_bytes{class=\"%s\"} %zu\n", slab.name, slab.bytes);
+        }
+    }
+    return t.len;
+}
+
+struct dir_lister *stats_listing(void) {
+    char *text = malloc(STATS_TEXT_SIZE);
+    if (text == NULL) {
+        return NULL;
+    }
+    size_t len = stats_format(text, STATS_TEXT_SIZE, 1);
+    struct dir_lister *l = dir_lister_text(text, len);
+    free(text);
+    return l;
+}
+
+/* One scrape per connection, answered with HTTP/1.0 and closed. */
+static void *stats_exporter(void *arg) {
+    static char body[STATS_TEXT_SIZE];
+    char request[1024];
+    char header[128];
+
+    while (1) {
+        int fd = accept4(exporter_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        if (read(fd, request, sizeof(request)) > 0) {
+            size_t len = stats_format(body, sizeof(body), exporter_local);
+            int n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                             "Content-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+            if (write_all(fd, header, n) == 0) {
+                write_all(fd, body, len);
+            }
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * Serves the statistics for Prometheus on 127.0.0.1:port from a thread of
+ * its own.  In fork mode that thread must not touch process-local state
+ * (its locks would be inherited mid-use by the next fork), so local is off.
+ */
+int stats_serve(int port, int local) {
+    struct sockaddr_in addr;
+    pthread_t thread;
+    int opt = 1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    exporter_fd = fd;
+    exporter_local = local;
+    if (pthread_create(&thread, NULL, stats_exporter, NULL) != 0) {
+        close(fd);
+        exporter_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
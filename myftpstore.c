@@ -0,0 +1,628 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "myftp.h"
+
+/*
+ * Deduplicating upload store (server -D, client -c, the X command).
+ *
+ * The client cuts a file into content-defined chunks (FastCDC: a gear
+ * hash over the bytes picks the cut points, so an insertion only changes
+ * the chunks around it), names each by its SHA-256 and sends the list.
+ * The server answers with the chunks it has not stored yet and receives
+ * only those.  The server never chunks anything itself, so it relies on
+ * nothing but the names the client sends and the bytes behind them.
+ *
+ * The store is a directory on the same file system as the served files:
+ *   objects/<sha256 of the chunk list>  each file stored, hard linked to
+ *                                       every path it was put to
+ *   chunks/<xx>/<sha256 of a chunk>     symlink "<object> <offset>" saying
+ *                                       where the chunk's bytes are
+ * A file stored before costs one link(), however often it is put; other
+ * files are assembled from the chunks already there with copy_file_range()
+ * plus the ones received.  The file system is the index, so forked
+ * sessions and threads share it without locks: entries are made with
+ * symlinkat() and linkat(), which fail rather than replace an entry made
+ * by another session first.
+ *
+ * Stored data is never trusted blindly: a reused chunk is read back and
+ * its SHA-256 checked before the server says it has it, a stored file
+ * must match the client's CRC32C before it is linked, and every upload is
+ * checked against that CRC32C before it is renamed into place.  While the
+ * store is enabled, a put that would write into a file with other links
+ * first gives it an inode of its own (store_unshare()), so the objects do
+ * not change underneath the index.  Objects no file links to any more are
+ * deleted when the server starts; chunk entries left pointing at them are
+ * dropped when next met.
+ */
+
+#define GEAR_MASK_SMALL (((1ull << 18) - 1) << 46)
+#define GEAR_MASK_LARGE (((1ull << 14) - 1) << 50)
+#define STORE_ENTRY_SIZE (SHA256_SIZE + 4)
+#define STORE_NAME_SIZE (2 * SHA256_SIZE + 1)
+
+int store_fd = -1;
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+struct chunk {
+    unsigned char hash[SHA256_SIZE];
+    uint32_t len;
+    off_t offset;
+};
+
+/* One chunk of an upload and where the server gets its bytes from. */
+struct store_entry {
+    const unsigned char *hash;
+    uint32_t len;
+    off_t offset;
+    int source;
+    long first;
+    char object[STORE_NAME_SIZE];
+    off_t object_offset;
+};
+
+enum { SOURCE_CLIENT, SOURCE_UPLOAD, SOURCE_STORE };
+
+/* The stored file a run of chunks is read from, kept open between them. */
+struct object_cache {
+    char name[STORE_NAME_SIZE];
+    int fd;
+};
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void hex_name(const unsigned char *hash, char *out) {
+    for (int i = 0; i < SHA256_SIZE; i++) {
+        snprintf(out + 2 * i, 3, "%02x", hash[i]);
+    }
+}
+
+/* Fixed, so that every client cuts the same file the same way. */
+static void gear_setup(void) {
+    uint64_t x = 0x6d7966747073746full;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+/*
+ * Length of the chunk starting at p, n bytes being available.  Cut points
+ * are harder to hit before CHUNK_AVG and easier after it, which keeps
+ * chunk sizes close to the average (FastCDC's normalized chunking).
+ */
+static size_t chunk_cut(const unsigned char *p, size_t n) {
+    size_t normal = n < CHUNK_AVG ? n : CHUNK_AVG;
+    size_t max = n < CHUNK_MAX ? n : CHUNK_MAX;
+    uint64_t h = 0;
+    size_t i = CHUNK_MIN;
+
+    if (n <= CHUNK_MIN) {
+        return n;
+    }
+    for (; i < normal; i++) {
+        h = (h << 1) + gear[p[i]];
+        if ((h & GEAR_MASK_SMALL) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < max; i++) {
+        h = (h << 1) + gear[p[i]];
+        if ((h & GEAR_MASK_LARGE) == 0) {
+            return i + 1;
+        }
+    }
+    return max;
+}
+
+static int chunk_file(int fd, struct chunk **out, uint32_t *count, off_t *size, uint32_t *crc) {
+    unsigned char *buf = malloc(CHUNK_SCAN_SIZE);
+    struct chunk *chunks = NULL;
+    uint32_t n = 0, cap = 0;
+    size_t len = 0, pos = 0;
+    off_t offset = 0;
+    int eof = 0;
+
+    pthread_once(&gear_once, gear_setup);
+    *crc = 0;
+    if (buf == NULL) {
+        return -1;
+    }
+    while (!eof || pos < len) {
+        if (!eof && len - pos < CHUNK_MAX) {
+            memmove(buf, buf + pos, len - pos);
+            len -= pos;
+            pos = 0;
+            ssize_t got = pread(fd, buf + len, CHUNK_SCAN_SIZE - len, offset + len);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got < 0) {
+                free(buf);
+                free(chunks);
+                return -1;
+            }
+            *crc = crc32c(*crc, buf + len, got);
+            eof = got == 0;
+            len += got;
+            continue;
+        }
+
+        if (n == cap) {
+            cap = cap > 0 ? cap * 2 : 1024;
+            struct chunk *grown = n < STORE_MAX_CHUNKS ? realloc(chunks, cap * sizeof(*chunks)) : NULL;
+            if (grown == NULL) {
+                free(buf);
+                free(chunks);
+                errno = n < STORE_MAX_CHUNKS ? ENOMEM : EFBIG;
+                return -1;
+            }
+            chunks = grown;
+        }
+        size_t cut = chunk_cut(buf + pos, len - pos);
+        sha256(buf + pos, cut, chunks[n].hash);
+        chunks[n].len = cut;
+        chunks[n].offset = offset;
+        n++;
+        pos += cut;
+        offset += cut;
+    }
+
+    free(buf);
+    *out = chunks;
+    *count = n;
+    *size = offset;
+    return 0;
+}
+
+/*
+ * Client side of X: sends the chunk list of file_fd, then the chunks the
+ * server asks for.  Wire format, raw on D or framed on K:
+ *   client  be64 size, be32 crc32c, be32 count, count x (sha256, be32 length)
+ *   server  be32 count, count x be32 index of a chunk it lacks, ascending
+ *   client  the bytes of those chunks, in order
+ */
+int store_send(int sock_fd, int framed, int file_fd, struct delta_stats *stats) {
+    struct chunk *chunks;
+    uint32_t count, crc;
+    off_t size;
+    unsigned char header[16], entry[STORE_ENTRY_SIZE];
+    unsigned char *buffer = NULL;
+    struct data_stream *s;
+    int status = -1;
+
+    if (chunk_file(file_fd, &chunks, &count, &size, &crc) < 0) {
+        return -1;
+    }
+    s = data_stream_open(sock_fd, framed);
+    if (s == NULL) {
+        free(chunks);
+        return -1;
+    }
+
+    put_be32(header, (uint64_t)size >> 32);
+    put_be32(header + 4, size);
+    put_be32(header + 8, crc);
+    put_be32(header + 12, count);
+    if (data_stream_write(s, header, sizeof(header)) < 0) {
+        goto done;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(entry, chunks[i].hash, SHA256_SIZE);
+        put_be32(entry + SHA256_SIZE, chunks[i].len);
+        if (data_stream_write(s, entry, sizeof(entry)) < 0) {
+            goto done;
+        }
+    }
+
+    uint32_t missing;
+    unsigned char word[4];
+    if (data_stream_finish(s) < 0 || data_stream_read(s, word, 4) < 0) {
+        goto done;
+    }
+    missing = get_be32(word);
+    uint32_t *wanted = missing <= count ? malloc((missing + 1) * sizeof(*wanted)) : NULL;
+    if (wanted == NULL) {
+        errno = missing <= count ? ENOMEM : EPROTO;
+        goto done;
+    }
+    for (uint32_t i = 0; i < missing; i++) {
+        if (data_stream_read(s, word, 4) < 0) {
+            free(wanted);
+            goto done;
+        }
+        wanted[i] = get_be32(word);
+        if (wanted[i] >= count || (i > 0 && wanted[i] <= wanted[i - 1])) {
+            free(wanted);
+            errno = EPROTO;
+            goto done;
+        }
+    }
+    if (data_stream_end(s) < 0 || (buffer = malloc(CHUNK_MAX)) == NULL) {
+        free(wanted);
+        goto done;
+    }
+
+    off_t sent = 0;
+    uint32_t i;
+    for (i = 0; i < missing; i++) {
+        struct chunk *c = &chunks[wanted[i]];
+        ssize_t got = pread(file_fd, buffer, c->len, c->offset);
+        if (got != (ssize_t)c->len) {
+            errno = got < 0 ? errno : EIO;
+            break;
+        }
+        if (data_stream_write(s, buffer, c->len) < 0) {
+            break;
+        }
+        sent += c->len;
+    }
+    if (i == missing) {
+        status = data_stream_finish(s);
+    }
+    if (stats != NULL) {
+        stats->literal += sent;
+        stats->matched += size - sent;
+    }
+    free(wanted);
+
+done:
+    free(buffer);
+    free(chunks);
+    data_stream_close(s);
+    return status;
+}
+
+static int object_open(struct object_cache *cache, const char *name) {
+    char path[STORE_NAME_SIZE + 16];
+    if (cache->fd >= 0 && strcmp(cache->name, name) == 0) {
+        return cache->fd;
+    }
+    if (cache->fd >= 0) {
+        close(cache->fd);
+    }
+    snprintf(path, sizeof(path), "objects/%s", name);
+    snprintf(cache->name, sizeof(cache->name), "%s", name);
+    cache->fd = openat(store_fd, path, O_RDONLY | O_CLOEXEC);
+    return cache->fd;
+}
+
+/* Finds a chunk in the store and checks its bytes; stale entries are removed. */
+static int store_lookup(struct store_entry *e, struct object_cache *cache, unsigned char *buffer) {
+    char hex[STORE_NAME_SIZE], path[STORE_NAME_SIZE + 16], target[STORE_NAME_SIZE + 32];
+    unsigned char hash[SHA256_SIZE];
+    long long offset;
+
+    hex_name(e->hash, hex);
+    snprintf(path, sizeof(path), "chunks/%.2s/%s", hex, hex);
+    ssize_t n = readlinkat(store_fd, path, target, sizeof(target) - 1);
+    if (n < 0) {
+        return 0;
+    }
+    target[n] = '\0';
+    if (sscanf(target, "%64s %lld", e->object, &offset) == 2 && strlen(e->object) == 2 * SHA256_SIZE) {
+        int fd = object_open(cache, e->object);
+        if (fd >= 0 && pread(fd, buffer, e->len, offset) == (ssize_t)e->len) {
+            sha256(buffer, e->len, hash);
+            if (memcmp(hash, e->hash, SHA256_SIZE) == 0) {
+                e->object_offset = offset;
+                return 1;
+            }
+        }
+    }
+    unlinkat(store_fd, path, 0);
+    return 0;
+}
+
+/* Records where each chunk of a newly stored object is; an entry already there wins. */
+static void store_index(struct store_entry *entries, uint32_t count, const char *object) {
+    char hex[STORE_NAME_SIZE], path[STORE_NAME_SIZE + 16], target[STORE_NAME_SIZE + 32];
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (entries[i].source == SOURCE_STORE) {
+            continue;
+        }
+        hex_name(entries[i].hash, hex);
+        snprintf(path, sizeof(path), "chunks/%.2s/%s", hex, hex);
+        snprintf(target, sizeof(target), "%s %lld", object, (long long)entries[i].offset);
+        if (symlinkat(target, store_fd, path) < 0 && errno == ENOENT) {
+            snprintf(path, sizeof(path), "chunks/%.2s", hex);
+            mkdirat(store_fd, path, 0755);
+            snprintf(path, sizeof(path), "chunks/%.2s/%s", hex, hex);
+            symlinkat(target, store_fd, path);
+        }
+    }
+}
+
+/* Replaces the upload's temporary file with a link to the stored object. */
+static int store_link(const char *object, int dir_fd, const char *temp) {
+    char path[STORE_NAME_SIZE + 16], link_temp[BUFFER_SIZE];
+    snprintf(path, sizeof(path), "objects/%s", object);
+    if ((size_t)snprintf(link_temp, sizeof(link_temp), "%s.o", temp) >= sizeof(link_temp) ||
+        linkat(store_fd, path, dir_fd, link_temp, 0) < 0) {
+        return -1;
+    }
+    if (renameat(dir_fd, link_temp, dir_fd, temp) < 0) {
+        unlinkat(dir_fd, link_temp, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static int store_assemble(struct data_stream *s, struct store_entry *entries, uint32_t count, int temp_fd,
+                          unsigned char *buffer) {
+    struct object_cache cache = { "", -1 };
+    unsigned char hash[SHA256_SIZE];
+    int status = 0;
+
+    for (uint32_t i = 0; i < count && status == 0; i++) {
+        struct store_entry *e = &entries[i];
+        if (e->source == SOURCE_UPLOAD) {
+            status = copy_file_data(temp_fd, entries[e->first].offset, temp_fd, e->len);
+        } else if (e->source == SOURCE_STORE) {
+            int fd = object_open(&cache, e->object);
+            status = fd < 0 ? -1 : copy_file_data(fd, e->object_offset, temp_fd, e->len);
+        } else if (data_stream_read(s, buffer, e->len) < 0) {
+            status = -1;
+        } else {
+            sha256(buffer, e->len, hash);
+            if (memcmp(hash, e->hash, SHA256_SIZE) != 0) {
+                errno = EPROTO;
+                status = -1;
+            } else {
+                status = write_all(temp_fd, (char *)buffer, e->len);
+            }
+        }
+    }
+    if (cache.fd >= 0) {
+        close(cache.fd);
+    }
+    return status;
+}
+
+/*
+ * Server side of X: reads the chunk list, asks for the chunks the store
+ * lacks and builds the file in temp_fd (made by delta_temp_file()).  The
+ * result is stored and renamed over pathname; on any error the temporary
+ * file is removed and pathname left as it was.
+ */
+int store_receive(int sock_fd, int framed, int dir_fd, const char *pathname, int temp_fd, const char *temp) {
+    struct data_stream *s = data_stream_open(sock_fd, framed);
+    unsigned char header[16], word[4], hash[SHA256_SIZE];
+    unsigned char *list = NULL, *buffer = malloc(CHUNK_MAX);
+    struct store_entry *entries = NULL;
+    long *seen = NULL;
+    char object[STORE_NAME_SIZE], path[STORE_NAME_SIZE + 16];
+    uint32_t count = 0, crc, mask = 1, missing = 0;
+    off_t size, total = 0;
+    int status = -1, stored = 0;
+
+    if (s == NULL || buffer == NULL || data_stream_read(s, header, sizeof(header)) < 0) {
+        goto done;
+    }
+    size = (off_t)get_be32(header) << 32 | get_be32(header + 4);
+    crc = get_be32(header + 8);
+    count = get_be32(header + 12);
+    if (count > STORE_MAX_CHUNKS) {
+        errno = EPROTO;
+        goto done;
+    }
+
+    /* count is only the client's word: grow the list as it arrives, and size the rest from it after. */
+    uint32_t have = 0, cap = 0;
+    do {
+        cap = cap > 0 ? cap * 2 : 1024;
+        cap = cap < count ? cap : count;
+        unsigned char *grown = realloc(list, (size_t)cap * STORE_ENTRY_SIZE + 1);
+        if (grown == NULL) {
+            errno = ENOMEM;
+            goto done;
+        }
+        list = grown;
+        if (data_stream_read(s, list + (size_t)have * STORE_ENTRY_SIZE, (size_t)(cap - have) * STORE_ENTRY_SIZE) < 0) {
+            goto done;
+        }
+        have = cap;
+    } while (have < count);
+    if (data_stream_end(s) < 0) {
+        goto done;
+    }
+    while (mask < count * 2) {
+        mask <<= 1;
+    }
+    entries = malloc((count + 1) * sizeof(*entries));
+    seen = malloc(mask * sizeof(*seen));
+    if (entries == NULL || seen == NULL) {
+        errno = ENOMEM;
+        goto done;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        entries[i].hash = list + (size_t)i * STORE_ENTRY_SIZE;
+        entries[i].len = get_be32(entries[i].hash + SHA256_SIZE);
+        entries[i].offset = total;
+        total += entries[i].len;
+        if (entries[i].len == 0 || entries[i].len > CHUNK_MAX) {
+            errno = EPROTO;
+            goto done;
+        }
+    }
+    if (total != size) {
+        errno = EPROTO;
+        goto done;
+    }
+    sha256(list, (size_t)count * STORE_ENTRY_SIZE, hash);
+    hex_name(hash, object);
+    snprintf(path, sizeof(path), "objects/%s", object);
+
+    /* Stored before: nothing to send, just link it. */
+    struct stat st;
+    uint32_t object_crc;
+    int object_fd = openat(store_fd, path, O_RDONLY | O_CLOEXEC);
+    if (object_fd >= 0) {
+        stored = fstat(object_fd, &st) == 0 && st.st_size == size &&
+                 crc32c_file(object_fd, &object_crc) == 0 && object_crc == crc;
+        if (stored && store_link(object, dir_fd, temp) < 0 && copy_file_data(object_fd, 0, temp_fd, size) < 0) {
+            close(object_fd);
+            goto done;
+        }
+        if (!stored) {
+            unlinkat(store_fd, path, 0);
+        }
+        close(object_fd);
+    }
+
+    struct object_cache cache = { "", -1 };
+    memset(seen, -1, mask * sizeof(*seen));
+    for (uint32_t i = 0; i < count && !stored; i++) {
+        struct store_entry *e = &entries[i];
+        uint32_t slot = get_be32(e->hash) & (mask - 1);
+        while (seen[slot] >= 0 && memcmp(entries[seen[slot]].hash, e->hash, SHA256_SIZE) != 0) {
+            slot = (slot + 1) & (mask - 1);
+        }
+        if (seen[slot] >= 0) {
+            e->source = SOURCE_UPLOAD;
+            e->first = seen[slot];
+            continue;
+        }
+        seen[slot] = i;
+        e->source = store_lookup(e, &cache, buffer) ? SOURCE_STORE : SOURCE_CLIENT;
+        missing += e->source == SOURCE_CLIENT;
+    }
+    if (cache.fd >= 0) {
+        close(cache.fd);
+    }
+
+    put_be32(word, missing);
+    if (data_stream_write(s, word, 4) < 0) {
+        goto done;
+    }
+    for (uint32_t i = 0; i < count && missing > 0; i++) {
+        put_be32(word, i);
+        if (entries[i].source == SOURCE_CLIENT && data_stream_write(s, word, 4) < 0) {
+            goto done;
+        }
+    }
+    if (data_stream_finish(s) < 0) {
+        goto done;
+    }
+
+    if ((!stored && store_assemble(s, entries, count, temp_fd, buffer) < 0) || data_stream_end(s) < 0) {
+        goto done;
+    }
+    if (!stored) {
+        if (crc32c_file(temp_fd, &object_crc) < 0 || object_crc != crc) {
+            errno = EIO;
+            goto done;
+        }
+        /* A file stored by another session meanwhile keeps its index. */
+        if (linkat(dir_fd, temp, store_fd, path, 0) == 0) {
+            store_index(entries, count, object);
+        }
+    }
+    status = renameat(dir_fd, temp, dir_fd, pathname);
+    /* Putting a stored file over a link to it renames nothing. */
+    if (status == 0) {
+        unlinkat(dir_fd, temp, 0);
+    }
+
+done:
+    if (status < 0) {
+        int error = errno;
+        unlinkat(dir_fd, temp, 0);
+        errno = error;
+    }
+    free(seen);
+    free(entries);
+    free(list);
+    free(buffer);
+    if (s != NULL) {
+        data_stream_close(s);
+    }
+    return status;
+}
+
+/* Gives pathname an inode of its own if it shares one, keeping its first keep bytes. */
+int store_unshare(int dir_fd, const char *pathname, off_t keep) {
+    struct stat st;
+    char temp[BUFFER_SIZE];
+
+    if (store_fd < 0 || fstatat(dir_fd, pathname, &st, 0) < 0 || !S_ISREG(st.st_mode) || st.st_nlink < 2) {
+        return 0;
+    }
+    if (keep == 0) {
+        return unlinkat(dir_fd, pathname, 0);
+    }
+
+    int in_fd = openat(dir_fd, pathname, O_RDONLY | O_CLOEXEC);
+    int out_fd = in_fd < 0 ? -1 : delta_temp_file(dir_fd, pathname, temp, sizeof(temp));
+    int status = -1;
+    if (out_fd >= 0) {
+        status = copy_file_data(in_fd, 0, out_fd, keep < st.st_size ? keep : st.st_size);
+        if (status == 0) {
+            fchmod(out_fd, st.st_mode & 07777);
+            status = renameat(dir_fd, temp, dir_fd, pathname);
+        }
+        if (status < 0) {
+            unlinkat(dir_fd, temp, 0);
+        }
+        close(out_fd);
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    return status;
+}
+
+/* Opens (creating if need be) the store at path and deletes objects no file links to. */
+int store_init(const char *path) {
+    mkdir(path, 0755);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    mkdirat(fd, "objects", 0755);
+    mkdirat(fd, "chunks", 0755);
+
+    int objects_fd = openat(fd, "objects", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = objects_fd < 0 ? NULL : fdopendir(objects_fd);
+    if (dir == NULL) {
+        if (objects_fd >= 0) {
+            close(objects_fd);
+        }
+        close(fd);
+        return -1;
+    }
+    struct dirent *d;
+    struct stat st;
+    while ((d = readdir(dir)) != NULL) {
+        if (fstatat(objects_fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) &&
+            st.st_nlink == 1) {
+            unlinkat(objects_fd, d->d_name, 0);
+        }
+    }
+    closedir(dir);
+
+    store_fd = fd;
+    return 0;
+}
@@ -0,0 +1,449 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "myftp.h"
+
+/*
+ * io_uring data engine for fork-mode transfers.
+ *
+ * Each server process lazily sets up one ring with uring_depth registered
+ * buffers of URING_BLOCK_SIZE, so file reads and writes can be kept
+ * uring_depth deep on fast storage instead of one at a time.
+ *
+ *   GET: READ_FIXEDs into every free buffer; finished blocks go out in
+ *        file order as one linked chain of SENDs, so the socket never
+ *        sees them reordered.
+ *   PUT: a RECV linked to the WRITE_FIXED of the same buffer, so the
+ *        kernel starts the disk write without a round trip through here
+ *        while the next block is already being received.
+ *
+ * A short RECV/SEND breaks its link; the rest of the chain comes back
+ * -ECANCELED and is redone.  Each buffer keeps 4 bytes of headroom for a
+ * frame header, so framed GETs send header and payload in one SEND.
+ */
+
+enum { OP_READ, OP_SEND, OP_RECV, OP_WRITE };
+enum { BUF_FREE, BUF_READING, BUF_READY, BUF_SENDING, BUF_WRITING };
+
+#define URING_HEADROOM 4
+#define URING_DATA(op, b) (((uint64_t)(op) << 32) | (uint32_t)(b))
+
+struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending;
+    unsigned inflight;
+    char *buffers;
+};
+
+int uring_depth = 0;
+static struct uring ring = { -1 };
+static int ring_failed;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static char *uring_buffer(int b) {
+    return ring.buffers + (size_t)b * (URING_BLOCK_SIZE + URING_HEADROOM);
+}
+
+static int uring_setup(struct uring *u, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    u->fd = sys_io_uring_setup(entries, &p);
+    if (u->fd < 0) {
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    }
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+        /* Only reached once per process before falling back; the maps are small. */
+        close(u->fd);
+        u->fd = -1;
+        return -1;
+    }
+
+    u->entries = p.sq_entries;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->pending = 0;
+    u->inflight = 0;
+    return 0;
+}
+
+/* Every opcode the engine issues must be there, or transfers use the old path. */
+static int uring_supported(int fd) {
+    static const int ops[] = { IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_SEND, IORING_OP_RECV };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ok = probe != NULL && sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+int uring_probe(int depth) {
+    struct uring probe;
+
+    if (uring_setup(&probe, depth * 2) < 0) {
+        return -1;
+    }
+    int ok = uring_supported(probe.fd);
+    close(probe.fd);
+    if (!ok) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return 0;
+}
+
+int uring_ready(void) {
+    if (uring_depth <= 0 || ring_failed) {
+        return 0;
+    }
+    if (ring.fd >= 0) {
+        return 1;
+    }
+
+    /* Set up lazily, so every forked session gets a ring of its own. */
+    struct iovec iov[URING_MAX_DEPTH];
+    size_t size = (size_t)uring_depth * (URING_BLOCK_SIZE + URING_HEADROOM);
+    ring.buffers = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring.buffers == MAP_FAILED || uring_setup(&ring, uring_depth * 2) < 0) {
+        ring_failed = 1;
+        return 0;
+    }
+    for (int b = 0; b < uring_depth; b++) {
+        iov[b].iov_base = uring_buffer(b);
+        iov[b].iov_len = URING_BLOCK_SIZE + URING_HEADROOM;
+    }
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, iov, uring_depth) < 0) {
+        close(ring.fd);
+        ring.fd = -1;
+        ring_failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static struct io_uring_sqe *uring_sqe(int op, int b, int fd, void *addr, unsigned len) {
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+
+    /* Never more than two SQEs per buffer, and the ring has room for that. */
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op == OP_READ ? IORING_OP_READ_FIXED : op == OP_WRITE ? IORING_OP_WRITE_FIXED :
+                  op == OP_SEND ? IORING_OP_SEND : IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->user_data = URING_DATA(op, b);
+    if (op == OP_SEND || op == OP_RECV) {
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    } else {
+        sqe->buf_index = b;
+    }
+
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+    ring.inflight++;
+    return sqe;
+}
+
+/* Submits what is queued and waits for at least one completion. */
+static int uring_wait(void) {
+    while (1) {
+        int n = sys_io_uring_enter(ring.fd, ring.pending, 1, IORING_ENTER_GETEVENTS);
+        io_count(1, 0, 0);
+        if (n >= 0) {
+            ring.pending -= n;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static int uring_next_cqe(uint64_t *data, int *res) {
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    *data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+    ring.inflight--;
+    return 1;
+}
+
+/* Waits out whatever is still in flight so the buffers can be reused. */
+static void uring_drain(void) {
+    uint64_t data;
+    int res;
+    while (ring.inflight > 0 && uring_wait() == 0) {
+        while (uring_next_cqe(&data, &res)) {
+        }
+    }
+}
+
+int uring_send_file(int out_fd, int in_fd, off_t offset, int framed) {
+    int depth = uring_depth;
+    int state[URING_MAX_DEPTH] = { 0 };
+    uint32_t length[URING_MAX_DEPTH];
+    unsigned long chunk[URING_MAX_DEPTH];
+    unsigned long next_read = 0, next_send = 0, done = 0;
+    int sending = 0, error = 0;
+    struct stat st;
+
+    if (fstat(in_fd, &st) < 0) {
+        return -1;
+    }
+    unsigned long total = offset < st.st_size ? (st.st_size - offset + URING_BLOCK_SIZE - 1) / URING_BLOCK_SIZE : 0;
+
+    while (done < total && error == 0) {
+        while (next_read < total && next_read - done < (unsigned long)depth) {
+            int b = next_read % depth;
+            off_t pos = offset + (off_t)next_read * URING_BLOCK_SIZE;
+            length[b] = st.st_size - pos < URING_BLOCK_SIZE ? st.st_size - pos : URING_BLOCK_SIZE;
+            chunk[b] = next_read++;
+            state[b] = BUF_READING;
+            uring_sqe(OP_READ, b, in_fd, uring_buffer(b) + URING_HEADROOM, length[b])->off = pos;
+        }
+
+        if (sending == 0) {
+            struct io_uring_sqe *last = NULL;
+            while (next_send < next_read && state[next_send % depth] == BUF_READY) {
+                int b = next_send++ % depth;
+                char *p = uring_buffer(b) + (framed ? 0 : URING_HEADROOM);
+                if (framed) {
+                    uint32_t header = htonl(length[b]);
+                    memcpy(p, &header, sizeof(header));
+                }
+                shape_take(length[b]);
+                state[b] = BUF_SENDING;
+                sending++;
+                last = uring_sqe(OP_SEND, b, out_fd, p, length[b] + (framed ? URING_HEADROOM : 0));
+                last->flags = IOSQE_IO_LINK;
+            }
+            if (last != NULL) {
+                last->flags = 0;
+            }
+        }
+
+        if (uring_wait() < 0) {
+            error = errno;
+            break;
+        }
+
+        uint64_t data;
+        int res;
+        while (uring_next_cqe(&data, &res)) {
+            int b = (uint32_t)data;
+            uint32_t want = length[b] + (framed ? URING_HEADROOM : 0);
+            if (data >> 32 == OP_READ) {
+                if (res != (int)length[b]) {
+                    /* Error, or the file shrank under us. */
+                    error = res < 0 ? -res : EIO;
+                }
+                state[b] = BUF_READY;
+                continue;
+            }
+
+            sending--;
+            if (res == -ECANCELED) {
+                /* An earlier send in the chain came up short; send this one again. */
+                state[b] = BUF_READY;
+                if (chunk[b] < next_send) {
+                    next_send = chunk[b];
+                }
+                continue;
+            }
+            if (res < 0) {
+                error = -res;
+                continue;
+            }
+            char *p = uring_buffer(b) + (framed ? 0 : URING_HEADROOM);
+            if ((uint32_t)res < want && write_all(out_fd, p + res, want - res) < 0) {
+                error = errno;
+            }
+            io_count(0, 0, want);
+            state[b] = BUF_FREE;
+            done++;
+        }
+    }
+
+    uring_drain();
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return framed ? write_frame_header(out_fd, 0, 0) : 0;
+}
+
+int uring_receive_file(int file_fd, int sock_fd, int framed) {
+    int depth = uring_depth;
+    int state[URING_MAX_DEPTH] = { 0 };
+    uint32_t length[URING_MAX_DEPTH];
+    uint32_t short_len[URING_MAX_DEPTH];
+    off_t position[URING_MAX_DEPTH];
+    off_t offset = lseek(file_fd, 0, SEEK_CUR);
+    uint32_t frame_left = 0;
+    int eof = 0, error = 0;
+
+    if (offset < 0) {
+        offset = 0;
+    }
+
+    while (!eof && error == 0) {
+        if (framed && frame_left == 0) {
+            /* The previous RECV has completed, so the header is next on the socket. */
+            if (read_frame_header(sock_fd, &frame_left) < 0) {
+                error = errno != 0 ? errno : EPIPE;
+                break;
+            }
+            if (frame_left == 0) {
+                break;
+            }
+        }
+
+        int b = 0;
+        while (b < depth && state[b] != BUF_FREE) {
+            b++;
+        }
+        if (b < depth) {
+            length[b] = framed && frame_left < URING_BLOCK_SIZE ? frame_left : URING_BLOCK_SIZE;
+            position[b] = offset;
+            short_len[b] = 0;
+            shape_take(length[b]);
+            state[b] = BUF_WRITING;
+            uring_sqe(OP_RECV, b, sock_fd, uring_buffer(b), length[b])->flags = IOSQE_IO_LINK;
+            uring_sqe(OP_WRITE, b, file_fd, uring_buffer(b), length[b])->off = offset;
+        }
+
+        /* Wait for the RECV (or, with every buffer busy, for a WRITE to free one). */
+        int received = 0;
+        while (!received && error == 0) {
+            if (uring_wait() < 0) {
+                error = errno;
+                break;
+            }
+            uint64_t data;
+            int res;
+            while (uring_next_cqe(&data, &res)) {
+                int i = (uint32_t)data;
+                if (data >> 32 == OP_RECV) {
+                    received = 1;
+                    if (res < 0) {
+                        error = -res;
+                    } else if (res == 0) {
+                        /* End of a raw upload; inside a frame the client vanished. */
+                        eof = 1;
+                        error = framed ? EPIPE : 0;
+                    } else {
+                        if ((uint32_t)res < length[i]) {
+                            short_len[i] = res;
+                        }
+                        offset += res;
+                        frame_left -= framed ? res : 0;
+                        io_count(0, res, 0);
+                    }
+                } else if (res == -ECANCELED && short_len[i] > 0) {
+                    /* The short RECV broke the link: write what did arrive. */
+                    length[i] = short_len[i];
+                    short_len[i] = 0;
+                    uring_sqe(OP_WRITE, i, file_fd, uring_buffer(i), length[i])->off = position[i];
+                } else {
+                    if (res != -ECANCELED && res != (int)length[i]) {
+                        error = res < 0 ? -res : EIO;
+                    }
+                    state[i] = BUF_FREE;
+                    received |= b == depth;
+                }
+            }
+        }
+    }
+
+    /* Let the queued writes land, still checking each of them. */
+    while (ring.inflight > 0 && error == 0) {
+        uint64_t data;
+        int res;
+        if (uring_wait() < 0) {
+            error = errno;
+            break;
+        }
+        while (uring_next_cqe(&data, &res)) {
+            int i = (uint32_t)data;
+            if (res == -ECANCELED && short_len[i] > 0) {
+                length[i] = short_len[i];
+                short_len[i] = 0;
+                uring_sqe(OP_WRITE, i, file_fd, uring_buffer(i), length[i])->off = position[i];
+            } else if (res != -ECANCELED && res != (int)length[i]) {
+                error = res < 0 ? -res : EIO;
+            }
+        }
+    }
+    uring_drain();
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}